@@ -22,20 +22,49 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <linux/limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef MINIMAKE_TESTS
 #include "vendor/utest.h"
 #endif
 
+/*
+ * Built with -DMINIMAKE_USDT, minimake has static probes (provider "minimake") which bpftrace or perf can attach
+ * to in a running build, without rebuilding it; until they do, each is a single nop. See "Tracing" in the README.
+ * Names are passed as pointer and length, since they aren't NUL-terminated: str(arg0, arg1) in bpftrace.
+ */
+#ifdef MINIMAKE_USDT
+#include <sys/sdt.h>
+#define MM_PROBE(name, ...) STAP_PROBEV(minimake, name, __VA_ARGS__)
+#else
+#define MM_PROBE(name, ...) ((void)0)
+#endif
+
 typedef struct {
     _Bool ok;
     const char* message;
@@ -62,13 +91,162 @@ typedef struct {
     size_t n_dependencies;
     mm_sv commands[32];
     size_t n_commands;
+    /* 0 for rules as written, otherwise 1 + the index of the variant this copy is for, see minimake_instantiate_variants() */
+    size_t variant;
 } minimake_rule;
 
+/*
+ * Optional stat cache shared by all minimake processes running in the same directory, so that e.g. a test
+ * harness starting dozens of them doesn't stat the same headers dozens of times. It's an open-addressing
+ * table keyed by a hash of the path, living in a /dev/shm segment, which is read and written without locks:
+ * every slot has a sequence number which is odd while the slot is being written.
+ * A cached result is only valid for the generation it was made in. Every process bumps the generation after
+ * running commands (which may have changed any file), and the table starts from scratch whenever the first
+ * process attaches to it, so results never outlive the set of processes sharing them.
+ */
+#define MINIMAKE_STAT_CACHE_SLOTS (1u << 16)
+#define MINIMAKE_STAT_CACHE_PROBES 32
+
+typedef struct {
+    _Atomic uint64_t key; /* 0 if the slot is free */
+    _Atomic uint32_t seq;
+    _Atomic int32_t err; /* errno of the stat, or 0 if it succeeded */
+    _Atomic uint64_t generation;
+    _Atomic uint64_t dev;
+    _Atomic uint64_t ino;
+    _Atomic uint64_t size;
+    _Atomic int64_t mtime_sec;
+    _Atomic int64_t mtime_nsec;
+    _Atomic uint32_t mode;
+} mm_stat_slot;
+
+typedef struct {
+    _Atomic uint64_t generation;
+    mm_stat_slot slots[MINIMAKE_STAT_CACHE_SLOTS];
+} mm_stat_table;
+
+/* the page cache prefetcher, see minimake_prefetch() */
+typedef struct mm_prefetcher mm_prefetcher;
+
+/* a set of strings (which aren't copied), with open addressing */
+typedef struct {
+    mm_sv* slots;
+    size_t capacity;
+    size_t size;
+} mm_set;
+
+/*
+ * Where jobs may run, for --placement: the NUMA nodes, each with the CPUs of it we're allowed to use, and how
+ * many jobs are running on each, see minimake_place_job().
+ */
+#define MINIMAKE_MAX_NUMA_NODES 64
+
+typedef struct {
+    cpu_set_t cpus[MINIMAKE_MAX_NUMA_NODES];
+    size_t n_cpus[MINIMAKE_MAX_NUMA_NODES];
+    size_t jobs[MINIMAKE_MAX_NUMA_NODES];
+    size_t n_nodes;
+} mm_topology;
+
+/* a directory from VPATH (pattern.data is NULL), or from a vpath directive for names matching `pattern` */
+typedef struct {
+    mm_sv pattern;
+    mm_sv dir;
+} mm_vpath;
+
+/* the normalized cache, see minimake_significant_mtime() */
+typedef struct mm_normalize_cache mm_normalize_cache;
+
+/* a build of the makefile in a directory of its own, with settings of its own, see minimake_instantiate_variants() */
+typedef struct {
+    /* where its targets go, and its commands run */
+    const char* dir;
+    /* "NAME=VALUE" settings for the environment of its commands */
+    char** env;
+    size_t n_env;
+    size_t env_capacity;
+    /* where the makefile is, as an absolute path, for MINIMAKE_SRCDIR */
+    const char* source_dir;
+} mm_variant;
+
+typedef enum {
+    MINIMAKE_MODE_BUILD,
+    /* only print the commands which would run */
+    MINIMAKE_MODE_DRY_RUN,
+    /* only find out whether anything has to be made, see minimake.outdated */
+    MINIMAKE_MODE_QUESTION,
+    /* instead of running commands, mark targets as up to date by updating their mtime */
+    MINIMAKE_MODE_TOUCH,
+} minimake_mode;
+
+/* per-tree state which outlives a single invocation (e.g. the lock table) is kept in here */
+#define MINIMAKE_STATE_DIR ".minimake"
+
 typedef struct {
     minimake_rule* rules;
     size_t n_rules;
     void* (*alloc)(size_t);
     void (*free)(void*);
+    /* lock table shared with other minimake processes, opened on first use, -2 if unavailable */
+    int lock_fd;
+    /* shared stat cache, NULL unless enabled, with the file backing it, whose fd holds our lock on it */
+    mm_stat_table* stat_cache;
+    int stat_cache_fd;
+    char stat_cache_path[64];
+    /* started on first use, if prefetching is enabled */
+    mm_prefetcher* prefetcher;
+    _Bool prefetch;
+    /* intermediate targets made by this build, and the memory-backed directory they live in, see minimake_stage() */
+    mm_sv* staged;
+    size_t n_staged;
+    size_t staged_capacity;
+    char* staging_dir;
+    /* the device the tree is on, 0 until we looked, see minimake_remove_stale_stage() */
+    dev_t tree_dev;
+    minimake_mode mode;
+    /* targets made (or, in a dry run, which would have been made) by the current build */
+    mm_set made;
+    /* in MINIMAKE_MODE_QUESTION, set if the target isn't up to date */
+    _Bool outdated;
+    /* build log, with how long each target took to make, opened on first use, -2 if unavailable */
+    int log_fd;
+    /* whether any file is normalized, -1 until we looked, see minimake_find_normalizer() */
+    int normalizers;
+    /* loaded on first use */
+    mm_normalize_cache* normalize_cache;
+    /* how many commands may run at once */
+    size_t max_jobs;
+    /* after a failure, keep making whatever doesn't depend on the failed target, instead of cancelling everything */
+    _Bool keep_going;
+    /* if not 0, jobs taking longer than this many seconds are stopped, and fail; ".TIMEOUT_<n>" sets it per target */
+    unsigned timeout_s;
+    /* if not 0, warn about jobs taking this many times longer than they usually do, see minimake_check_deadlines() */
+    double straggler_factor;
+    /* and stop those, to run them again (once) */
+    _Bool retry_stragglers;
+    /* if set, report targets which took much longer than they usually do, after each build; see minimake_report_regressions() */
+    _Bool regressions;
+    /* and if set, write those to this file as well, one JSON object per line */
+    const char* regressions_file;
+    /* if not 0, sample CPU utilization at this interval (in ms) while building, and print it as a timeline */
+    unsigned cpu_timeline_ms;
+    /* if set, jobs are pinned to the CPUs of a NUMA node */
+    mm_topology* topology;
+    /* search path for dependencies, in makefile order, see minimake_apply_vpath() */
+    mm_vpath* vpaths;
+    size_t n_vpaths;
+    size_t vpaths_capacity;
+    /* paths dependencies were found at through the search path, which they now point to */
+    char** found_paths;
+    size_t n_found_paths;
+    /* if any, these are built instead of the makefile as it is, all at once, see minimake_instantiate_variants() */
+    mm_variant* variants;
+    size_t n_variants;
+    size_t variants_capacity;
+    /* names of the targets of the variants, which their rules point to */
+    char** variant_paths;
+    size_t n_variant_paths;
+    char* source_dir;
 } minimake;
 
 static const minimake_result minimake_result_ok = { .ok = 1, .message = "success", .context = "no context" };
@@ -76,17 +254,369 @@ static const minimake_result minimake_result_invalid_arguments = { .ok = 0, .mes
 
 minimake minimake_init(void* (*alloc)(size_t), void (*dealloc)(void*)) {
     minimake m;
+    memset(&m, 0, sizeof(m));
     m.alloc = alloc ? alloc : malloc;
     m.free = dealloc ? dealloc : free;
     m.rules = NULL;
+    m.lock_fd = -1;
+    m.stat_cache_fd = -1;
+    m.log_fd = -1;
+    m.normalizers = -1;
+    m.max_jobs = 1;
     return m;
 }
 
+static void minimake_stop_prefetcher(minimake* m);
+static void minimake_free_normalize_cache(minimake* m);
+
 void minimake_free(minimake* m) {
     if (m) {
+        minimake_stop_prefetcher(m);
         m->free(m->rules);
         m->rules = NULL;
+        if (m->vpaths) {
+            m->free(m->vpaths);
+        }
+        m->vpaths = NULL;
+        m->n_vpaths = 0;
+        for (size_t i = 0; i < m->n_found_paths; ++i) {
+            m->free(m->found_paths[i]);
+        }
+        if (m->found_paths) {
+            m->free(m->found_paths);
+        }
+        m->found_paths = NULL;
+        m->n_found_paths = 0;
+        for (size_t i = 0; i < m->n_variants; ++i) {
+            if (m->variants[i].env) {
+                m->free(m->variants[i].env);
+            }
+        }
+        if (m->variants) {
+            m->free(m->variants);
+        }
+        m->variants = NULL;
+        m->n_variants = 0;
+        for (size_t i = 0; i < m->n_variant_paths; ++i) {
+            m->free(m->variant_paths[i]);
+        }
+        if (m->variant_paths) {
+            m->free(m->variant_paths);
+        }
+        m->variant_paths = NULL;
+        m->n_variant_paths = 0;
+        if (m->source_dir) {
+            m->free(m->source_dir);
+        }
+        m->source_dir = NULL;
+        if (m->topology) {
+            m->free(m->topology);
+        }
+        m->topology = NULL;
+        if (m->lock_fd >= 0) {
+            close(m->lock_fd);
+        }
+        m->lock_fd = -1;
+        minimake_free_normalize_cache(m);
+        if (m->log_fd >= 0) {
+            close(m->log_fd);
+        }
+        m->log_fd = -1;
+        if (m->stat_cache) {
+            munmap(m->stat_cache, sizeof(mm_stat_table));
+        }
+        m->stat_cache = NULL;
+        if (m->stat_cache_fd >= 0) {
+            /* the table is 4.7MB of memory, so the last process using it removes it. one attaching right now
+            waits for our lock, and then uses its own copy, which the next build no longer shares */
+            if (flock(m->stat_cache_fd, LOCK_EX | LOCK_NB) == 0) {
+                unlink(m->stat_cache_path);
+            }
+            close(m->stat_cache_fd);
+        }
+        m->stat_cache_fd = -1;
+    }
+}
+
+/* FNV-1a, for when a target name needs to become a fixed-size key */
+static uint64_t minimake_hash(mm_sv sv) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sv.size; ++i) {
+        h ^= (unsigned char)sv.data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static int mm_sv_eq(mm_sv a, mm_sv b) {
+    return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+}
+
+static int mm_set_contains(mm_set* set, mm_sv sv) {
+    if (set->capacity == 0) {
+        return 0;
+    }
+    for (size_t i = minimake_hash(sv) & (set->capacity - 1); set->slots[i].data; i = (i + 1) & (set->capacity - 1)) {
+        if (mm_sv_eq(set->slots[i], sv)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* returns 1 if `sv` was added, 0 if it was already there, and -1 if we ran out of memory */
+static int mm_set_insert(minimake* m, mm_set* set, mm_sv sv) {
+    if (mm_set_contains(set, sv)) {
+        return 0;
+    }
+    /* keep it at most half full */
+    if ((set->size + 1) * 2 > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        mm_sv* slots = m->alloc(sizeof(mm_sv) * capacity);
+        if (!slots) {
+            return -1;
+        }
+        memset(slots, 0, sizeof(mm_sv) * capacity);
+        for (size_t j = 0; j < set->capacity; ++j) {
+            if (set->slots[j].data) {
+                size_t i = minimake_hash(set->slots[j]) & (capacity - 1);
+                while (slots[i].data) {
+                    i = (i + 1) & (capacity - 1);
+                }
+                slots[i] = set->slots[j];
+            }
+        }
+        if (set->slots) {
+            m->free(set->slots);
+        }
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+    size_t i = minimake_hash(sv) & (set->capacity - 1);
+    while (set->slots[i].data) {
+        i = (i + 1) & (set->capacity - 1);
+    }
+    set->slots[i] = sv;
+    ++set->size;
+    return 1;
+}
+
+static void mm_set_clear(minimake* m, mm_set* set) {
+    if (set->slots) {
+        m->free(set->slots);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+/* attaches to (or creates) the shared stat cache for the current directory */
+static minimake_result minimake_attach_stat_cache(minimake* m) {
+    char cwd[PATH_MAX];
+    char* path = m->stat_cache_path;
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "getcwd" };
+    }
+    snprintf(path, sizeof(m->stat_cache_path), "/dev/shm/minimake-%016llx", (unsigned long long)minimake_hash(minimake_cstr_stringview(cwd)));
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "opening stat cache" };
+    }
+    /* every attached process holds a shared lock, so if we get an exclusive one, nobody else uses the table
+    and whatever is in it may be stale. the locks are held until the fd is closed, in minimake_free() */
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(mm_stat_table)) < 0) {
+            close(fd);
+            return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "resizing stat cache" };
+        }
+        /* a generation of 0 would match all the zeroed slots */
+        mm_stat_table* table = mmap(NULL, sizeof(mm_stat_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (table != MAP_FAILED) {
+            atomic_store(&table->generation, 1);
+            munmap(table, sizeof(mm_stat_table));
+        }
+    }
+    if (flock(fd, LOCK_SH) < 0) {
+        close(fd);
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "locking stat cache" };
+    }
+    void* table = mmap(NULL, sizeof(mm_stat_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED) {
+        close(fd);
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "mapping stat cache" };
+    }
+    m->stat_cache = table;
+    m->stat_cache_fd = fd;
+    return minimake_result_ok;
+}
+
+/* invalidates everything in the shared stat cache, needed whenever files may have changed */
+static void minimake_stat_cache_invalidate(minimake* m) {
+    if (m->stat_cache) {
+        atomic_fetch_add_explicit(&m->stat_cache->generation, 1, memory_order_acq_rel);
+    }
+}
+
+/* stat(2), but answered from the shared stat cache if possible */
+static int minimake_stat(minimake* m, const char* path, struct stat* st) {
+    if (!m->stat_cache) {
+        return stat(path, st);
+    }
+    mm_stat_table* table = m->stat_cache;
+    uint64_t key = minimake_hash(minimake_cstr_stringview(path)) | 1;
+    uint64_t generation = atomic_load_explicit(&table->generation, memory_order_acquire);
+    for (uint64_t probe = 0; probe < MINIMAKE_STAT_CACHE_PROBES; ++probe) {
+        mm_stat_slot* slot = &table->slots[(key + probe) & (MINIMAKE_STAT_CACHE_SLOTS - 1)];
+        uint64_t slot_key = atomic_load_explicit(&slot->key, memory_order_acquire);
+        if (slot_key == 0) {
+            /* claim it; if someone else was faster, slot_key now holds their key */
+            if (atomic_compare_exchange_strong(&slot->key, &slot_key, key)) {
+                slot_key = key;
+            }
+        }
+        if (slot_key != key) {
+            continue;
+        }
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq % 2 == 0 && atomic_load_explicit(&slot->generation, memory_order_relaxed) == generation) {
+            int err = atomic_load_explicit(&slot->err, memory_order_relaxed);
+            memset(st, 0, sizeof(*st));
+            st->st_dev = atomic_load_explicit(&slot->dev, memory_order_relaxed);
+            st->st_ino = atomic_load_explicit(&slot->ino, memory_order_relaxed);
+            st->st_size = atomic_load_explicit(&slot->size, memory_order_relaxed);
+            st->st_mtim.tv_sec = atomic_load_explicit(&slot->mtime_sec, memory_order_relaxed);
+            st->st_mtim.tv_nsec = atomic_load_explicit(&slot->mtime_nsec, memory_order_relaxed);
+            st->st_mode = atomic_load_explicit(&slot->mode, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) {
+                if (err) {
+                    errno = err;
+                    return -1;
+                }
+                return 0;
+            }
+        }
+        /* miss (or torn read), so stat for real and publish the result, unless someone else is writing */
+        int rc = stat(path, st);
+        int err = rc < 0 ? errno : 0;
+        if (seq % 2 == 0 && atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1)) {
+            atomic_store_explicit(&slot->err, err, memory_order_relaxed);
+            atomic_store_explicit(&slot->generation, generation, memory_order_relaxed);
+            atomic_store_explicit(&slot->dev, rc < 0 ? 0 : st->st_dev, memory_order_relaxed);
+            atomic_store_explicit(&slot->ino, rc < 0 ? 0 : st->st_ino, memory_order_relaxed);
+            atomic_store_explicit(&slot->size, rc < 0 ? 0 : st->st_size, memory_order_relaxed);
+            atomic_store_explicit(&slot->mtime_sec, rc < 0 ? 0 : st->st_mtim.tv_sec, memory_order_relaxed);
+            atomic_store_explicit(&slot->mtime_nsec, rc < 0 ? 0 : st->st_mtim.tv_nsec, memory_order_relaxed);
+            atomic_store_explicit(&slot->mode, rc < 0 ? 0 : st->st_mode, memory_order_relaxed);
+            atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+        }
+        errno = err;
+        return rc;
+    }
+    /* too crowded around this key, don't bother */
+    return stat(path, st);
+}
+
+/*
+ * On a cold page cache, every command starts by waiting for the disk to deliver its sources. The prefetcher is
+ * a low priority thread which asks the kernel to read the inputs of targets we will get to soon, while the current
+ * command is still running. It's purely speculative: if the queue is full, paths are dropped, and errors are ignored.
+ * It's opt-in (--prefetch): so far, measured builds from a cold cache were no faster with it.
+ */
+#define MINIMAKE_PREFETCH_QUEUE 256
+/* how many chain entries ahead of the current one we prefetch for */
+#define MINIMAKE_PREFETCH_LOOKAHEAD 8
+
+struct mm_prefetcher {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char* queue[MINIMAKE_PREFETCH_QUEUE];
+    size_t head;
+    size_t n_queued;
+    _Bool stop;
+};
+
+static void* minimake_prefetch_thread(void* arg) {
+    mm_prefetcher* p = arg;
+    (void)setpriority(PRIO_PROCESS, 0, 19);
+    /* IOPRIO_WHO_PROCESS of 0 is the calling thread; IOPRIO_CLASS_IDLE */
+    (void)syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && p->n_queued == 0) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        if (p->stop) {
+            break;
+        }
+        char* path = p->queue[p->head];
+        p->head = (p->head + 1) % MINIMAKE_PREFETCH_QUEUE;
+        --p->n_queued;
+        pthread_mutex_unlock(&p->lock);
+        int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd >= 0) {
+            (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+        free(path);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* queues `path` to be read into the page cache in the background */
+static void minimake_prefetch(minimake* m, mm_sv path) {
+    if (!m->prefetch) {
+        return;
+    }
+    if (!m->prefetcher) {
+        mm_prefetcher* p = calloc(1, sizeof(mm_prefetcher));
+        if (!p) {
+            m->prefetch = 0;
+            return;
+        }
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->wake, NULL);
+        if (pthread_create(&p->thread, NULL, minimake_prefetch_thread, p) != 0) {
+            free(p);
+            m->prefetch = 0;
+            return;
+        }
+        m->prefetcher = p;
+    }
+    mm_prefetcher* p = m->prefetcher;
+    char* copy = strndup(path.data, path.size);
+    if (!copy) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->n_queued < MINIMAKE_PREFETCH_QUEUE) {
+        p->queue[(p->head + p->n_queued) % MINIMAKE_PREFETCH_QUEUE] = copy;
+        ++p->n_queued;
+        copy = NULL;
+        pthread_cond_signal(&p->wake);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(copy);
+}
+
+static void minimake_stop_prefetcher(minimake* m) {
+    mm_prefetcher* p = m->prefetcher;
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    for (size_t i = 0; i < p->n_queued; ++i) {
+        free(p->queue[(p->head + i) % MINIMAKE_PREFETCH_QUEUE]);
     }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p);
+    m->prefetcher = NULL;
 }
 
 static minimake_result minimake_read_makefile(minimake* m, const char* makefile, char** buffer, size_t* size) {
@@ -158,6 +688,7 @@ static minimake_result minimake_tokenize(minimake* m, const char* buffer, minima
     minimake_token* new_tokens = NULL;
     minimake_result result = minimake_result_ok;
     const char* p = buffer;
+    MM_PROBE(tokenize__start, buffer);
     *ptokens = m->alloc(sizeof(minimake_token) * max_tokens);
     if (!*ptokens) {
         result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating tokens" };
@@ -236,13 +767,15 @@ static minimake_result minimake_tokenize(minimake* m, const char* buffer, minima
         }
 
         if (*n_tokens == max_tokens) {
+            size_t old_max_tokens = max_tokens;
             max_tokens = max_tokens * 1.5;
             new_tokens = m->alloc(sizeof(minimake_token) * max_tokens);
             if (!new_tokens) {
                 result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating tokens" };
                 goto cleanup;
             }
-            memcpy(new_tokens, *ptokens, sizeof(minimake_token) * max_tokens);
+            memset(new_tokens, 0, sizeof(minimake_token) * max_tokens);
+            memcpy(new_tokens, *ptokens, sizeof(minimake_token) * old_max_tokens);
             m->free(*ptokens);
             *ptokens = new_tokens;
             new_tokens = NULL;
@@ -253,6 +786,7 @@ cleanup:
     if (new_tokens) {
         m->free(new_tokens);
     }
+    MM_PROBE(tokenize__done, *n_tokens, result.ok);
     return result;
 }
 
@@ -288,10 +822,127 @@ static char ERR_BUF[8196];
         }                                                               \
     } while (0)
 
+static mm_sv minimake_token_sv(minimake_token* token) {
+    return (mm_sv) { .data = token->start, .size = token->end - token->start };
+}
+
+/*
+ * Whether the line starting at token i sets the search path, rather than being a rule:
+ * "VPATH = dir...", with "+=" or ":=" also allowed, or "vpath [pattern [dir...]]".
+ */
+static int minimake_is_search_path(minimake_token* tokens, size_t n_tokens, size_t i) {
+    if (i >= n_tokens || tokens[i].type != MINIMAKE_TOK_WORD) {
+        return 0;
+    }
+    mm_sv word = minimake_token_sv(&tokens[i]);
+    if (mm_sv_eq(word, minimake_cstr_stringview("vpath"))) {
+        /* "vpath: ..." is a rule for a file called vpath */
+        return i + 1 >= n_tokens || tokens[i + 1].type != MINIMAKE_TOK_COLON;
+    }
+    if (word.size < 5 || memcmp(word.data, "VPATH", 5) != 0) {
+        return 0;
+    }
+    if (word.size > 5) {
+        return word.data[5] == '=' || (word.size > 6 && word.data[5] == '+' && word.data[6] == '=');
+    }
+    size_t next = i + 1;
+    if (next < n_tokens && tokens[next].type == MINIMAKE_TOK_COLON) {
+        ++next;
+    }
+    if (next >= n_tokens || tokens[next].type != MINIMAKE_TOK_WORD) {
+        return 0;
+    }
+    word = minimake_token_sv(&tokens[next]);
+    return word.data[0] == '=' || (word.size > 1 && word.data[0] == '+' && word.data[1] == '=');
+}
+
+static minimake_result minimake_add_vpath(minimake* m, mm_sv pattern, mm_sv dir) {
+    if (m->n_vpaths == m->vpaths_capacity) {
+        size_t capacity = m->vpaths_capacity ? m->vpaths_capacity * 2 : 8;
+        mm_vpath* vpaths = m->alloc(sizeof(mm_vpath) * capacity);
+        if (!vpaths) {
+            return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating search path" };
+        }
+        if (m->vpaths) {
+            memcpy(vpaths, m->vpaths, sizeof(mm_vpath) * m->n_vpaths);
+            m->free(m->vpaths);
+        }
+        m->vpaths = vpaths;
+        m->vpaths_capacity = capacity;
+    }
+    m->vpaths[m->n_vpaths++] = (mm_vpath) { .pattern = pattern, .dir = dir };
+    return minimake_result_ok;
+}
+
+/* drops the directories of VPATH (if `pattern` is NULL), of vpath directives for `pattern`, or of all of them */
+static void minimake_remove_vpaths(minimake* m, const mm_sv* pattern, _Bool all_patterns) {
+    size_t kept = 0;
+    for (size_t j = 0; j < m->n_vpaths; ++j) {
+        mm_vpath* vpath = &m->vpaths[j];
+        int remove = pattern ? vpath->pattern.data && mm_sv_eq(vpath->pattern, *pattern)
+                             : (all_patterns ? vpath->pattern.data != NULL : vpath->pattern.data == NULL);
+        if (!remove) {
+            m->vpaths[kept++] = *vpath;
+        }
+    }
+    m->n_vpaths = kept;
+}
+
+/*
+ * Parses a line minimake_is_search_path() said sets the search path. Like in make, directories are separated
+ * by colons or blanks; words of the line are separate tokens either way.
+ */
+static minimake_result minimake_parse_search_path(minimake* m, minimake_token* tokens, size_t n_tokens, size_t* i) {
+    mm_sv word = minimake_token_sv(&tokens[(*i)++]);
+    mm_sv pattern = { .data = NULL, .size = 0 };
+    mm_sv first = { .data = NULL, .size = 0 };
+    if (word.data[0] == 'v') {
+        if (*i < n_tokens && tokens[*i].type == MINIMAKE_TOK_WORD) {
+            pattern = minimake_token_sv(&tokens[(*i)++]);
+        }
+        /* a directive without directories forgets those given for the pattern before, or for all patterns */
+        if (*i >= n_tokens || (tokens[*i].type != MINIMAKE_TOK_WORD && tokens[*i].type != MINIMAKE_TOK_COLON)) {
+            minimake_remove_vpaths(m, pattern.data ? &pattern : NULL, 1);
+        }
+    } else {
+        /* the assignment operator either ends "VPATH", or starts the next word, after the ':' of ":=" */
+        if (word.size > 5) {
+            first = (mm_sv) { .data = word.data + 5, .size = word.size - 5 };
+        } else {
+            if (tokens[*i].type == MINIMAKE_TOK_COLON) {
+                ++*i;
+            }
+            first = minimake_token_sv(&tokens[(*i)++]);
+        }
+        if (first.data[0] == '+') {
+            ++first.data;
+            --first.size;
+        } else {
+            minimake_remove_vpaths(m, NULL, 0);
+        }
+        ++first.data;
+        --first.size;
+    }
+    minimake_result result = minimake_result_ok;
+    if (first.size > 0) {
+        result = minimake_add_vpath(m, pattern, first);
+    }
+    while (result.ok && *i < n_tokens && (tokens[*i].type == MINIMAKE_TOK_WORD || tokens[*i].type == MINIMAKE_TOK_COLON)) {
+        minimake_token* token = &tokens[(*i)++];
+        if (token->type == MINIMAKE_TOK_WORD) {
+            result = minimake_add_vpath(m, pattern, minimake_token_sv(token));
+        }
+    }
+    return result;
+}
+
+static minimake_result minimake_apply_vpath(minimake* m);
+
 minimake_result minimake_parse(minimake* m, const char* makefile, char* buffer) {
     minimake_token* tokens = NULL;
     size_t n_tokens = 0;
 
+    MM_PROBE(parse__start, makefile);
     minimake_result result = minimake_tokenize(m, buffer, &tokens, &n_tokens);
     if (!result.ok) {
         goto cleanup;
@@ -308,23 +959,31 @@ minimake_result minimake_parse(minimake* m, const char* makefile, char* buffer)
 
     for (m->n_rules = 0; i < n_tokens; ++m->n_rules) {
         /* quick and dirty realloc :^) */
-        if (m->n_rules > rules_capacity) {
+        if (m->n_rules == rules_capacity) {
             rules_capacity *= 2;
             minimake_rule* new_rules = m->alloc(sizeof(minimake_rule) * rules_capacity);
             if (!new_rules) {
                 result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating rules" };
                 goto cleanup;
             }
-            memcpy(new_rules, m->rules, sizeof(minimake_rule) * rules_capacity);
+            memset(new_rules, 0, sizeof(minimake_rule) * rules_capacity);
+            memcpy(new_rules, m->rules, sizeof(minimake_rule) * m->n_rules);
             m->free(m->rules);
             m->rules = new_rules;
         }
 
         minimake_rule* rule = &m->rules[m->n_rules];
 
-        /* special case where we have multiple newlines between rules */
-        while (tokens[i].type == MINIMAKE_TOK_NEWLINE && i < n_tokens) {
-            ++i;
+        /* special case where we have multiple newlines between rules, and lines setting the search path */
+        while (i < n_tokens && (tokens[i].type == MINIMAKE_TOK_NEWLINE || minimake_is_search_path(tokens, n_tokens, i))) {
+            if (tokens[i].type == MINIMAKE_TOK_NEWLINE) {
+                ++i;
+                continue;
+            }
+            result = minimake_parse_search_path(m, tokens, n_tokens, &i);
+            if (!result.ok) {
+                goto cleanup;
+            }
         }
         if (i >= n_tokens) {
             break;
@@ -360,11 +1019,6 @@ minimake_result minimake_parse(minimake* m, const char* makefile, char* buffer)
             goto cleanup;
         }
 
-        if (tokens[i].type == MINIMAKE_TOK_NEWLINE) {
-            MINIMAKE_ERR_EXPECTED(tokens[i], "command(s)");
-            result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "no context" };
-            goto cleanup;
-        }
         while (tokens[i].type == MINIMAKE_TOK_COMMAND && i < n_tokens) {
             if (rule->n_commands == 128) {
                 result = (minimake_result) { .ok = 0, .message = "too many commands", .context = "no context" };
@@ -381,11 +1035,15 @@ minimake_result minimake_parse(minimake* m, const char* makefile, char* buffer)
             ++rule->n_commands;
         }
     }
+    if (m->n_vpaths > 0) {
+        result = minimake_apply_vpath(m);
+    }
 
 cleanup:
     if (tokens) {
         m->free(tokens);
     }
+    MM_PROBE(parse__done, makefile, m->n_rules, result.ok);
     return result;
 }
 
@@ -393,6 +1051,7 @@ minimake_result minimake_resolve(minimake* m, mm_sv target, mm_sv** result_chain
     *result_chain = NULL;
     *result_chain_len = 0;
     minimake_result result = minimake_result_ok;
+    MM_PROBE(resolve__start, target.data, target.size);
 
     /* We initialize a chain (array) of targets, which will be our *inverted* todo list of targets to check.
     "Inverted" meaning that it starts with the target we want, and the following elements are sort of a flat
@@ -435,7 +1094,7 @@ minimake_result minimake_resolve(minimake* m, mm_sv target, mm_sv** result_chain
                             result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating chain" };
                             goto cleanup;
                         }
-                        memcpy(new_chain, chain, sizeof(mm_sv) * chain_capacity);
+                        memcpy(new_chain, chain, sizeof(mm_sv) * n_chain);
                         m->free(chain);
                         chain = new_chain;
                     }
@@ -453,343 +1112,6219 @@ cleanup:
         m->free(chain);
     }
 
+    MM_PROBE(resolve__done, target.data, target.size, *result_chain_len, result.ok);
     return result;
 }
 
-minimake_result minimake_make(minimake* m, mm_sv* target, char** cmd, size_t* cmd_capacity) {
-    int found = 0;
+/*
+ * The dependency graph, indexed: every distinct name, target or not, is a node, and for every node we have
+ * its dependencies and its users (the targets depending on it), each stored compactly in one array.
+ * Unlike the chain, this answers questions about the whole makefile without scanning all rules each time.
+ * Special targets (like .INTERMEDIATE) are not part of it, except for the goal of a build of variants.
+ */
+#define MM_NODE_HAS_RULE 1
+#define MM_NODE_HAS_COMMANDS 2
+/* the goal of a build of variants, which is done when they are, see minimake_instantiate_variants() */
+#define MM_NODE_VARIANTS 4
+
+#define MINIMAKE_VARIANTS_TARGET ".VARIANTS"
+
+typedef struct {
+    mm_sv* names;
+    uint8_t* flags;
+    size_t n_nodes;
+    /* the dependencies of node i are deps[deps_start[i]] up to deps[deps_start[i + 1]] */
+    size_t* deps_start;
+    size_t* deps;
+    /* likewise for users */
+    size_t* users_start;
+    size_t* users;
+    /* open-addressing name -> node table, SIZE_MAX for free slots */
+    size_t* index;
+    size_t index_capacity;
+} minimake_graph;
+
+size_t minimake_graph_find(minimake_graph* g, mm_sv name) {
+    for (size_t i = minimake_hash(name) & (g->index_capacity - 1); g->index[i] != SIZE_MAX; i = (i + 1) & (g->index_capacity - 1)) {
+        if (mm_sv_eq(g->names[g->index[i]], name)) {
+            return g->index[i];
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t minimake_graph_add(minimake_graph* g, mm_sv name) {
+    size_t i = minimake_hash(name) & (g->index_capacity - 1);
+    for (; g->index[i] != SIZE_MAX; i = (i + 1) & (g->index_capacity - 1)) {
+        if (mm_sv_eq(g->names[g->index[i]], name)) {
+            return g->index[i];
+        }
+    }
+    g->names[g->n_nodes] = name;
+    g->index[i] = g->n_nodes;
+    return g->n_nodes++;
+}
+
+void minimake_graph_free(minimake* m, minimake_graph* g) {
+    void* arrays[] = { g->names, g->flags, g->deps_start, g->deps, g->users_start, g->users, g->index };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); ++i) {
+        if (arrays[i]) {
+            m->free(arrays[i]);
+        }
+    }
+    memset(g, 0, sizeof(*g));
+}
+
+static int minimake_is_special_target(mm_sv target) {
+    return target.size > 0 && target.data[0] == '.';
+}
+
+/* whether a rule's target is part of the graph */
+static int minimake_is_graph_target(mm_sv target) {
+    return !minimake_is_special_target(target) || mm_sv_eq(target, minimake_cstr_stringview(MINIMAKE_VARIANTS_TARGET));
+}
+
+minimake_result minimake_graph_build(minimake* m, minimake_graph* g) {
+    memset(g, 0, sizeof(*g));
+    size_t max_nodes = 1;
+    size_t n_edges = 0;
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        max_nodes += 1 + m->rules[j].n_dependencies;
+        n_edges += m->rules[j].n_dependencies;
+    }
+    g->index_capacity = 1;
+    while (g->index_capacity < max_nodes * 2) {
+        g->index_capacity *= 2;
+    }
+    g->names = m->alloc(sizeof(mm_sv) * max_nodes);
+    g->flags = m->alloc(max_nodes);
+    g->deps_start = m->alloc(sizeof(size_t) * (max_nodes + 1));
+    g->deps = m->alloc(sizeof(size_t) * (n_edges + 1));
+    g->users_start = m->alloc(sizeof(size_t) * (max_nodes + 1));
+    g->users = m->alloc(sizeof(size_t) * (n_edges + 1));
+    g->index = m->alloc(sizeof(size_t) * g->index_capacity);
+    if (!g->names || !g->flags || !g->deps_start || !g->deps || !g->users_start || !g->users || !g->index) {
+        minimake_graph_free(m, g);
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating graph" };
+    }
+    memset(g->flags, 0, max_nodes);
+    memset(g->deps_start, 0, sizeof(size_t) * (max_nodes + 1));
+    memset(g->users_start, 0, sizeof(size_t) * (max_nodes + 1));
+    memset(g->index, 0xff, sizeof(size_t) * g->index_capacity);
+
+    /* count edges per node first (shifted by one, so the prefix sum turns them into start offsets) */
     for (size_t j = 0; j < m->n_rules; ++j) {
         minimake_rule* rule = &m->rules[j];
-        if (rule->target.size == target->size && memcmp(rule->target.data, target->data, target->size) == 0) {
-            found = 1;
-            for (size_t k = 0; k < rule->n_commands; ++k) {
-                if (*cmd_capacity < rule->commands[k].size + 1) {
-                    *cmd_capacity = rule->commands[k].size + 1;
-                    m->free(*cmd);
-                    *cmd = m->alloc(*cmd_capacity);
-                    memset(*cmd, 0, *cmd_capacity);
-                }
-                memcpy(*cmd, rule->commands[k].data, rule->commands[k].size);
-                printf("%s\n", *cmd);
-                if (system(*cmd) != 0) {
-                    sprintf(ERR_BUF, "command \"%.*s\" failed", (int)rule->commands[k].size, rule->commands[k].data);
-                    return (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "command" };
-                }
-            }
+        if (!minimake_is_graph_target(rule->target)) {
+            continue;
+        }
+        size_t t = minimake_graph_add(g, rule->target);
+        g->flags[t] |= MM_NODE_HAS_RULE | (rule->n_commands ? MM_NODE_HAS_COMMANDS : 0);
+        g->flags[t] |= minimake_is_special_target(rule->target) ? MM_NODE_VARIANTS : 0;
+        g->deps_start[t + 1] += rule->n_dependencies;
+        for (size_t k = 0; k < rule->n_dependencies; ++k) {
+            g->users_start[minimake_graph_add(g, rule->dependencies[k]) + 1] += 1;
         }
     }
-    if (!found) {
-        sprintf(ERR_BUF, "no rule to make \"%.*s\"", (int)target->size, target->data);
-        return (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "no context" };
+    for (size_t i = 0; i < g->n_nodes; ++i) {
+        g->deps_start[i + 1] += g->deps_start[i];
+        g->users_start[i + 1] += g->users_start[i];
+    }
+    /* then fill them in, using the start offsets of the next node as cursors, and shift them back */
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        if (!minimake_is_graph_target(rule->target)) {
+            continue;
+        }
+        size_t t = minimake_graph_find(g, rule->target);
+        for (size_t k = 0; k < rule->n_dependencies; ++k) {
+            size_t d = minimake_graph_find(g, rule->dependencies[k]);
+            g->deps[g->deps_start[t]++] = d;
+            g->users[g->users_start[d]++] = t;
+        }
     }
+    for (size_t i = g->n_nodes; i > 0; --i) {
+        g->deps_start[i] = g->deps_start[i - 1];
+        g->users_start[i] = g->users_start[i - 1];
+    }
+    g->deps_start[0] = 0;
+    g->users_start[0] = 0;
     return minimake_result_ok;
 }
 
-minimake_result minimake_execute_chain(minimake* m, mm_sv* chain, size_t chain_len) {
-    char filename[PATH_MAX];
-    size_t cmd_capacity = 0;
-    char* cmd = NULL;
+/* what we know about a directory the search path made us look into, see minimake_dir_contains() */
+typedef struct {
+    char* path;
+    unsigned lookups;
+    _Bool listed;
+    /* once listed, the names in it, pointing into `listing` */
+    char* listing;
+    mm_set names;
+} mm_dir_cache;
+
+typedef struct {
+    mm_dir_cache* dirs;
+    size_t n_dirs;
+    size_t capacity;
+} mm_dir_caches;
+
+/* reads all names in the directory at once; a directory we can't read is simply empty */
+static minimake_result minimake_list_dir(minimake* m, mm_dir_cache* dir) {
+    dir->listed = 1;
+    DIR* d = opendir(dir->path);
+    if (!d) {
+        return minimake_result_ok;
+    }
     minimake_result result = minimake_result_ok;
-    memset(ERR_BUF, 0, sizeof(ERR_BUF));
-    memset(filename, 0, sizeof(filename));
-    for (ssize_t i = chain_len - 1; i > -1; --i) {
-        /* 1. check if that file exists */
-        if (chain[i].size >= PATH_MAX) {
-            result = (minimake_result) { .ok = 0, .message = "path too long", .context = "target" };
-            goto cleanup;
-        }
-        memcpy(filename, chain[i].data, chain[i].size);
-        filename[chain[i].size] = 0;
-        struct stat st;
-        if (stat(filename, &st) < 0) {
-            switch (errno) {
-            case ENOENT: {
-                /* 2a. if it doesn't exist, execute the commands */
-                minimake_result make_result = minimake_make(m, &chain[i], &cmd, &cmd_capacity);
-                if (!make_result.ok) {
-                    result = make_result;
-                    goto cleanup;
-                }
-                /* check that the rule succeeded by doing another stat */
-                if (stat(filename, &st) < 0) {
-                    sprintf(ERR_BUF, "rule \"%.*s\" should have created \"%s\", but after running the rule, minimake checked, and got the error: %s", (int)chain[i].size, chain[i].data, filename, strerror(errno));
-                    make_result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "stat" };
-                    goto cleanup;
-                }
-                break;
+    size_t size = 0;
+    size_t capacity = 4096;
+    dir->listing = m->alloc(capacity);
+    for (struct dirent* entry; dir->listing && (entry = readdir(d));) {
+        size_t len = strlen(entry->d_name) + 1;
+        if (size + len > capacity) {
+            while (size + len > capacity) {
+                capacity *= 2;
             }
-            default:
-                sprintf(ERR_BUF, "error determining if \"%s\" exists: %s", filename, strerror(errno));
-                result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "stat" };
-                goto cleanup;
+            char* listing = m->alloc(capacity);
+            if (listing) {
+                memcpy(listing, dir->listing, size);
             }
-        } else {
-            char dep_filename[PATH_MAX];
-            /* 2b. does exist, check that the modified time of all dependencies is older than the target's modification time */
-            /* at this point, all dependencies are guaranteed to exist */
-            for (size_t rule_i = 0; rule_i < m->n_rules; ++rule_i) {
-                if (m->rules[rule_i].target.size == chain[i].size && memcmp(m->rules[rule_i].target.data, chain[i].data, chain[i].size) == 0) {
-                    int rebuilt = 0;
-                    /* check dependencies */
-                    for (size_t k = 0; !rebuilt && k < m->rules[rule_i].n_dependencies; ++k) {
-                        if (m->rules[i].dependencies[k].size >= PATH_MAX) {
-                            result = (minimake_result) { .ok = 0, .message = "path too long", .context = "dependency" };
-                            goto cleanup;
-                        }
-                        memcpy(dep_filename, m->rules[rule_i].dependencies[k].data, m->rules[rule_i].dependencies[k].size);
-                        dep_filename[m->rules[rule_i].dependencies[k].size] = 0;
-                        struct stat dep_st;
-                        if (stat(dep_filename, &dep_st) < 0) {
-                            result = (minimake_result) { .ok = 0, .message = "dependency not satisfied when it should be guaranteed, is something else modifying the filesystem?", .context = "dependency" };
-                            goto cleanup;
-                        }
-                        /* compare dependency mtime to target mtime, if target mtime < dependency mtime, make target again */
-                        if (st.st_mtim.tv_sec < dep_st.st_mtim.tv_sec) {
-                            minimake_result make_result = minimake_make(m, &chain[i], &cmd, &cmd_capacity);
-                            if (!make_result.ok) {
-                                make_result.context = "rebuild due to mtime";
-                                result = make_result;
-                                goto cleanup;
-                            }
-                            rebuilt = 1;
-                            break;
-                        }
-                    }
-                    break;
-                }
+            m->free(dir->listing);
+            dir->listing = listing;
+            if (!listing) {
+                break;
             }
         }
+        memcpy(dir->listing + size, entry->d_name, len);
+        size += len;
     }
-    if (!cmd) {
-        /* no work has been done! */
-        printf("\"%.*s\" is up to date\n", (int)chain[0].size, chain[0].data);
+    closedir(d);
+    if (!dir->listing) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "listing directory" };
     }
-cleanup:
-    if (cmd) {
-        m->free(cmd);
+    /* only now that the listing doesn't move any more */
+    for (size_t i = 0; i < size && result.ok;) {
+        mm_sv name = minimake_cstr_stringview(dir->listing + i);
+        if (mm_set_insert(m, &dir->names, name) < 0) {
+            result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "listing directory" };
+        }
+        i += name.size + 1;
     }
     return result;
 }
 
-#ifndef MINIMAKE_TESTS
-
-int main(int argc, char** argv) {
-    memset(ERR_BUF, 0, sizeof(ERR_BUF));
-    minimake m = minimake_init(NULL, NULL);
-
-    char* buffer = NULL;
-    size_t size = 0;
-    minimake_result result = minimake_read_makefile(&m, "Makefile", &buffer, &size);
-    if (!result.ok) {
-        printf("ERROR: %s (%s)\n", result.message, result.context);
-        return 1;
+/*
+ * Whether `path` exists, answered from a listing of its directory. The first question about a directory is
+ * answered with a stat, since listing it costs more than that; after that, it's listed once, and everything
+ * else about it, found or not, is answered without a syscall.
+ */
+static minimake_result minimake_dir_contains(minimake* m, mm_dir_caches* caches, const char* path, int* exists) {
+    const char* slash = strrchr(path, '/');
+    const char* base = slash ? slash + 1 : path;
+    size_t dir_len = slash ? (size_t)(slash - path) : 0;
+    const char* dir_path = slash ? path : ".";
+    if (!slash) {
+        dir_len = 1;
+    } else if (dir_len == 0) {
+        dir_len = 1; /* the root directory */
     }
-    buffer[size] = 0;
-    result = minimake_parse(&m, "Minimakefile", buffer);
-    if (!result.ok) {
-        printf("ERROR: %s (%s)\n", result.message, result.context);
-        return 1;
+    mm_dir_cache* dir = NULL;
+    for (size_t j = 0; j < caches->n_dirs; ++j) {
+        if (strlen(caches->dirs[j].path) == dir_len && memcmp(caches->dirs[j].path, dir_path, dir_len) == 0) {
+            dir = &caches->dirs[j];
+            break;
+        }
     }
+    if (!dir) {
+        if (caches->n_dirs == caches->capacity) {
+            size_t capacity = caches->capacity ? caches->capacity * 2 : 8;
+            mm_dir_cache* dirs = m->alloc(sizeof(mm_dir_cache) * capacity);
+            if (!dirs) {
+                return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating directory cache" };
+            }
+            if (caches->dirs) {
+                memcpy(dirs, caches->dirs, sizeof(mm_dir_cache) * caches->n_dirs);
+                m->free(caches->dirs);
+            }
+            caches->dirs = dirs;
+            caches->capacity = capacity;
+        }
+        dir = &caches->dirs[caches->n_dirs];
+        memset(dir, 0, sizeof(*dir));
+        dir->path = m->alloc(dir_len + 1);
+        if (!dir->path) {
+            return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating directory cache" };
+        }
+        memcpy(dir->path, dir_path, dir_len);
+        dir->path[dir_len] = 0;
+        ++caches->n_dirs;
+    }
+    if (!dir->listed && dir->lookups++ == 0) {
+        struct stat st;
+        *exists = stat(path, &st) == 0;
+        return minimake_result_ok;
+    }
+    if (!dir->listed) {
+        minimake_result result = minimake_list_dir(m, dir);
+        if (!result.ok) {
+            return result;
+        }
+    }
+    *exists = mm_set_contains(&dir->names, minimake_cstr_stringview(base));
+    return minimake_result_ok;
+}
+
+static void minimake_free_dir_caches(minimake* m, mm_dir_caches* caches) {
+    for (size_t j = 0; j < caches->n_dirs; ++j) {
+        m->free(caches->dirs[j].path);
+        if (caches->dirs[j].listing) {
+            m->free(caches->dirs[j].listing);
+        }
+        mm_set_clear(m, &caches->dirs[j].names);
+    }
+    if (caches->dirs) {
+        m->free(caches->dirs);
+    }
+    memset(caches, 0, sizeof(*caches));
+}
+
+/* vpath patterns have at most one '%', which matches any (possibly empty) part of the name */
+static int minimake_vpath_matches(mm_sv pattern, mm_sv name) {
+    const char* percent = memchr(pattern.data, '%', pattern.size);
+    if (!percent) {
+        return mm_sv_eq(pattern, name);
+    }
+    size_t prefix = percent - pattern.data;
+    size_t suffix = pattern.size - prefix - 1;
+    return name.size >= prefix + suffix
+        && memcmp(name.data, pattern.data, prefix) == 0
+        && memcmp(name.data + name.size - suffix, percent + 1, suffix) == 0;
+}
+
+/*
+ * Like make, dependencies no rule makes, which aren't where the makefile says they are, are looked for in the
+ * directories of matching vpath directives, in order, and then in those of VPATH. A dependency found that way
+ * is replaced by the path it was found at, so everything after parsing (checking whether targets are up to
+ * date, prefetching, watching) uses the real file without searching again. Each name is looked up once, and
+ * the directories are listed rather than probed name by name, see minimake_dir_contains().
+ */
+static minimake_result minimake_apply_vpath(minimake* m) {
+    minimake_graph g;
+    mm_dir_caches caches = { 0 };
+    mm_sv* found = NULL;
+    char* path = NULL;
+    minimake_result result = minimake_graph_build(m, &g);
+    if (!result.ok) {
+        return result;
+    }
+    found = m->alloc(sizeof(mm_sv) * (g.n_nodes + 1));
+    m->found_paths = m->alloc(sizeof(char*) * (g.n_nodes + 1));
+    path = m->alloc(PATH_MAX);
+    if (!found || !m->found_paths || !path) {
+        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating search path results" };
+        goto cleanup;
+    }
+    memset(found, 0, sizeof(mm_sv) * (g.n_nodes + 1));
+    for (size_t node = 0; node < g.n_nodes && result.ok; ++node) {
+        mm_sv name = g.names[node];
+        if ((g.flags[node] & MM_NODE_HAS_RULE) || name.data[0] == '/' || name.size >= PATH_MAX / 2) {
+            continue;
+        }
+        int exists = 0;
+        snprintf(path, PATH_MAX, "%.*s", (int)name.size, name.data);
+        result = minimake_dir_contains(m, &caches, path, &exists);
+        /* patterns first, then VPATH */
+        for (int pass = 0; pass < 2 && result.ok && !exists; ++pass) {
+            for (size_t j = 0; j < m->n_vpaths && result.ok && !exists; ++j) {
+                mm_vpath* vpath = &m->vpaths[j];
+                if ((pass == 0) != (vpath->pattern.data != NULL)
+                    || (vpath->pattern.data && !minimake_vpath_matches(vpath->pattern, name))) {
+                    continue;
+                }
+                int len = snprintf(path, PATH_MAX, "%.*s/%.*s", (int)vpath->dir.size, vpath->dir.data, (int)name.size, name.data);
+                if (len >= PATH_MAX) {
+                    continue;
+                }
+                result = minimake_dir_contains(m, &caches, path, &exists);
+                if (result.ok && exists) {
+                    char* copy = m->alloc(len + 1);
+                    if (!copy) {
+                        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating search path results" };
+                        break;
+                    }
+                    memcpy(copy, path, len + 1);
+                    m->found_paths[m->n_found_paths++] = copy;
+                    found[node] = (mm_sv) { .data = copy, .size = len };
+                }
+            }
+        }
+    }
+    for (size_t j = 0; j < m->n_rules && result.ok; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        for (size_t k = 0; k < rule->n_dependencies; ++k) {
+            size_t node = minimake_graph_find(&g, rule->dependencies[k]);
+            if (node != SIZE_MAX && found[node].data) {
+                rule->dependencies[k] = found[node];
+            }
+        }
+    }
+
+cleanup:
+    minimake_free_dir_caches(m, &caches);
+    if (found) {
+        m->free(found);
+    }
+    if (path) {
+        m->free(path);
+    }
+    minimake_graph_free(m, &g);
+    return result;
+}
+
+/* the rule for MINIMAKE_VARIANTS_TARGET has room for as many dependencies */
+#define MINIMAKE_MAX_VARIANTS 64
+
+/* adds a variant, built in `dir` */
+static minimake_result minimake_add_variant(minimake* m, char* dir) {
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        dir[--len] = 0;
+    }
+    if (len == 0 || strcmp(dir, ".") == 0 || strcmp(dir, MINIMAKE_STATE_DIR) == 0) {
+        return (minimake_result) { .ok = 0, .message = "a variant needs a directory of its own", .context = "variant" };
+    }
+    if (m->n_variants == MINIMAKE_MAX_VARIANTS) {
+        return (minimake_result) { .ok = 0, .message = "too many variants", .context = "variant" };
+    }
+    if (m->n_variants == m->variants_capacity) {
+        size_t capacity = m->variants_capacity ? m->variants_capacity * 2 : 4;
+        mm_variant* variants = m->alloc(sizeof(mm_variant) * capacity);
+        if (!variants) {
+            return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating variants" };
+        }
+        if (m->variants) {
+            memcpy(variants, m->variants, sizeof(mm_variant) * m->n_variants);
+            m->free(m->variants);
+        }
+        m->variants = variants;
+        m->variants_capacity = capacity;
+    }
+    m->variants[m->n_variants++] = (mm_variant) { .dir = dir, .env = NULL, .n_env = 0, .env_capacity = 0, .source_dir = NULL };
+    return minimake_result_ok;
+}
+
+/* adds a "NAME=VALUE" setting to the environment of the last variant */
+static minimake_result minimake_add_variant_setting(minimake* m, char* setting) {
+    if (m->n_variants == 0) {
+        return (minimake_result) { .ok = 0, .message = "settings belong to a variant, which has to come first", .context = "variant" };
+    }
+    char* equals = strchr(setting, '=');
+    if (!equals || equals == setting) {
+        return (minimake_result) { .ok = 0, .message = "a setting looks like NAME=VALUE", .context = "variant" };
+    }
+    mm_variant* variant = &m->variants[m->n_variants - 1];
+    if (variant->n_env == variant->env_capacity) {
+        size_t capacity = variant->env_capacity ? variant->env_capacity * 2 : 4;
+        char** env = m->alloc(sizeof(char*) * capacity);
+        if (!env) {
+            return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating variant settings" };
+        }
+        if (variant->env) {
+            memcpy(env, variant->env, sizeof(char*) * variant->n_env);
+            m->free(variant->env);
+        }
+        variant->env = env;
+        variant->env_capacity = capacity;
+    }
+    variant->env[variant->n_env++] = setting;
+    return minimake_result_ok;
+}
+
+/* creates the directories leading up to `path`, each once */
+static void minimake_make_parents(minimake* m, mm_set* made_dirs, mm_sv path) {
+    char dir[PATH_MAX];
+    for (size_t i = 1; i < path.size && i < PATH_MAX; ++i) {
+        if (path.data[i] != '/' || mm_set_insert(m, made_dirs, (mm_sv) { .data = path.data, .size = i }) == 0) {
+            continue;
+        }
+        memcpy(dir, path.data, i);
+        dir[i] = 0;
+        /* if this fails, so will the commands, which say why */
+        (void)mkdir(dir, 0777);
+    }
+}
+
+/* adds `dir`/`name` to the names of the variants' targets */
+static mm_sv minimake_variant_path(minimake* m, const char* dir, mm_sv name) {
+    size_t size = strlen(dir) + 1 + name.size;
+    char* path = m->alloc(size + 1);
+    if (!path) {
+        return (mm_sv) { .data = NULL, .size = 0 };
+    }
+    snprintf(path, size + 1, "%s/%.*s", dir, (int)name.size, name.data);
+    m->variant_paths[m->n_variant_paths++] = path;
+    return (mm_sv) { .data = path, .size = size };
+}
+
+/*
+ * Turns the makefile into a template, of which every variant gets a copy, so that debug, release and sanitizer
+ * builds, say, are made by one scheduler sharing the job slots, from one parse. In the copy for a variant, whatever
+ * a rule makes is in the variant's directory, and that's where its commands run, with the variant's settings in
+ * their environment. Sources (what no rule makes) aren't copied: every variant depends on the same ones, which
+ * are only checked once, and are linked into the variant's directory, so the commands find them as usual.
+ * A rule MINIMAKE_VARIANTS_TARGET, which depends on `goal` in every variant, becomes what is made.
+ * Only with `prepare` are the variants' directories created, and the sources linked into them, so that a dry
+ * run, or a tool, leaves the tree as it is.
+ */
+static minimake_result minimake_instantiate_variants(minimake* m, mm_sv goal, int prepare) {
+    minimake_graph g;
+    mm_set made_dirs = { 0 };
+    mm_sv* paths = NULL;
+    char cwd[PATH_MAX];
+    char link_target[PATH_MAX];
+    minimake_result result = minimake_graph_build(m, &g);
+    if (!result.ok) {
+        return result;
+    }
+    size_t n_templates = m->n_rules;
+    minimake_rule* rules = m->alloc(sizeof(minimake_rule) * (n_templates * (m->n_variants + 1) + 1));
+    paths = m->alloc(sizeof(mm_sv) * (g.n_nodes + 1));
+    m->variant_paths = m->alloc(sizeof(char*) * (g.n_nodes * m->n_variants + 1));
+    if (!rules || !paths || !m->variant_paths) {
+        if (rules) {
+            m->free(rules);
+        }
+        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating variants" };
+        goto cleanup;
+    }
+    if (!getcwd(cwd, sizeof(cwd)) || !(m->source_dir = m->alloc(strlen(cwd) + 1))) {
+        m->free(rules);
+        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "variants" };
+        goto cleanup;
+    }
+    strcpy(m->source_dir, cwd);
+    memcpy(rules, m->rules, sizeof(minimake_rule) * n_templates);
+    m->free(m->rules);
+    m->rules = rules;
+
+    minimake_rule* variants_rule = &m->rules[n_templates * (m->n_variants + 1)];
+    memset(variants_rule, 0, sizeof(*variants_rule));
+    variants_rule->target = minimake_cstr_stringview(MINIMAKE_VARIANTS_TARGET);
+    for (size_t v = 0; v < m->n_variants; ++v) {
+        mm_variant* variant = &m->variants[v];
+        variant->source_dir = m->source_dir;
+        for (size_t node = 0; node < g.n_nodes; ++node) {
+            mm_sv name = g.names[node];
+            paths[node] = (mm_sv) { .data = NULL, .size = 0 };
+            if (g.flags[node] & MM_NODE_HAS_RULE) {
+                paths[node] = minimake_variant_path(m, variant->dir, name);
+                if (!paths[node].data) {
+                    result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating variants" };
+                    goto cleanup;
+                }
+                if (prepare) {
+                    minimake_make_parents(m, &made_dirs, paths[node]);
+                }
+            } else if (prepare && name.data[0] != '/' && !memmem(name.data, name.size, "..", 2)) {
+                /* an existing link is most likely ours, from last time, and anything else is best left alone */
+                mm_sv link = minimake_variant_path(m, variant->dir, name);
+                if (!link.data) {
+                    result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating variants" };
+                    goto cleanup;
+                }
+                minimake_make_parents(m, &made_dirs, link);
+                int len = snprintf(link_target, sizeof(link_target), "%s/%.*s", cwd, (int)name.size, name.data);
+                if (len > 0 && (size_t)len < sizeof(link_target)) {
+                    (void)symlink(link_target, link.data);
+                }
+            }
+        }
+        for (size_t j = 0; j < n_templates; ++j) {
+            minimake_rule* rule = &m->rules[n_templates * (v + 1) + j];
+            *rule = m->rules[j];
+            rule->variant = v + 1;
+            size_t node = minimake_graph_find(&g, rule->target);
+            if (node != SIZE_MAX && paths[node].data) {
+                rule->target = paths[node];
+            }
+            /* special targets stay what they are, but their dependencies become the variant's */
+            for (size_t k = 0; k < rule->n_dependencies; ++k) {
+                node = minimake_graph_find(&g, rule->dependencies[k]);
+                if (node != SIZE_MAX && paths[node].data) {
+                    rule->dependencies[k] = paths[node];
+                }
+            }
+        }
+        size_t node = minimake_graph_find(&g, goal);
+        variants_rule->dependencies[variants_rule->n_dependencies++] = node != SIZE_MAX && paths[node].data ? paths[node] : goal;
+    }
+    m->n_rules = n_templates * (m->n_variants + 1) + 1;
+
+cleanup:
+    mm_set_clear(m, &made_dirs);
+    if (paths) {
+        m->free(paths);
+    }
+    minimake_graph_free(m, &g);
+    return result;
+}
+
+/* parses a sysfs CPU list, like "0-3,8,10-11"; returns the number of CPUs in it, or -1 */
+static int minimake_parse_cpulist(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    while (*list && *list != '\n') {
+        char* end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list || last < first) {
+                return -1;
+            }
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',' && *end != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(cpus);
+}
+
+/*
+ * Reads the NUMA nodes and their CPUs from sysfs, leaving out CPUs we aren't allowed to run on (e.g. because of
+ * taskset or a cgroup cpuset), and nodes left without any. Without NUMA information, everything is one node.
+ * `nodes` is where sysfs keeps the nodes, normally "/sys/devices/system/node".
+ */
+static minimake_result minimake_load_topology(minimake* m, const char* nodes) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "getting CPU affinity" };
+    }
+    mm_topology* t = m->alloc(sizeof(mm_topology));
+    if (!t) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating topology" };
+    }
+    memset(t, 0, sizeof(*t));
+    for (int node = 0; node < 1024 && t->n_nodes < MINIMAKE_MAX_NUMA_NODES; ++node) {
+        char path[PATH_MAX];
+        char list[4096];
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", nodes, node);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            /* node numbers can have holes, when nodes are offline */
+            continue;
+        }
+        ssize_t len = read(fd, list, sizeof(list) - 1);
+        close(fd);
+        list[len > 0 ? len : 0] = 0;
+        cpu_set_t* cpus = &t->cpus[t->n_nodes];
+        if (minimake_parse_cpulist(list, cpus) <= 0) {
+            continue;
+        }
+        CPU_AND(cpus, cpus, &allowed);
+        t->n_cpus[t->n_nodes] = CPU_COUNT(cpus);
+        if (t->n_cpus[t->n_nodes] > 0) {
+            ++t->n_nodes;
+        }
+    }
+    if (t->n_nodes == 0) {
+        t->cpus[0] = allowed;
+        t->n_cpus[0] = CPU_COUNT(&allowed);
+        t->n_nodes = 1;
+    }
+    m->topology = t;
+    return minimake_result_ok;
+}
+
+/*
+ * Picks the node for a new job: the one with the fewest running jobs per CPU, so jobs spread over all nodes
+ * (a job counts as many times as it has job slots, see minimake_load_job_slots())
+ * instead of piling up on the first. The job is pinned to all CPUs of that node, so it, and any threads or
+ * processes it starts (a parallel linker, say), stay on the node, near the memory they allocate there.
+ */
+static size_t minimake_place_job(mm_topology* t, size_t slots) {
+    size_t best = 0;
+    for (size_t node = 1; node < t->n_nodes; ++node) {
+        if (t->jobs[node] * t->n_cpus[best] < t->jobs[best] * t->n_cpus[node]) {
+            best = node;
+        }
+    }
+    t->jobs[best] += slots;
+    return best;
+}
+
+/* how a command runs, besides the command itself */
+typedef struct {
+    /* CPUs it may run on, NULL for any */
+    const cpu_set_t* cpus;
+    /* job slots it was given, see minimake_load_job_slots() */
+    size_t slots;
+    /* cgroup.procs of the cgroup it runs in, -1 to stay in ours, see minimake_setup_priorities() */
+    int cgroup_fd;
+    /* if not 0, how much nicer than us it is, and that its I/O is too */
+    int nice;
+    /* the variant it's part of, which says where it runs, and with what settings; NULL for none */
+    const mm_variant* variant;
+} mm_spawn_options;
+
+/*
+ * runs `cmd` with the shell, like make does; returns the pid, or -1.
+ * The command gets the number of job slots it was given in MINIMAKE_JOB_SLOTS, to size its thread pool by,
+ * and in a variant, the directory of the makefile in MINIMAKE_SRCDIR.
+ */
+static pid_t minimake_spawn(const char* cmd, const mm_spawn_options* options, int* pidfd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char value[32];
+        /* a group of its own, so it can be cancelled with everything it started, see minimake_cancel_jobs() */
+        setpgid(0, 0);
+        snprintf(value, sizeof(value), "%zu", options->slots);
+        setenv("MINIMAKE_JOB_SLOTS", value, 1);
+        /* before exec, so that the command never runs anywhere else; these are all only preferences, so errors don't matter */
+        if (options->cpus) {
+            sched_setaffinity(0, sizeof(*options->cpus), options->cpus);
+        }
+        if (options->cgroup_fd >= 0) {
+            int len = snprintf(value, sizeof(value), "%d\n", (int)getpid());
+            (void)!write(options->cgroup_fd, value, len);
+        }
+        if (options->nice) {
+            (void)!nice(options->nice);
+            /* IOPRIO_WHO_PROCESS, best-effort class at its lowest level */
+            (void)syscall(SYS_ioprio_set, 1, 0, (2 << 13) | 7);
+        }
+        if (options->variant) {
+            if (chdir(options->variant->dir) < 0) {
+                _exit(127);
+            }
+            setenv("MINIMAKE_SRCDIR", options->variant->source_dir, 1);
+            for (size_t i = 0; i < options->variant->n_env; ++i) {
+                putenv(options->variant->env[i]);
+            }
+        }
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
+    }
+    if (pid > 0) {
+        /* here as well, so that it's in place no matter which of us gets to run first */
+        setpgid(pid, pid);
+    }
+    *pidfd = pid > 0 ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+    return pid;
+}
+
+/* the longest argument exec takes (MAX_ARG_STRLEN), which limits a command, since it's passed to sh -c as one */
+#define MINIMAKE_MAX_COMMAND (32 * 4096)
+
+/* how long `command` is with "$?" replaced by `changed`, see minimake_expand_command() */
+static size_t minimake_expanded_size(mm_sv command, mm_sv changed) {
+    size_t size = 0;
+    for (size_t i = 0; i < command.size; ++i) {
+        if (command.data[i] == '$' && i + 1 < command.size && command.data[i + 1] == '?') {
+            size += changed.size;
+            ++i;
+            continue;
+        }
+        if (command.data[i] == '$' && i + 1 < command.size && command.data[i + 1] == '$') {
+            ++i;
+        }
+        ++size;
+    }
+    return size;
+}
+
+/*
+ * Copies `command` to `*cmd`, which grows as needed, with "$?" replaced by `changed` and "$$" by "$", like make
+ * does, so that "$$?" is still the shell's; any other "$" is left to the shell, as always.
+ * Returns 0 if the memory ran out.
+ */
+static int minimake_expand_command(minimake* m, mm_sv command, mm_sv changed, char** cmd, size_t* cmd_capacity) {
+    size_t size = minimake_expanded_size(command, changed);
+    if (*cmd_capacity < size + 1) {
+        if (*cmd) {
+            m->free(*cmd);
+        }
+        *cmd_capacity = size + 1;
+        *cmd = m->alloc(*cmd_capacity);
+        if (!*cmd) {
+            *cmd_capacity = 0;
+            return 0;
+        }
+    }
+    char* out = *cmd;
+    for (size_t i = 0; i < command.size; ++i) {
+        if (command.data[i] == '$' && i + 1 < command.size && command.data[i + 1] == '?') {
+            if (changed.size) {
+                memcpy(out, changed.data, changed.size);
+                out += changed.size;
+            }
+            ++i;
+            continue;
+        }
+        if (command.data[i] == '$' && i + 1 < command.size && command.data[i + 1] == '$') {
+            ++i;
+        }
+        *out++ = command.data[i];
+    }
+    *out = 0;
+    return 1;
+}
+
+/* the variant `rule` was copied for, NULL if it's as written */
+static const mm_variant* minimake_rule_variant(minimake* m, const minimake_rule* rule) {
+    return rule->variant ? &m->variants[rule->variant - 1] : NULL;
+}
+
+/* prints a command about to run, with the directory of its variant, since it's not run from here */
+static void minimake_print_command(minimake* m, const minimake_rule* rule, const char* cmd) {
+    const mm_variant* variant = minimake_rule_variant(m, rule);
+    if (variant) {
+        printf("[%s] %s\n", variant->dir, cmd);
+    } else {
+        printf("%s\n", cmd);
+    }
+    fflush(stdout);
+}
+
+/* runs the commands of `target` one by one, with `changed` for "$?", or in a dry run, only prints them */
+minimake_result minimake_make(minimake* m, mm_sv* target, mm_sv changed, char** cmd, size_t* cmd_capacity) {
+    int found = 0;
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        if (rule->target.size == target->size && memcmp(rule->target.data, target->data, target->size) == 0) {
+            found = 1;
+            for (size_t k = 0; k < rule->n_commands; ++k) {
+                if (!minimake_expand_command(m, rule->commands[k], changed, cmd, cmd_capacity)) {
+                    return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating command" };
+                }
+                minimake_print_command(m, rule, *cmd);
+                if (m->mode == MINIMAKE_MODE_DRY_RUN) {
+                    continue;
+                }
+                int pidfd;
+                int status = -1;
+                mm_spawn_options options = { .cpus = NULL, .slots = 1, .cgroup_fd = -1, .nice = 0, .variant = minimake_rule_variant(m, rule) };
+                pid_t pid = minimake_spawn(*cmd, &options, &pidfd);
+                while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+                }
+                if (pidfd >= 0) {
+                    close(pidfd);
+                }
+                if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    sprintf(ERR_BUF, "command \"%.*s\" failed", (int)rule->commands[k].size, rule->commands[k].data);
+                    return (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "command" };
+                }
+            }
+        }
+    }
+    if (!found) {
+        sprintf(ERR_BUF, "no rule to make \"%.*s\"", (int)target->size, target->data);
+        return (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "no context" };
+    }
+    return minimake_result_ok;
+}
+
+static minimake_rule* minimake_find_rule(minimake* m, mm_sv target) {
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        if (m->rules[j].target.size == target.size && memcmp(m->rules[j].target.data, target.data, target.size) == 0) {
+            return &m->rules[j];
+        }
+    }
+    return NULL;
+}
+
+/* opens (creating it and the state directory if needed) a file in MINIMAKE_STATE_DIR, returns -2 on failure */
+static int minimake_open_state(const char* path, int flags) {
+    if (mkdir(MINIMAKE_STATE_DIR, 0777) < 0 && errno != EEXIST) {
+        return -2;
+    }
+    int fd = open(path, flags | O_CREAT | O_CLOEXEC, 0666);
+    return fd < 0 ? -2 : fd;
+}
+
+/* set by the handler of SIGINT and friends, while the scheduler runs */
+static volatile sig_atomic_t minimake_interrupted;
+
+/*
+ * Two minimake processes in the same tree (say, one started by an editor and one from a terminal) must not
+ * build the same target at the same time. They coordinate through a lock table: a single file in which every
+ * target owns one byte, picked by hashing its name. Whoever makes a target holds a write lock on its byte
+ * and read locks on the bytes of the target's dependencies, so it neither races another process writing
+ * the same output, nor reads an input that is still being written.
+ * These are open file description locks, so the kernel drops them if a process dies.
+ * Returns -1 if another process holds a conflicting lock, unless `wait` is set, in which case we wait for it
+ * (or for an interrupt, which also returns -1); that's only safe while we hold no locks ourselves, or two
+ * processes could end up waiting for each other.
+ */
+static int minimake_lock(minimake* m, mm_sv target, short type, int wait) {
+    if (m->lock_fd == -1) {
+        /* if we can't have a lock table (read-only tree, ...), we simply build without one */
+        m->lock_fd = minimake_open_state(MINIMAKE_STATE_DIR "/lock", O_RDWR);
+    }
+    if (m->lock_fd < 0) {
+        return 0;
+    }
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    /* 40 bits worth of slots, so unrelated targets practically never share one */
+    fl.l_start = (off_t)(minimake_hash(target) >> 24);
+    fl.l_len = 1;
+    if (fcntl(m->lock_fd, F_OFD_SETLK, &fl) == 0 || (errno != EAGAIN && errno != EACCES)) {
+        return 0;
+    }
+    if (!wait) {
+        return -1;
+    }
+    while (fcntl(m->lock_fd, F_OFD_SETLKW, &fl) < 0) {
+        /* our handlers don't restart the call, so a ^C gets us out of the wait */
+        if (errno != EINTR || minimake_interrupted) {
+            return errno == EINTR ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+/* whether `target` is a dependency of the special target `special`, e.g. ".INTERMEDIATE" */
+static int minimake_is_special(minimake* m, const char* special, mm_sv target) {
+    size_t special_size = strlen(special);
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        if (rule->target.size != special_size || memcmp(rule->target.data, special, special_size) != 0) {
+            continue;
+        }
+        for (size_t k = 0; k < rule->n_dependencies; ++k) {
+            if (rule->dependencies[k].size == target.size && memcmp(rule->dependencies[k].data, target.data, target.size) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* whether `target` is secondary; an empty .SECONDARY makes every target secondary */
+static int minimake_is_secondary(minimake* m, mm_sv target) {
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        if (rule->n_dependencies == 0 && rule->target.size == strlen(".SECONDARY") && memcmp(rule->target.data, ".SECONDARY", rule->target.size) == 0) {
+            return 1;
+        }
+    }
+    return minimake_is_special(m, ".SECONDARY", target);
+}
+
+/*
+ * Intermediate and secondary targets are allowed to be missing: they're only made if something that depends on
+ * them has to be made. That way, cleaning up generated sources after they were compiled into a library doesn't
+ * make the next build regenerate them, and then everything downstream of them.
+ */
+static int minimake_may_be_missing(minimake* m, mm_sv target) {
+    return minimake_find_rule(m, target) && (minimake_is_special(m, ".INTERMEDIATE", target) || minimake_is_secondary(m, target));
+}
+
+/*
+ * Removes the link `filename`, which points to `staged`, in the staging directory of a build that was killed
+ * before it could clean up, along with the staged file, and that directory once it's empty. tmpfs is memory,
+ * so otherwise every killed build would keep some of it for good.
+ */
+static void minimake_remove_stale_link(minimake* m, const char* filename, char* staged) {
+    unlink(filename);
+    unlink(staged);
+    char* slash = strrchr(staged, '/');
+    if (slash) {
+        *slash = 0;
+        if (!m->staging_dir || strcmp(staged, m->staging_dir) != 0) {
+            /* fails if the directory still holds other targets of that build; the last of them removes it */
+            rmdir(staged);
+        }
+    }
+}
+
+/*
+ * Targets listed as dependencies of .INTERMEDIATE only exist to feed other rules. Like make, we delete the ones
+ * we made once the build is done. Until then, they live in a directory on tmpfs, so they never hit the disk:
+ * before its commands run, the target's path is made a symlink to a file in that directory, so the commands
+ * write to, and later ones read from, memory. A command which replaces the symlink instead of writing
+ * through it just ends up with the file on disk, which is fine as well.
+ */
+static void minimake_stage(minimake* m, mm_sv* target, const char* filename) {
+    char staged[PATH_MAX];
+    /* secondary ones are kept */
+    if (!minimake_is_special(m, ".INTERMEDIATE", *target) || minimake_is_secondary(m, *target)) {
+        return;
+    }
+    if (m->n_staged == m->staged_capacity) {
+        size_t capacity = m->staged_capacity ? m->staged_capacity * 2 : 16;
+        mm_sv* new_staged = m->alloc(sizeof(mm_sv) * capacity);
+        if (!new_staged) {
+            /* then it's just a normal target */
+            return;
+        }
+        if (m->staged) {
+            memcpy(new_staged, m->staged, sizeof(mm_sv) * m->n_staged);
+            m->free(m->staged);
+        }
+        m->staged = new_staged;
+        m->staged_capacity = capacity;
+    }
+    m->staged[m->n_staged++] = *target;
+    if (!m->staging_dir) {
+        char dir[] = "/dev/shm/minimake-XXXXXX";
+        if (mkdtemp(dir)) {
+            m->staging_dir = strdup(dir);
+        }
+    }
+    if (m->staging_dir) {
+        /* a dangling link to the staging directory of a build that was killed before it could clean up */
+        ssize_t len = readlink(filename, staged, sizeof(staged) - 1);
+        if (len > 0 && (size_t)len >= strlen("/dev/shm/minimake-") && memcmp(staged, "/dev/shm/minimake-", strlen("/dev/shm/minimake-")) == 0) {
+            staged[len] = 0;
+            minimake_remove_stale_link(m, filename, staged);
+        }
+        snprintf(staged, sizeof(staged), "%s/%016llx", m->staging_dir, (unsigned long long)minimake_hash(*target));
+        /* the file has to exist, since some tools (cp, for one) refuse to write through a dangling symlink.
+        if any of this fails, the target is made in place, and still deleted later */
+        int fd = open(staged, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd >= 0) {
+            close(fd);
+            (void)symlink(staged, filename);
+        }
+    }
+}
+
+/*
+ * A symlink into a staging directory other than ours was left by a build that was killed before it could clean
+ * up, and what it points to, if it's still there, may be stale, so it's removed. Returns whether it was.
+ * Such links resolve to another file system than the tree, so targets in the tree only cost a comparison.
+ */
+static int minimake_remove_stale_stage(minimake* m, const char* filename, struct stat* st) {
+    static const char prefix[] = "/dev/shm/minimake-";
+    char staged[PATH_MAX];
+    struct stat tree;
+    if (m->tree_dev == 0 && stat(".", &tree) == 0) {
+        m->tree_dev = tree.st_dev;
+    }
+    if (st->st_dev == m->tree_dev) {
+        return 0;
+    }
+    ssize_t len = readlink(filename, staged, sizeof(staged) - 1);
+    if (len < (ssize_t)strlen(prefix) || memcmp(staged, prefix, strlen(prefix)) != 0) {
+        return 0;
+    }
+    size_t ours = m->staging_dir ? strlen(m->staging_dir) : 0;
+    if (ours && (size_t)len > ours && memcmp(staged, m->staging_dir, ours) == 0 && staged[ours] == '/') {
+        return 0;
+    }
+    staged[len] = 0;
+    minimake_remove_stale_link(m, filename, staged);
+    minimake_stat_cache_invalidate(m);
+    return 1;
+}
+
+/* deletes all intermediate targets made by this build */
+static void minimake_unstage(minimake* m) {
+    char filename[PATH_MAX];
+    char staged[PATH_MAX];
+    for (size_t i = 0; i < m->n_staged; ++i) {
+        snprintf(filename, sizeof(filename), "%.*s", (int)m->staged[i].size, m->staged[i].data);
+        printf("rm %s\n", filename);
+        unlink(filename);
+        if (m->staging_dir) {
+            snprintf(staged, sizeof(staged), "%s/%016llx", m->staging_dir, (unsigned long long)minimake_hash(m->staged[i]));
+            unlink(staged);
+        }
+    }
+    if (m->staging_dir) {
+        rmdir(m->staging_dir);
+        free(m->staging_dir);
+        m->staging_dir = NULL;
+    }
+    if (m->n_staged) {
+        minimake_stat_cache_invalidate(m);
+    }
+    m->free(m->staged);
+    m->staged = NULL;
+    m->n_staged = 0;
+    m->staged_capacity = 0;
+}
+
+/* special targets whose dependencies (names, or patterns with a %) are normalized, see minimake_significant_mtime() */
+#define MINIMAKE_NORMALIZE_C_TARGET ".NORMALIZE_C"
+#define MINIMAKE_NORMALIZE_TARGET ".NORMALIZE"
+
+/* what we know about a version of a normalized file */
+typedef struct {
+    char* path;
+    /* a file with the same mtime, size and inode is taken to be the same version */
+    struct timespec mtime;
+    off_t size;
+    ino_t ino;
+    /* of the normalized content */
+    uint64_t hash;
+    /* mtime of the first version seen with this normalized content, i.e. when it last changed in a way that matters */
+    time_t significant;
+} mm_normalized;
+
+struct mm_normalize_cache {
+    mm_normalized* entries;
+    size_t n_entries;
+    size_t capacity;
+    /* open-addressing path -> entry table, SIZE_MAX for free slots */
+    size_t* index;
+    size_t index_capacity;
+    /* the file, MINIMAKE_STATE_DIR "/normalized", opened for appending, -2 if unavailable */
+    int fd;
+};
+
+static void minimake_free_normalize_cache(minimake* m) {
+    mm_normalize_cache* cache = m->normalize_cache;
+    if (!cache) {
+        return;
+    }
+    for (size_t i = 0; i < cache->n_entries; ++i) {
+        m->free(cache->entries[i].path);
+    }
+    if (cache->entries) {
+        m->free(cache->entries);
+    }
+    if (cache->index) {
+        m->free(cache->index);
+    }
+    if (cache->fd >= 0) {
+        close(cache->fd);
+    }
+    m->free(cache);
+    m->normalize_cache = NULL;
+}
+
+/* the normalizer of `name`, that is, the rule of the first special target naming it, NULL if it has none */
+static minimake_rule* minimake_find_normalizer(minimake* m, mm_sv name) {
+    if (m->normalizers < 0) {
+        m->normalizers = 0;
+        for (size_t j = 0; j < m->n_rules; ++j) {
+            m->normalizers |= mm_sv_eq(m->rules[j].target, minimake_cstr_stringview(MINIMAKE_NORMALIZE_C_TARGET))
+                || mm_sv_eq(m->rules[j].target, minimake_cstr_stringview(MINIMAKE_NORMALIZE_TARGET));
+        }
+    }
+    for (size_t j = 0; j < m->n_rules && m->normalizers; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        if (!mm_sv_eq(rule->target, minimake_cstr_stringview(MINIMAKE_NORMALIZE_C_TARGET))
+            && !mm_sv_eq(rule->target, minimake_cstr_stringview(MINIMAKE_NORMALIZE_TARGET))) {
+            continue;
+        }
+        for (size_t k = 0; k < rule->n_dependencies; ++k) {
+            mm_sv pattern = rule->dependencies[k];
+            if (memchr(pattern.data, '%', pattern.size) ? minimake_vpath_matches(pattern, name) : mm_sv_eq(pattern, name)) {
+                return rule;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Normalizes C-family source in place, and returns its new size: comments go, as do whitespace at the start and
+ * end of lines, and blank lines, while other whitespace becomes a single space; string and character literals
+ * stay as they are. What the compiler would see differently comes out differently, except for line numbers.
+ */
+static size_t minimake_normalize_c(char* data, size_t size) {
+    size_t out = 0;
+    int space = 0;
+    for (size_t i = 0; i < size;) {
+        char c = data[i];
+        if (c == '/' && i + 1 < size && data[i + 1] == '/') {
+            while (i < size && data[i] != '\n') {
+                ++i;
+            }
+        } else if (c == '/' && i + 1 < size && data[i + 1] == '*') {
+            for (i += 2; i < size && !(data[i - 1] == '*' && data[i] == '/' && data[i - 2] != '/'); ++i) {
+            }
+            i = i < size ? i + 1 : size;
+            space = 1;
+        } else if (c == '\n') {
+            space = 0;
+            if (out > 0 && data[out - 1] != '\n') {
+                data[out++] = '\n';
+            }
+            ++i;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            space = 1;
+            ++i;
+        } else {
+            /* there's room for the space, since at least as much was dropped */
+            if (space && out > 0 && data[out - 1] != '\n') {
+                data[out++] = ' ';
+            }
+            space = 0;
+            data[out++] = data[i++];
+            if (c == '"' || c == '\'') {
+                while (i < size && data[i] != c && data[i] != '\n') {
+                    if (data[i] == '\\' && i + 1 < size) {
+                        data[out++] = data[i++];
+                    }
+                    data[out++] = data[i++];
+                }
+                if (i < size && data[i] == c) {
+                    data[out++] = data[i++];
+                }
+            }
+        }
+    }
+    return out;
+}
+
+/* reads all of `fd` into `*data` (allocated, and grown as needed); returns 0 on errors */
+static int minimake_read_all(minimake* m, int fd, char** data, size_t* size) {
+    size_t capacity = 64 * 1024;
+    *size = 0;
+    *data = m->alloc(capacity);
+    while (*data) {
+        if (*size == capacity) {
+            char* grown = m->alloc(capacity * 2);
+            if (grown) {
+                memcpy(grown, *data, *size);
+                capacity *= 2;
+            }
+            m->free(*data);
+            *data = grown;
+            continue;
+        }
+        ssize_t len = read(fd, *data + *size, capacity - *size);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return len == 0;
+        }
+        *size += len;
+    }
+    return 0;
+}
+
+/*
+ * Hashes the content of `path` as `normalizer` sees it: with .NORMALIZE_C, that's minimake_normalize_c(), and with
+ * .NORMALIZE, the output of its command, which gets the file on its standard input, and its name in $1.
+ * Returns 0 if that didn't work.
+ */
+static int minimake_hash_normalized(minimake* m, minimake_rule* normalizer, const char* path, uint64_t* hash) {
+    char* data = NULL;
+    size_t size = 0;
+    int ok = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    if (mm_sv_eq(normalizer->target, minimake_cstr_stringview(MINIMAKE_NORMALIZE_C_TARGET))) {
+        ok = minimake_read_all(m, fd, &data, &size);
+        size = ok ? minimake_normalize_c(data, size) : 0;
+    } else if (normalizer->n_commands > 0) {
+        char* cmd = NULL;
+        size_t cmd_capacity = 0;
+        int out[2] = { -1, -1 };
+        pid_t pid = -1;
+        if (minimake_expand_command(m, normalizer->commands[0], (mm_sv) { .data = NULL, .size = 0 }, &cmd, &cmd_capacity) && pipe2(out, O_CLOEXEC) == 0) {
+            pid = fork();
+        }
+        if (pid == 0) {
+            dup2(fd, 0);
+            dup2(out[1], 1);
+            execl("/bin/sh", "sh", "-c", cmd, "sh", path, (char*)NULL);
+            _exit(127);
+        }
+        if (out[1] >= 0) {
+            close(out[1]);
+        }
+        if (pid > 0) {
+            int status = -1;
+            ok = minimake_read_all(m, out[0], &data, &size);
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (out[0] >= 0) {
+            close(out[0]);
+        }
+        if (cmd) {
+            m->free(cmd);
+        }
+    }
+    close(fd);
+    if (ok) {
+        *hash = minimake_hash((mm_sv) { .data = data, .size = size });
+    }
+    if (data) {
+        m->free(data);
+    }
+    return ok;
+}
+
+static size_t minimake_normalize_cache_find(mm_normalize_cache* cache, mm_sv path) {
+    if (cache->index_capacity == 0) {
+        return SIZE_MAX;
+    }
+    for (size_t i = minimake_hash(path) & (cache->index_capacity - 1); cache->index[i] != SIZE_MAX; i = (i + 1) & (cache->index_capacity - 1)) {
+        if (mm_sv_eq(minimake_cstr_stringview(cache->entries[cache->index[i]].path), path)) {
+            return cache->index[i];
+        }
+    }
+    return SIZE_MAX;
+}
+
+/* adds `entry` to the cache (in memory), or updates the one for the same path; returns 0 if the memory ran out */
+static int minimake_normalize_cache_put(minimake* m, mm_normalize_cache* cache, mm_normalized entry, mm_sv path) {
+    size_t i = minimake_normalize_cache_find(cache, path);
+    if (i != SIZE_MAX) {
+        entry.path = cache->entries[i].path;
+        cache->entries[i] = entry;
+        return 1;
+    }
+    /* keep the index at most half full */
+    if ((cache->n_entries + 1) * 2 > cache->index_capacity) {
+        size_t index_capacity = cache->index_capacity ? cache->index_capacity * 2 : 256;
+        size_t* index = m->alloc(sizeof(size_t) * index_capacity);
+        mm_normalized* entries = m->alloc(sizeof(mm_normalized) * index_capacity / 2);
+        if (!index || !entries) {
+            if (index) {
+                m->free(index);
+            }
+            if (entries) {
+                m->free(entries);
+            }
+            return 0;
+        }
+        if (cache->entries) {
+            memcpy(entries, cache->entries, sizeof(mm_normalized) * cache->n_entries);
+            m->free(cache->entries);
+            m->free(cache->index);
+        }
+        cache->entries = entries;
+        cache->index = index;
+        cache->index_capacity = index_capacity;
+        memset(cache->index, 0xff, sizeof(size_t) * index_capacity);
+        for (size_t e = 0; e < cache->n_entries; ++e) {
+            size_t slot = minimake_hash(minimake_cstr_stringview(cache->entries[e].path)) & (index_capacity - 1);
+            while (cache->index[slot] != SIZE_MAX) {
+                slot = (slot + 1) & (index_capacity - 1);
+            }
+            cache->index[slot] = e;
+        }
+    }
+    entry.path = m->alloc(path.size + 1);
+    if (!entry.path) {
+        return 0;
+    }
+    memcpy(entry.path, path.data, path.size);
+    entry.path[path.size] = 0;
+    size_t slot = minimake_hash(path) & (cache->index_capacity - 1);
+    while (cache->index[slot] != SIZE_MAX) {
+        slot = (slot + 1) & (cache->index_capacity - 1);
+    }
+    cache->index[slot] = cache->n_entries;
+    cache->entries[cache->n_entries++] = entry;
+    return 1;
+}
+
+/* one line of MINIMAKE_STATE_DIR "/normalized" */
+static int minimake_format_normalized(char* line, size_t size, const mm_normalized* entry) {
+    return snprintf(line, size, "%lld %ld %lld %llu %016llx %lld %s\n", (long long)entry->mtime.tv_sec, entry->mtime.tv_nsec,
+        (long long)entry->size, (unsigned long long)entry->ino, (unsigned long long)entry->hash, (long long)entry->significant, entry->path);
+}
+
+/*
+ * Reads MINIMAKE_STATE_DIR "/normalized", where every line is a version of a normalized file, the last line about
+ * a file being its latest. New versions are appended, so concurrent minimake processes can share it; when most
+ * lines are outdated, it's rewritten.
+ */
+static mm_normalize_cache* minimake_load_normalize_cache(minimake* m) {
+    mm_normalize_cache* cache = m->alloc(sizeof(mm_normalize_cache));
+    if (!cache) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -2;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    size_t n_lines = 0;
+    ssize_t len;
+    FILE* file = fopen(MINIMAKE_STATE_DIR "/normalized", "r");
+    while (file && (len = getline(&line, &line_capacity, file)) > 0) {
+        long long mtime_sec, size, significant;
+        long mtime_nsec;
+        unsigned long long ino, hash;
+        int path_start = 0;
+        if (line[len - 1] == '\n') {
+            line[--len] = 0;
+        }
+        ++n_lines;
+        if (sscanf(line, "%lld %ld %lld %llu %llx %lld %n", &mtime_sec, &mtime_nsec, &size, &ino, &hash, &significant, &path_start) < 6 || path_start == 0) {
+            continue;
+        }
+        mm_normalized entry = {
+            .mtime = { .tv_sec = mtime_sec, .tv_nsec = mtime_nsec },
+            .size = size,
+            .ino = ino,
+            .hash = hash,
+            .significant = significant,
+        };
+        minimake_normalize_cache_put(m, cache, entry, (mm_sv) { .data = line + path_start, .size = len - path_start });
+    }
+    if (file) {
+        fclose(file);
+    }
+    if (line) {
+        free(line);
+    }
+    if (n_lines > cache->n_entries * 2 + 64) {
+        char buffer[PATH_MAX + 128];
+        int fd = minimake_open_state(MINIMAKE_STATE_DIR "/normalized.new", O_WRONLY | O_TRUNC);
+        int ok = fd >= 0;
+        for (size_t i = 0; i < cache->n_entries && ok; ++i) {
+            int size = minimake_format_normalized(buffer, sizeof(buffer), &cache->entries[i]);
+            ok = size > 0 && (size_t)size < sizeof(buffer) && write(fd, buffer, size) == size;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (ok) {
+            rename(MINIMAKE_STATE_DIR "/normalized.new", MINIMAKE_STATE_DIR "/normalized");
+        }
+    }
+    cache->fd = minimake_open_state(MINIMAKE_STATE_DIR "/normalized", O_WRONLY | O_APPEND);
+    return cache;
+}
+
+/*
+ * The mtime of the dependency `name` (at `path`, with metadata `st`) which matters for whether what's made from it
+ * is outdated. That's its mtime, unless a special target gives it a normalizer: then edits which leave the
+ * normalized content as it was (say, to comments) don't count, and it's the mtime of the version which changed
+ * that last. Each version of a file is normalized once, since the hashes are kept in MINIMAKE_STATE_DIR.
+ */
+static time_t minimake_significant_mtime(minimake* m, mm_sv name, const char* path, struct stat* st) {
+    minimake_rule* normalizer = m->normalizers == 0 ? NULL : minimake_find_normalizer(m, name);
+    if (!normalizer || !S_ISREG(st->st_mode)) {
+        return st->st_mtim.tv_sec;
+    }
+    if (!m->normalize_cache && !(m->normalize_cache = minimake_load_normalize_cache(m))) {
+        return st->st_mtim.tv_sec;
+    }
+    mm_normalize_cache* cache = m->normalize_cache;
+    mm_sv key = minimake_cstr_stringview(path);
+    size_t i = minimake_normalize_cache_find(cache, key);
+    mm_normalized* known = i != SIZE_MAX ? &cache->entries[i] : NULL;
+    if (known && known->mtime.tv_sec == st->st_mtim.tv_sec && known->mtime.tv_nsec == st->st_mtim.tv_nsec
+        && known->size == st->st_size && known->ino == st->st_ino) {
+        return known->significant;
+    }
+    mm_normalized entry = { .mtime = st->st_mtim, .size = st->st_size, .ino = st->st_ino, .significant = st->st_mtim.tv_sec };
+    if (!minimake_hash_normalized(m, normalizer, path, &entry.hash)) {
+        printf("WARNING: can't normalize \"%s\", so any change to it counts\n", path);
+        return st->st_mtim.tv_sec;
+    }
+    if (known && known->hash == entry.hash && known->significant < entry.significant) {
+        entry.significant = known->significant;
+    }
+    if (minimake_normalize_cache_put(m, cache, entry, key) && cache->fd >= 0) {
+        char line[PATH_MAX + 128];
+        entry.path = (char*)path;
+        int len = minimake_format_normalized(line, sizeof(line), &entry);
+        if (len > 0 && (size_t)len < sizeof(line)) {
+            (void)!write(cache->fd, line, len);
+        }
+    }
+    return entry.significant;
+}
+
+/*
+ * Normalizes the dependencies of `target`, which has just been made, if they have normalizers: when `target` was
+ * missing, nothing needed their content to decide that, but the next build will, to tell whether they changed since.
+ */
+static void minimake_remember_normalized(minimake* m, mm_sv target) {
+    char dep_filename[PATH_MAX];
+    minimake_rule* rule = m->normalizers == 0 ? NULL : minimake_find_rule(m, target);
+    for (size_t k = 0; rule && k < rule->n_dependencies; ++k) {
+        struct stat dep_st;
+        snprintf(dep_filename, sizeof(dep_filename), "%.*s", (int)rule->dependencies[k].size, rule->dependencies[k].data);
+        if (minimake_find_normalizer(m, rule->dependencies[k]) && minimake_stat(m, dep_filename, &dep_st) == 0) {
+            minimake_significant_mtime(m, rule->dependencies[k], dep_filename, &dep_st);
+        }
+    }
+}
+
+/* the newest mtime of `target`'s dependencies, looking through missing intermediates; that's the mtime `target`
+would have if we made it now. a dependency which doesn't exist at all counts as infinitely new */
+static time_t minimake_newest_input(minimake* m, mm_sv target) {
+    char dep_filename[PATH_MAX];
+    time_t newest = 0;
+    minimake_rule* rule = minimake_find_rule(m, target);
+    for (size_t k = 0; rule && k < rule->n_dependencies; ++k) {
+        time_t mtime;
+        struct stat dep_st;
+        snprintf(dep_filename, sizeof(dep_filename), "%.*s", (int)rule->dependencies[k].size, rule->dependencies[k].data);
+        if (mm_set_contains(&m->made, rule->dependencies[k])) {
+            return INT64_MAX;
+        } else if (minimake_stat(m, dep_filename, &dep_st) == 0) {
+            mtime = minimake_significant_mtime(m, rule->dependencies[k], dep_filename, &dep_st);
+        } else if (errno == ENOENT && minimake_may_be_missing(m, rule->dependencies[k])) {
+            mtime = minimake_newest_input(m, rule->dependencies[k]);
+        } else {
+            return INT64_MAX;
+        }
+        if (mtime > newest) {
+            newest = mtime;
+        }
+    }
+    return newest;
+}
+
+/* sets `newer` if `dependency` is newer than the target whose metadata `st` is, so that it has to be made again */
+static minimake_result minimake_is_newer(minimake* m, mm_sv dependency, struct stat* st, int* newer) {
+    char dep_filename[PATH_MAX];
+    if (dependency.size >= PATH_MAX) {
+        return (minimake_result) { .ok = 0, .message = "path too long", .context = "dependency" };
+    }
+    memcpy(dep_filename, dependency.data, dependency.size);
+    dep_filename[dependency.size] = 0;
+    struct stat dep_st;
+    time_t dep_mtime;
+    if (mm_set_contains(&m->made, dependency)) {
+        /* made by this build, so we're outdated, even if the mtimes (or, in a dry run, the lack of them) don't tell */
+        *newer = 1;
+        return minimake_result_ok;
+    } else if (minimake_stat(m, dep_filename, &dep_st) == 0) {
+        dep_mtime = minimake_significant_mtime(m, dependency, dep_filename, &dep_st);
+    } else if (errno == ENOENT && minimake_may_be_missing(m, dependency)) {
+        /* a missing intermediate is up to date if what it would be made from is older than us */
+        dep_mtime = minimake_newest_input(m, dependency);
+    } else {
+        return (minimake_result) { .ok = 0, .message = "dependency not satisfied when it should be guaranteed, is something else modifying the filesystem?", .context = "dependency" };
+    }
+    /* compare dependency mtime to target mtime, if target mtime < dependency mtime, make target again */
+    *newer = st->st_mtim.tv_sec < dep_mtime;
+    return minimake_result_ok;
+}
+
+/* sets `outdated` if any dependency of `target` was modified after `st` */
+static minimake_result minimake_is_outdated(minimake* m, mm_sv* target, struct stat* st, int* outdated) {
+    minimake_rule* rule = minimake_find_rule(m, *target);
+    *outdated = 0;
+    /* at this point, all dependencies are guaranteed to exist, except for intermediate ones */
+    for (size_t k = 0; rule && k < rule->n_dependencies && !*outdated; ++k) {
+        minimake_result result = minimake_is_newer(m, rule->dependencies[k], st, outdated);
+        if (!result.ok) {
+            return result;
+        }
+    }
+    return minimake_result_ok;
+}
+
+/* whether a command of `target` uses "$?", since only then the changed dependencies are worth listing */
+static int minimake_uses_changed(minimake* m, mm_sv target) {
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        for (size_t k = 0; k < rule->n_commands && mm_sv_eq(rule->target, target); ++k) {
+            if (memmem(rule->commands[k].data, rule->commands[k].size, "$?", 2)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Lists the dependencies of `target` which are newer than it (all of them if it doesn't exist, and `st` is NULL),
+ * separated by spaces, for "$?". If there are any, `changed` is allocated.
+ */
+static minimake_result minimake_changed_inputs(minimake* m, mm_sv target, struct stat* st, mm_sv* changed) {
+    minimake_rule* rule = minimake_find_rule(m, target);
+    int newer[sizeof(rule->dependencies) / sizeof(rule->dependencies[0])];
+    size_t size = 0;
+    *changed = (mm_sv) { .data = NULL, .size = 0 };
+    for (size_t k = 0; rule && k < rule->n_dependencies; ++k) {
+        newer[k] = 1;
+        if (st) {
+            minimake_result result = minimake_is_newer(m, rule->dependencies[k], st, &newer[k]);
+            if (!result.ok) {
+                return result;
+            }
+        }
+        size += newer[k] ? rule->dependencies[k].size + 1 : 0;
+    }
+    if (size == 0) {
+        return minimake_result_ok;
+    }
+    char* data = m->alloc(size);
+    if (!data) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating changed dependencies" };
+    }
+    char* out = data;
+    const mm_variant* variant = minimake_rule_variant(m, rule);
+    size_t dir_size = variant ? strlen(variant->dir) : 0;
+    for (size_t k = 0; k < rule->n_dependencies; ++k) {
+        mm_sv dependency = rule->dependencies[k];
+        if (!newer[k]) {
+            continue;
+        }
+        /* the commands of a variant run in its directory, where the sources are linked */
+        if (variant && dependency.size > dir_size && memcmp(dependency.data, variant->dir, dir_size) == 0 && dependency.data[dir_size] == '/') {
+            dependency.data += dir_size + 1;
+            dependency.size -= dir_size + 1;
+        }
+        memcpy(out, dependency.data, dependency.size);
+        out += dependency.size;
+        *out++ = ' ';
+    }
+    *changed = (mm_sv) { .data = data, .size = out - data - 1 };
+    return minimake_result_ok;
+}
+
+/* how many durations of each target the build log keeps, and we look at */
+#define MINIMAKE_HISTORY 16
+
+/*
+ * Rewrites the build log with just the last MINIMAKE_HISTORY lines about each target, once most of its lines are
+ * older than that, like MINIMAKE_STATE_DIR "/normalized" is. Going from the newest line back, a line is kept if
+ * its target isn't in all of the MINIMAKE_HISTORY sets yet.
+ */
+static void minimake_compact_log(minimake* m) {
+    mm_set seen[MINIMAKE_HISTORY];
+    memset(seen, 0, sizeof(seen));
+    char* data = NULL;
+    struct stat st;
+    int fd = open(MINIMAKE_STATE_DIR "/log", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0 || !(data = m->alloc(st.st_size))) {
+        goto cleanup;
+    }
+    if (read(fd, data, st.st_size) != st.st_size) {
+        goto cleanup;
+    }
+    size_t n_lines = 0;
+    size_t n_kept = 0;
+    size_t end = st.st_size;
+    while (end > 0) {
+        size_t line_end = data[end - 1] == '\n' ? end - 1 : end;
+        size_t start = line_end;
+        while (start > 0 && data[start - 1] != '\n') {
+            --start;
+        }
+        ++n_lines;
+        /* the target comes after the time and the duration */
+        char* space = memchr(data + start, ' ', line_end - start);
+        space = space ? memchr(space + 1, ' ', data + line_end - space - 1) : NULL;
+        int kept = 0;
+        if (space) {
+            mm_sv name = { .data = space + 1, .size = data + line_end - space - 1 };
+            for (size_t i = 0; i < MINIMAKE_HISTORY && !kept; ++i) {
+                kept = mm_set_insert(m, &seen[i], name);
+                if (kept < 0) {
+                    goto cleanup;
+                }
+            }
+        }
+        if (!kept) {
+            /* no line starts with a 0 byte otherwise */
+            data[start] = 0;
+        }
+        n_kept += kept;
+        end = start;
+    }
+    if (n_lines <= n_kept * 2 + 64) {
+        goto cleanup;
+    }
+    size_t size = 0;
+    for (size_t start = 0; start < (size_t)st.st_size;) {
+        char* newline = memchr(data + start, '\n', st.st_size - start);
+        size_t next = newline ? (size_t)(newline - data) + 1 : (size_t)st.st_size;
+        if (data[start]) {
+            memmove(data + size, data + start, next - start);
+            size += next - start;
+        }
+        start = next;
+    }
+    int out = minimake_open_state(MINIMAKE_STATE_DIR "/log.new", O_WRONLY | O_TRUNC);
+    int ok = out >= 0 && write(out, data, size) == (ssize_t)size;
+    if (out >= 0) {
+        close(out);
+    }
+    if (ok) {
+        rename(MINIMAKE_STATE_DIR "/log.new", MINIMAKE_STATE_DIR "/log");
+    }
+cleanup:
+    for (size_t i = 0; i < MINIMAKE_HISTORY; ++i) {
+        mm_set_clear(m, &seen[i]);
+    }
+    if (data) {
+        m->free(data);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * Every target we make gets a line in the build log, MINIMAKE_STATE_DIR "/log":
+ *     <when it was done, in ms since the epoch> <how long it took, in ms> <target>
+ * Lines are short enough to be appended atomically, so concurrent minimake processes can share the log.
+ */
+static void minimake_log_duration(minimake* m, mm_sv target, struct timespec* start, struct timespec* end) {
+    char line[PATH_MAX + 64];
+    if (m->log_fd == -1) {
+        minimake_compact_log(m);
+        m->log_fd = minimake_open_state(MINIMAKE_STATE_DIR "/log", O_WRONLY | O_APPEND);
+    }
+    if (m->log_fd < 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long duration_ms = (end->tv_sec - start->tv_sec) * 1000LL + (end->tv_nsec - start->tv_nsec) / 1000000;
+    int len = snprintf(line, sizeof(line), "%lld %lld %.*s\n", now.tv_sec * 1000LL + now.tv_nsec / 1000000, duration_ms, (int)target.size, target.data);
+    if (len > 0 && (size_t)len < sizeof(line)) {
+        (void)!write(m->log_fd, line, len);
+    }
+}
+
+/* calls `fn` for every line in the build log about a node of `g`, oldest first */
+static void minimake_read_log(minimake_graph* g, void (*fn)(size_t node, long long duration_ms, void* arg), void* arg) {
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    FILE* log = fopen(MINIMAKE_STATE_DIR "/log", "r");
+    if (!log) {
+        return;
+    }
+    while ((len = getline(&line, &line_capacity, log)) > 0) {
+        long long when, duration_ms;
+        int name_start = 0;
+        if (line[len - 1] == '\n') {
+            line[--len] = 0;
+        }
+        if (sscanf(line, "%lld %lld %n", &when, &duration_ms, &name_start) < 2 || name_start == 0) {
+            continue;
+        }
+        mm_sv name = { .data = line + name_start, .size = len - name_start };
+        size_t node = minimake_graph_find(g, name);
+        if (node != SIZE_MAX) {
+            fn(node, duration_ms, arg);
+        }
+    }
+    free(line);
+    fclose(log);
+}
+
+/* the last few durations of a target, from the build log */
+typedef struct {
+    uint32_t ms[MINIMAKE_HISTORY];
+    /* how many were ever logged; the latest is ms[(n - 1) % MINIMAKE_HISTORY] */
+    uint32_t n;
+} mm_history;
+
+static void minimake_add_history(size_t node, long long duration_ms, void* arg) {
+    mm_history* history = &((mm_history*)arg)[node];
+    history->ms[history->n++ % MINIMAKE_HISTORY] = duration_ms < 0 ? 0 : duration_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_ms;
+}
+
+/* fills in the history of every node of `g`, which has room for g->n_nodes of them */
+static void minimake_load_history(minimake_graph* g, mm_history* history) {
+    memset(history, 0, sizeof(mm_history) * g->n_nodes);
+    minimake_read_log(g, minimake_add_history, history);
+}
+
+/* sorts the (few) `values`, and returns their median */
+static uint32_t mm_median(uint32_t* values, size_t n) {
+    for (size_t i = 1; i < n; ++i) {
+        uint32_t value = values[i];
+        size_t j = i;
+        for (; j > 0 && values[j - 1] > value; --j) {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
+    }
+    return n % 2 ? values[n / 2] : (uint32_t)(((uint64_t)values[n / 2 - 1] + values[n / 2]) / 2);
+}
+
+/* how long making a target usually takes, going by its history; one slow run doesn't move it */
+typedef struct {
+    /* 0 if there's no history */
+    uint32_t median_ms;
+    /* the median absolute deviation from that, i.e. how much it usually varies */
+    uint32_t mad_ms;
+    uint32_t samples;
+} mm_baseline;
+
+static mm_baseline minimake_baseline(const mm_history* history) {
+    mm_baseline baseline = { 0 };
+    uint32_t values[MINIMAKE_HISTORY];
+    baseline.samples = history->n < MINIMAKE_HISTORY ? history->n : MINIMAKE_HISTORY;
+    if (baseline.samples == 0) {
+        return baseline;
+    }
+    memcpy(values, history->ms, sizeof(uint32_t) * baseline.samples);
+    baseline.median_ms = mm_median(values, baseline.samples);
+    for (size_t i = 0; i < baseline.samples; ++i) {
+        values[i] = values[i] > baseline.median_ms ? values[i] - baseline.median_ms : baseline.median_ms - values[i];
+    }
+    baseline.mad_ms = mm_median(values, baseline.samples);
+    return baseline;
+}
+
+/* about to run commands for chain[i], so prefetch the sources of what comes after it, while those commands run */
+static void minimake_prefetch_ahead(minimake* m, mm_sv* chain, ssize_t i, ssize_t* prefetched) {
+    ssize_t end = i - MINIMAKE_PREFETCH_LOOKAHEAD < 0 ? 0 : i - MINIMAKE_PREFETCH_LOOKAHEAD;
+    for (ssize_t j = (*prefetched < i ? *prefetched : i) - 1; j >= end; --j) {
+        minimake_rule* rule = minimake_find_rule(m, chain[j]);
+        for (size_t k = 0; rule && k < rule->n_dependencies; ++k) {
+            /* only sources; anything with a rule is yet to be made, or was just written */
+            if (!minimake_find_rule(m, rule->dependencies[k])) {
+                minimake_prefetch(m, rule->dependencies[k]);
+            }
+        }
+        *prefetched = j;
+    }
+}
+
+/* a path to work on with minimake_for_each_path(), and the errno it resulted in */
+typedef struct {
+    mm_sv path;
+    int err;
+} mm_path_op;
+
+/* does something to the file `name` in the directory `dirfd`, returns 0 or an errno */
+typedef int (*mm_path_fn)(int dirfd, const char* name, void* arg);
+
+typedef struct {
+    mm_path_op* ops;
+    size_t n_ops;
+    mm_path_fn fn;
+    void* arg;
+} mm_path_batch;
+
+static int mm_path_op_compare(const void* a, const void* b) {
+    const mm_path_op* x = a;
+    const mm_path_op* y = b;
+    int rc = memcmp(x->path.data, y->path.data, x->path.size < y->path.size ? x->path.size : y->path.size);
+    return rc ? rc : (x->path.size > y->path.size) - (x->path.size < y->path.size);
+}
+
+static void* minimake_path_batch_thread(void* arg) {
+    mm_path_batch* batch = arg;
+    char path[PATH_MAX];
+    char dir[PATH_MAX] = "";
+    const char* name;
+    int dirfd = -1;
+    for (size_t i = 0; i < batch->n_ops; ++i) {
+        mm_path_op* op = &batch->ops[i];
+        if (op->path.size >= PATH_MAX) {
+            op->err = ENAMETOOLONG;
+            continue;
+        }
+        memcpy(path, op->path.data, op->path.size);
+        path[op->path.size] = 0;
+        /* sorted, so files in the same directory come one after another */
+        const char* slash = strrchr(path, '/');
+        size_t dir_size = slash ? (size_t)(slash - path) + 1 : 0;
+        if (dirfd < 0 || strlen(dir) != dir_size || memcmp(dir, path, dir_size) != 0) {
+            if (dirfd >= 0) {
+                close(dirfd);
+            }
+            memcpy(dir, path, dir_size);
+            dir[dir_size] = 0;
+            dirfd = open(dir_size ? dir : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        }
+        name = path + dir_size;
+        op->err = dirfd < 0 ? errno : batch->fn(dirfd, name, batch->arg);
+    }
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+    return NULL;
+}
+
+/*
+ * Runs `fn` on every path in `ops`, which is what touching or removing many targets boils down to. To keep
+ * that from being dominated by path lookups and syscall latency, the paths are sorted, each directory is
+ * opened only once, and large batches are split over a few threads.
+ */
+static void minimake_for_each_path(mm_path_op* ops, size_t n_ops, mm_path_fn fn, void* arg) {
+    pthread_t threads[8];
+    mm_path_batch batches[8];
+    size_t n_threads = n_ops / 1024 + 1;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads > sizeof(threads) / sizeof(*threads)) {
+        n_threads = sizeof(threads) / sizeof(*threads);
+    }
+    if (n_cpus > 0 && n_threads > (size_t)n_cpus) {
+        n_threads = n_cpus;
+    }
+    qsort(ops, n_ops, sizeof(*ops), mm_path_op_compare);
+    for (size_t t = 0; t < n_threads; ++t) {
+        batches[t] = (mm_path_batch) { .ops = ops + n_ops * t / n_threads, .n_ops = n_ops * (t + 1) / n_threads - n_ops * t / n_threads, .fn = fn, .arg = arg };
+    }
+    size_t started = 1;
+    for (; started < n_threads; ++started) {
+        if (pthread_create(&threads[started], NULL, minimake_path_batch_thread, &batches[started]) != 0) {
+            break;
+        }
+    }
+    /* the first batch (and any we couldn't start a thread for) is done right here */
+    minimake_path_batch_thread(&batches[0]);
+    for (size_t t = started; t < n_threads; ++t) {
+        minimake_path_batch_thread(&batches[t]);
+    }
+    for (size_t t = 1; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+static int minimake_touch_one(int dirfd, const char* name, void* arg) {
+    struct timespec* times = arg;
+    if (utimensat(dirfd, name, times, 0) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return errno;
+    }
+    /* like touch(1), create what doesn't exist */
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return errno;
+    }
+    int rc = futimens(fd, times) < 0 ? errno : 0;
+    close(fd);
+    return rc;
+}
+
+/* sets the mtime of every target a touch build decided to make. they all get the same time, which is enough
+for all of them to count as up to date (and is why the order doesn't matter) */
+static minimake_result minimake_touch_made(minimake* m) {
+    struct timespec times[2];
+    minimake_result result = minimake_result_ok;
+    if (m->made.size == 0) {
+        return result;
+    }
+    mm_path_op* ops = m->alloc(sizeof(mm_path_op) * m->made.size);
+    if (!ops) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating targets to touch" };
+    }
+    size_t n_ops = 0;
+    for (size_t i = 0; i < m->made.capacity; ++i) {
+        if (m->made.slots[i].data) {
+            ops[n_ops++] = (mm_path_op) { .path = m->made.slots[i], .err = 0 };
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[1] = times[0];
+    minimake_for_each_path(ops, n_ops, minimake_touch_one, times);
+    minimake_stat_cache_invalidate(m);
+    for (size_t i = 0; i < n_ops; ++i) {
+        if (ops[i].err) {
+            sprintf(ERR_BUF, "can't touch \"%.*s\": %s", (int)ops[i].path.size, ops[i].path.data, strerror(ops[i].err));
+            result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "touch" };
+            break;
+        }
+    }
+    m->free(ops);
+    return result;
+}
+
+/*
+ * Targets are made by a scheduler working on the dependency graph: a target is looked at once everything it
+ * depends on is done, and if it's outdated, its commands run as a job, with up to `max_jobs` jobs at once.
+ * Of the targets which are ready, the one furthest back in the chain goes first. That's the order in which
+ * targets have always been made, so a build with one job runs the same commands in the same order as before.
+ */
+typedef enum {
+    /* waiting for dependencies */
+    MM_TARGET_PENDING,
+    /* in the ready queue */
+    MM_TARGET_READY,
+    /* outdated, but missing intermediates it's made from have to be made first */
+    MM_TARGET_WAITING,
+    /* outdated, but another minimake holds its locks, see minimake_retry_parked() */
+    MM_TARGET_PARKED,
+    MM_TARGET_RUNNING,
+    /* a missing intermediate nothing needed so far */
+    MM_TARGET_SKIPPED,
+    MM_TARGET_DONE,
+} mm_target_state;
+
+typedef struct {
+    size_t node;
+    /* the command running now is m->rules[rule].commands[command - 1] */
+    size_t rule;
+    size_t command;
+    pid_t pid;
+    /* to poll for the command to exit, -1 if the kernel can't give us one */
+    int pidfd;
+    /* didn't exist before, so has to exist afterwards */
+    _Bool missing;
+    /* the NUMA node it runs on, see minimake_place_job(), SIZE_MAX if it's not pinned */
+    size_t numa_node;
+    /* how many of the `max_jobs` slots it takes */
+    size_t slots;
+    /* mtime of the target before the job started, all 0 if it didn't exist, to tell whether it was touched */
+    struct timespec old_mtime;
+    /* signalled to stop, after another job failed */
+    _Bool cancelled;
+    /* when it's stopped for taking too long, and when it's considered a straggler; all 0 for never */
+    struct timespec timeout_at;
+    struct timespec straggler_at;
+    /* when it's killed, after having been asked to stop because of one of those */
+    struct timespec kill_at;
+    _Bool timed_out;
+    /* stopped to be run again, see minimake.retry_stragglers */
+    _Bool retrying;
+    _Bool retried;
+    struct timespec start;
+    /* CPU time of the running command already accounted for in the timeline, in seconds */
+    double cpu_seen;
+    /* what "$?" stands for in its commands, allocated, see minimake_changed_inputs() */
+    mm_sv changed;
+    /* set once that's been moved to a response file, since it was too long, and "$?" stands for "@<file>" */
+    _Bool changed_file;
+} mm_job;
+
+typedef struct {
+    /* ms since the build started */
+    uint32_t at_ms;
+    /* how many jobs were running, on average */
+    float jobs;
+    /* in CPUs, so 2.5 means two and a half CPUs were busy on average */
+    float busy;
+    float jobs_busy;
+} mm_cpu_sample;
+
+typedef struct {
+    mm_cpu_sample* samples;
+    size_t n_samples;
+    size_t capacity;
+    struct timespec start;
+    struct timespec last;
+    /* jobs times ms they were running for, since the last sample, accounted up to `tick` */
+    double job_ms;
+    struct timespec tick;
+    unsigned long long last_busy;
+    unsigned long long last_total;
+    /* CPU time of commands which exited since the last sample, in seconds */
+    double exited_cpu;
+    long n_cpus;
+    long ticks_per_second;
+} mm_cpu_timeline;
+
+/*
+ * Rules can be given a priority class, with the special targets ".PRIORITY_HIGH" and ".PRIORITY_LOW".
+ * Of the ready targets, those of a higher class go first, and the commands of each class run in a cgroup of
+ * their own, with a CPU and I/O weight for the class, so low priority work (say, documentation) only gets
+ * what the rest leaves over, and high priority work (what a developer waits for) gets more than its share.
+ */
+typedef enum {
+    /* only while working out the classes, see minimake_load_priorities() */
+    MM_PRIORITY_UNSET,
+    MM_PRIORITY_LOW,
+    MM_PRIORITY_NORMAL,
+    MM_PRIORITY_HIGH,
+    MM_PRIORITIES,
+} mm_priority;
+
+static const char* mm_priority_names[MM_PRIORITIES] = { "unset", "low", "normal", "high" };
+static const int mm_priority_weights[MM_PRIORITIES] = { 100, 10, 100, 400 };
+
+typedef struct {
+    /* cgroup.procs of the cgroup of each class, -1 if there is none */
+    int cgroup_fds[MM_PRIORITIES];
+    /* without cgroups, low priority commands are at least run nicer */
+    int nice[MM_PRIORITIES];
+    char cgroup_dirs[MM_PRIORITIES][PATH_MAX];
+} mm_priorities;
+
+typedef struct {
+    size_t node;
+    /* as passed to minimake_start_target() */
+    _Bool missing;
+} mm_parked;
+
+typedef struct {
+    minimake_graph g;
+    mm_sv* chain;
+    size_t goal;
+    /* where each node's last entry in the chain is, SIZE_MAX if it's not part of this build */
+    size_t* key;
+    /* dependencies not done yet, or, for waiting targets, missing intermediates not made yet */
+    size_t* pending;
+    uint8_t* state;
+    /* a missing intermediate which has to be made after all */
+    uint8_t* forced;
+    /* jobs holding a read lock on this node, since an unlock would drop all of ours at once */
+    uint32_t* readers;
+    /* job slots making this node takes, see minimake_load_job_slots() */
+    uint32_t* slots;
+    /* mm_priority of each node */
+    uint8_t* priority;
+    /* how many seconds the job making each node may take, 0 for no limit */
+    uint32_t* timeout_s;
+    /* how long making each node usually takes, from before this build; NULL unless stragglers or regressions are looked for */
+    mm_baseline* baseline;
+    /* how long making each node took in this build, in ms, UINT32_MAX if it wasn't made; NULL unless regressions are looked for */
+    uint32_t* took_ms;
+    mm_priorities priorities;
+    /* job slots taken by running jobs, which may add up to `max_jobs` */
+    size_t slots_used;
+    /* max-heap of ready nodes, ordered by priority, then key */
+    size_t* ready;
+    size_t n_ready;
+    mm_job* jobs;
+    size_t n_jobs;
+    /* targets whose locks another minimake holds, retried from the loop, see minimake_retry_parked() */
+    mm_parked* parked;
+    size_t n_parked;
+    struct pollfd* fds;
+    char* cmd;
+    size_t cmd_capacity;
+    ssize_t prefetched;
+    _Bool ran_commands;
+    /* set on the first error (or, when only asking, on the first outdated target): nothing new is started */
+    _Bool stop;
+    /* if set, errors don't stop the build, see minimake.keep_going */
+    _Bool keep_going;
+    /* running jobs have been sent SIGTERM, and get SIGKILL at `kill_at`, unless they're gone by then */
+    _Bool cancelling;
+    _Bool killed;
+    struct timespec kill_at;
+    /* process groups of cancelled jobs whose shell exited, but not everything it started */
+    pid_t* lingering;
+    size_t n_lingering;
+    minimake_result result;
+    mm_cpu_timeline* timeline;
+} mm_scheduler;
+
+/* whether ready node `a` goes before `b` */
+static int mm_ready_before(mm_scheduler* s, size_t a, size_t b) {
+    if (s->priority[a] != s->priority[b]) {
+        return s->priority[a] > s->priority[b];
+    }
+    return s->key[a] > s->key[b];
+}
+
+static void mm_ready_push(mm_scheduler* s, size_t node) {
+    size_t i = s->n_ready++;
+    s->state[node] = MM_TARGET_READY;
+    for (; i > 0 && mm_ready_before(s, node, s->ready[(i - 1) / 2]); i = (i - 1) / 2) {
+        s->ready[i] = s->ready[(i - 1) / 2];
+    }
+    s->ready[i] = node;
+}
+
+static size_t mm_ready_pop(mm_scheduler* s) {
+    size_t top = s->ready[0];
+    size_t last = s->ready[--s->n_ready];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= s->n_ready) {
+            break;
+        }
+        if (child + 1 < s->n_ready && mm_ready_before(s, s->ready[child + 1], s->ready[child])) {
+            ++child;
+        }
+        if (!mm_ready_before(s, s->ready[child], last)) {
+            break;
+        }
+        s->ready[i] = s->ready[child];
+        i = child;
+    }
+    s->ready[i] = last;
+    return top;
+}
+
+static void minimake_fail(mm_scheduler* s, minimake_result result) {
+    if (s->result.ok) {
+        s->result = result;
+    } else if (s->keep_going) {
+        /* only the first error is returned, so the others are reported as they happen */
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+    }
+    if (!s->keep_going) {
+        s->stop = 1;
+    }
+}
+
+/* parses the CPU time used by all CPUs so far, in clock ticks, from the first line of /proc/stat */
+static int minimake_parse_cpu_times(const char* stat, unsigned long long* busy, unsigned long long* total) {
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+    if (sscanf(stat, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) != 8) {
+        return -1;
+    }
+    *busy = user + nice + system + irq + softirq + steal;
+    *total = *busy + idle + iowait;
+    return 0;
+}
+
+/* reads the CPU time used by all CPUs so far, in clock ticks, from /proc/stat */
+static int minimake_read_cpu_times(unsigned long long* busy, unsigned long long* total) {
+    char buffer[256];
+    int fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buffer[len] = 0;
+    return minimake_parse_cpu_times(buffer, busy, total);
+}
+
+/* how many CPUs were busy on average between two readings of /proc/stat, given as busy and total ticks */
+static double minimake_cpu_busy(unsigned long long last_busy, unsigned long long last_total,
+    unsigned long long busy, unsigned long long total, long n_cpus) {
+    if (total <= last_total || busy < last_busy) {
+        return 0;
+    }
+    return (double)(busy - last_busy) / (total - last_total) * n_cpus;
+}
+
+/* how deep into a job's process tree we look for CPU time */
+#define MINIMAKE_PROCESS_TREE_DEPTH 16
+
+/*
+ * The CPU time, in seconds, used so far by a process and everything below it. A process' own time is in
+ * /proc/<pid>/stat, along with the time of the children it has already waited for; the ones still running
+ * are found through /proc/<pid>/task/<pid>/children. The shell running a command usually doesn't exec it,
+ * so without this, we wouldn't see any of a command's time until it's over.
+ */
+static double minimake_read_process_cpu(pid_t pid, long ticks_per_second, int depth) {
+    char path[64];
+    char buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buffer[len] = 0;
+    /* the command name may contain anything, so start after the last ')', at field 3 */
+    char* fields = strrchr(buffer, ')');
+    unsigned long long utime, stime;
+    long long cutime, cstime;
+    if (!fields || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld %lld", &utime, &stime, &cutime, &cstime) != 4) {
+        return 0;
+    }
+    double cpu = (double)(utime + stime + cutime + cstime) / ticks_per_second;
+    if (depth >= MINIMAKE_PROCESS_TREE_DEPTH) {
+        return cpu;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid, (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return cpu;
+    }
+    len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[len > 0 ? len : 0] = 0;
+    for (char* p = buffer; *p;) {
+        char* end;
+        long child = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        cpu += minimake_read_process_cpu((pid_t)child, ticks_per_second, depth + 1);
+        p = end;
+    }
+    return cpu;
+}
+
+static double mm_timespec_ms(struct timespec* from, struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static int mm_timespec_set(const struct timespec* t) {
+    return t->tv_sec != 0 || t->tv_nsec != 0;
+}
+
+static struct timespec mm_timespec_after_ms(const struct timespec* t, double ms) {
+    struct timespec result = *t;
+    long long ns = (long long)(ms * 1e6) + result.tv_nsec;
+    result.tv_sec += ns / 1000000000LL;
+    result.tv_nsec = ns % 1000000000LL;
+    return result;
+}
+
+/* accounts for the jobs which ran since the last tick; called before anything changes how many there are */
+static void minimake_timeline_tick(mm_scheduler* s) {
+    struct timespec now;
+    if (!s->timeline) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s->timeline->job_ms += s->n_jobs * mm_timespec_ms(&s->timeline->tick, &now);
+    s->timeline->tick = now;
+}
+
+/* adds a sample of how busy the machine, and our jobs in particular, were since the last one */
+static void minimake_sample_cpu(minimake* m, mm_scheduler* s) {
+    mm_cpu_timeline* t = s->timeline;
+    struct timespec now;
+    unsigned long long busy, total;
+    minimake_timeline_tick(s);
+    now = t->tick;
+    double elapsed = mm_timespec_ms(&t->last, &now) / 1000.0;
+    if (elapsed <= 0 || minimake_read_cpu_times(&busy, &total) < 0) {
+        return;
+    }
+    if (t->n_samples == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 256;
+        mm_cpu_sample* samples = m->alloc(sizeof(mm_cpu_sample) * capacity);
+        if (!samples) {
+            return;
+        }
+        if (t->samples) {
+            memcpy(samples, t->samples, sizeof(mm_cpu_sample) * t->n_samples);
+            m->free(t->samples);
+        }
+        t->samples = samples;
+        t->capacity = capacity;
+    }
+    double jobs_cpu = t->exited_cpu;
+    for (size_t i = 0; i < s->n_jobs; ++i) {
+        double cpu = minimake_read_process_cpu(s->jobs[i].pid, t->ticks_per_second, 0);
+        if (cpu > s->jobs[i].cpu_seen) {
+            jobs_cpu += cpu - s->jobs[i].cpu_seen;
+            s->jobs[i].cpu_seen = cpu;
+        }
+    }
+    mm_cpu_sample* sample = &t->samples[t->n_samples++];
+    sample->at_ms = (uint32_t)mm_timespec_ms(&t->start, &now);
+    sample->jobs = (float)(t->job_ms / (elapsed * 1000));
+    sample->busy = (float)minimake_cpu_busy(t->last_busy, t->last_total, busy, total, t->n_cpus);
+    sample->jobs_busy = (float)(jobs_cpu / elapsed);
+    t->last = now;
+    t->last_busy = busy;
+    t->last_total = total;
+    t->exited_cpu = 0;
+    t->job_ms = 0;
+}
+
+/* the totals printed under the timeline */
+typedef struct {
+    double seconds;
+    /* of all CPUs, in percent */
+    double utilization;
+    double serial_seconds;
+    double idle_seconds;
+} mm_cpu_summary;
+
+/*
+ * Adds up the samples. Each one covers the time since the one before it; those where about one job was running
+ * on average count as serial, and those where about none was count as idle.
+ */
+static mm_cpu_summary minimake_summarize_cpu(const mm_cpu_sample* samples, size_t n_samples, long n_cpus) {
+    mm_cpu_summary summary = { 0 };
+    double busy = 0;
+    for (size_t i = 0; i < n_samples; ++i) {
+        double ms = samples[i].at_ms - (i > 0 ? samples[i - 1].at_ms : 0);
+        busy += samples[i].busy * ms;
+        if (samples[i].jobs < 0.05) {
+            summary.idle_seconds += ms / 1000;
+        } else if (samples[i].jobs < 1.05) {
+            summary.serial_seconds += ms / 1000;
+        }
+    }
+    double total_ms = n_samples > 0 ? samples[n_samples - 1].at_ms : 0;
+    summary.seconds = total_ms / 1000;
+    summary.utilization = total_ms > 0 && n_cpus > 0 ? busy / total_ms / n_cpus * 100 : 0;
+    return summary;
+}
+
+#define MINIMAKE_TIMELINE_ROWS 40
+#define MINIMAKE_TIMELINE_WIDTH 50
+
+/*
+ * Prints the samples as one bar per row, '#' for CPUs busy with our jobs and '+' for CPUs busy with anything
+ * else. With many samples, several go into one row. A long run of rows with a single job and a short bar is
+ * the tail of a build waiting for one slow command.
+ */
+static void minimake_print_cpu_timeline(mm_cpu_timeline* t, unsigned interval_ms) {
+    char bar[MINIMAKE_TIMELINE_WIDTH + 1];
+    if (t->n_samples == 0) {
+        return;
+    }
+    size_t per_row = (t->n_samples + MINIMAKE_TIMELINE_ROWS - 1) / MINIMAKE_TIMELINE_ROWS;
+    printf("CPU utilization, %ld CPUs, %gs per row ('#' build jobs, '+' everything else):\n", t->n_cpus, per_row * interval_ms / 1000.0);
+    for (size_t row = 0; row * per_row < t->n_samples; ++row) {
+        size_t end = (row + 1) * per_row < t->n_samples ? (row + 1) * per_row : t->n_samples;
+        double busy = 0, jobs_busy = 0, jobs = 0;
+        for (size_t i = row * per_row; i < end; ++i) {
+            mm_cpu_sample* sample = &t->samples[i];
+            busy += sample->busy;
+            jobs_busy += sample->jobs_busy;
+            jobs += sample->jobs;
+        }
+        busy /= end - row * per_row;
+        jobs_busy /= end - row * per_row;
+        jobs /= end - row * per_row;
+        /* jobs are part of the machine's load, which is measured separately, so the two may disagree a little */
+        if (jobs_busy > busy) {
+            busy = jobs_busy;
+        }
+        size_t n_jobs = (size_t)(jobs_busy / t->n_cpus * MINIMAKE_TIMELINE_WIDTH + 0.5);
+        size_t n_busy = (size_t)(busy / t->n_cpus * MINIMAKE_TIMELINE_WIDTH + 0.5);
+        n_busy = n_busy > MINIMAKE_TIMELINE_WIDTH ? MINIMAKE_TIMELINE_WIDTH : n_busy;
+        n_jobs = n_jobs > n_busy ? n_busy : n_jobs;
+        memset(bar, '#', n_jobs);
+        memset(bar + n_jobs, '+', n_busy - n_jobs);
+        memset(bar + n_busy, ' ', MINIMAKE_TIMELINE_WIDTH - n_busy);
+        bar[MINIMAKE_TIMELINE_WIDTH] = 0;
+        double row_start = row > 0 ? t->samples[row * per_row - 1].at_ms / 1000.0 : 0;
+        printf("%7.1fs %5.1f jobs |%s| %3.0f%%\n", row_start, jobs, bar, n_busy * 100.0 / MINIMAKE_TIMELINE_WIDTH);
+    }
+    mm_cpu_summary summary = minimake_summarize_cpu(t->samples, t->n_samples, t->n_cpus);
+    printf("%.1fs, %.0f%% average utilization, %.1fs with a single job running, %.1fs with none\n", summary.seconds,
+        summary.utilization, summary.serial_seconds, summary.idle_seconds);
+}
+
+/* lets the users of `node` know it's done, or, for a missing intermediate, skipped */
+static void minimake_notify_users(mm_scheduler* s, size_t node, mm_target_state waiting_in) {
+    for (size_t e = s->g.users_start[node]; e < s->g.users_start[node + 1]; ++e) {
+        size_t user = s->g.users[e];
+        if (s->key[user] != SIZE_MAX && s->state[user] == waiting_in && --s->pending[user] == 0) {
+            mm_ready_push(s, user);
+        }
+    }
+}
+
+static void minimake_finish_target(minimake* m, mm_scheduler* s, size_t node, int made) {
+    if (made) {
+        mm_set_insert(m, &m->made, s->g.names[node]);
+    }
+    s->state[node] = MM_TARGET_DONE;
+    /* a forced intermediate already counted as done for its users when it was skipped, so it only wakes the
+    ones waiting for it specifically */
+    minimake_notify_users(s, node, s->forced[node] ? MM_TARGET_WAITING : MM_TARGET_PENDING);
+}
+
+/* releases the read locks on the dependencies of `node` up to (not including) edge `end` */
+static void minimake_unlock_dependencies(minimake* m, mm_scheduler* s, size_t node, size_t end) {
+    for (size_t e = s->g.deps_start[node]; e < end; ++e) {
+        size_t dep = s->g.deps[e];
+        if ((s->g.flags[dep] & MM_NODE_HAS_RULE) && --s->readers[dep] == 0) {
+            minimake_lock(m, s->g.names[dep], F_UNLCK, 0);
+        }
+    }
+}
+
+/*
+ * Takes (or, with F_UNLCK, releases) the locks for making `node`, see minimake_lock(). Returns -1, holding none
+ * of them, if another minimake has one of them; with `wait`, it waits for the one on `node` itself, but never
+ * for those on dependencies, since it holds that one by then.
+ */
+static int minimake_lock_target(minimake* m, mm_scheduler* s, size_t node, short type, int wait) {
+    size_t end = s->g.deps_start[node + 1];
+    if (type == F_UNLCK) {
+        minimake_unlock_dependencies(m, s, node, end);
+        minimake_lock(m, s->g.names[node], F_UNLCK, 0);
+        return 0;
+    }
+    if (minimake_lock(m, s->g.names[node], type, wait) < 0) {
+        return -1;
+    }
+    for (size_t e = s->g.deps_start[node]; e < end; ++e) {
+        size_t dep = s->g.deps[e];
+        if (!(s->g.flags[dep] & MM_NODE_HAS_RULE) || s->readers[dep]++ > 0) {
+            continue;
+        }
+        if (minimake_lock(m, s->g.names[dep], F_RDLCK, 0) < 0) {
+            --s->readers[dep];
+            minimake_unlock_dependencies(m, s, node, e);
+            minimake_lock(m, s->g.names[node], F_UNLCK, 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* moves `job` on to its next command, and returns it, or a NULL command if there are none left */
+static mm_sv minimake_job_advance(minimake* m, mm_scheduler* s, mm_job* job) {
+    mm_sv target = s->g.names[job->node];
+    for (; job->rule < m->n_rules; ++job->rule, job->command = 0) {
+        minimake_rule* rule = &m->rules[job->rule];
+        if (job->command < rule->n_commands && mm_sv_eq(rule->target, target)) {
+            return rule->commands[job->command++];
+        }
+    }
+    return (mm_sv) { .data = NULL, .size = 0 };
+}
+
+/* where the response file of `job` goes, see minimake_write_changed_file() */
+static void minimake_changed_file(mm_job* job, char* path, size_t size) {
+    snprintf(path, size, MINIMAKE_STATE_DIR "/changed-%d-%zu", (int)getpid(), job->node);
+}
+
+/*
+ * A list of changed dependencies too long for a command is written to a response file instead, one per line,
+ * and "$?" becomes "@<file>", which compilers, linkers, ar and most other tools taking many files understand.
+ * The file goes away with the job.
+ */
+static minimake_result minimake_write_changed_file(minimake* m, mm_scheduler* s, mm_job* job) {
+    char path[PATH_MAX];
+    minimake_changed_file(job, path, sizeof(path));
+    char* list = (char*)job->changed.data;
+    int fd = minimake_open_state(path, O_WRONLY | O_TRUNC);
+    int ok = fd >= 0;
+    if (ok) {
+        for (size_t i = 0; i < job->changed.size; ++i) {
+            list[i] = list[i] == ' ' ? '\n' : list[i];
+        }
+        ok = write(fd, list, job->changed.size) == (ssize_t)job->changed.size && write(fd, "\n", 1) == 1;
+        close(fd);
+        /* from here on, the file is removed with the job */
+        job->changed_file = 1;
+    }
+    if (!ok) {
+        sprintf(ERR_BUF, "can't write the changed dependencies of \"%.*s\" to \"%s\"", (int)s->g.names[job->node].size, s->g.names[job->node].data, path);
+        return (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "response file" };
+    }
+    m->free(list);
+    /* the commands of a variant run elsewhere */
+    const char* dir = m->rules[job->rule].variant ? m->source_dir : NULL;
+    size_t size = 1 + (dir ? strlen(dir) + 1 : 0) + strlen(path);
+    job->changed.data = m->alloc(size + 1);
+    if (!job->changed.data) {
+        job->changed.size = 0;
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating response file name" };
+    }
+    snprintf((char*)job->changed.data, size + 1, "@%s%s%s", dir ? dir : "", dir ? "/" : "", path);
+    job->changed.size = size;
+    return minimake_result_ok;
+}
+
+/* starts the next command of `job`; returns 0 if there are none left, -1 if it couldn't be started */
+static int minimake_job_next(minimake* m, mm_scheduler* s, mm_job* job) {
+    mm_sv command = minimake_job_advance(m, s, job);
+    if (!command.data) {
+        return 0;
+    }
+    if (!job->changed_file && minimake_expanded_size(command, job->changed) > MINIMAKE_MAX_COMMAND) {
+        minimake_result result = minimake_write_changed_file(m, s, job);
+        if (!result.ok) {
+            minimake_fail(s, result);
+            return -1;
+        }
+    }
+    if (!minimake_expand_command(m, command, job->changed, &s->cmd, &s->cmd_capacity)) {
+        minimake_fail(s, (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating command" });
+        return -1;
+    }
+    minimake_print_command(m, &m->rules[job->rule], s->cmd);
+    s->ran_commands = 1;
+    job->cpu_seen = 0;
+    mm_spawn_options options = {
+        .cpus = job->numa_node != SIZE_MAX ? &m->topology->cpus[job->numa_node] : NULL,
+        .slots = job->slots,
+        .cgroup_fd = s->priorities.cgroup_fds[s->priority[job->node]],
+        .nice = s->priorities.nice[s->priority[job->node]],
+        .variant = minimake_rule_variant(m, &m->rules[job->rule]),
+    };
+    job->pid = minimake_spawn(s->cmd, &options, &job->pidfd);
+    if (job->pid < 0) {
+        sprintf(ERR_BUF, "can't run command \"%s\": %s", s->cmd, strerror(errno));
+        minimake_fail(s, (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "command" });
+        return -1;
+    }
+    MM_PROBE(command__start, s->g.names[job->node].data, s->g.names[job->node].size, s->cmd, job->pid);
+    return 1;
+}
+
+/* `job` is over, because its last command exited (`ok` if it succeeded), or because the next couldn't start */
+static void minimake_end_job(minimake* m, mm_scheduler* s, mm_job* job, int ok) {
+    char filename[PATH_MAX];
+    mm_sv target = s->g.names[job->node];
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    MM_PROBE(job__done, target.data, target.size, ok, (long long)(mm_timespec_ms(&job->start, &end) * 1000));
+    if (ok) {
+        minimake_log_duration(m, target, &job->start, &end);
+        if (s->took_ms) {
+            double ms = mm_timespec_ms(&job->start, &end);
+            s->took_ms[job->node] = ms < UINT32_MAX ? (uint32_t)ms : UINT32_MAX - 1;
+        }
+    }
+    if (job->numa_node != SIZE_MAX) {
+        m->topology->jobs[job->numa_node] -= job->slots;
+    }
+    if (job->changed_file) {
+        minimake_changed_file(job, filename, sizeof(filename));
+        unlink(filename);
+    }
+    if (job->changed.data) {
+        m->free((void*)job->changed.data);
+    }
+    s->slots_used -= job->slots;
+    /* before unlocking, so that whoever waits for the lock sees what we made */
+    minimake_stat_cache_invalidate(m);
+    minimake_lock_target(m, s, job->node, F_UNLCK, 0);
+    if (!ok) {
+        return;
+    }
+    /* check that the rule succeeded by doing another stat */
+    struct stat st;
+    snprintf(filename, sizeof(filename), "%.*s", (int)target.size, target.data);
+    if (job->missing && minimake_stat(m, filename, &st) < 0) {
+        sprintf(ERR_BUF, "rule \"%.*s\" should have created \"%s\", but after running the rule, minimake checked, and got the error: %s", (int)target.size, target.data, filename, strerror(errno));
+        minimake_fail(s, (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "stat" });
+        return;
+    }
+    minimake_remember_normalized(m, target);
+    minimake_finish_target(m, s, job->node, 1);
+}
+
+/* how long jobs asked to stop (cancelled, or too slow) get to clean up after themselves, after SIGTERM, before they're killed */
+#define MINIMAKE_CANCEL_GRACE_MS 3000
+
+/* a job doesn't count as a straggler unless it's at least this late, however quick it usually is */
+#define MINIMAKE_STRAGGLER_MIN_LATE_MS 2000
+
+/* works out when the job, which has just started, would be too slow */
+static void minimake_set_deadlines(minimake* m, mm_scheduler* s, mm_job* job) {
+    memset(&job->timeout_at, 0, sizeof(job->timeout_at));
+    memset(&job->straggler_at, 0, sizeof(job->straggler_at));
+    memset(&job->kill_at, 0, sizeof(job->kill_at));
+    if (s->timeout_s[job->node]) {
+        job->timeout_at = mm_timespec_after_ms(&job->start, s->timeout_s[job->node] * 1000.0);
+    }
+    uint32_t typical = s->baseline && m->straggler_factor > 0 ? s->baseline[job->node].median_ms : 0;
+    if (typical) {
+        double late = typical * m->straggler_factor;
+        if (late < typical + MINIMAKE_STRAGGLER_MIN_LATE_MS) {
+            late = typical + MINIMAKE_STRAGGLER_MIN_LATE_MS;
+        }
+        job->straggler_at = mm_timespec_after_ms(&job->start, late);
+    }
+}
+
+/* asks a job to stop, with everything it started; if it's still there after the grace period, it's killed */
+static void minimake_stop_job(mm_job* job, const struct timespec* now) {
+    kill(-job->pid, SIGTERM);
+    job->kill_at = mm_timespec_after_ms(now, MINIMAKE_CANCEL_GRACE_MS);
+}
+
+/*
+ * Acts on the deadlines of running jobs which have passed: stops jobs over their timeout, warns about
+ * stragglers, which take much longer than they usually do, and maybe stops those to run them again, since
+ * a hang (say, a deadlock in a code generator) often doesn't happen twice.
+ * Returns the ms until the next deadline, or -1 if there is none, for the scheduler to wait at most that long.
+ */
+static int minimake_check_deadlines(minimake* m, mm_scheduler* s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double next = -1;
+    for (size_t i = 0; i < s->n_jobs; ++i) {
+        mm_job* job = &s->jobs[i];
+        mm_sv target = s->g.names[job->node];
+        struct timespec* deadlines[] = { &job->kill_at, &job->timeout_at, &job->straggler_at };
+        for (size_t d = 0; d < sizeof(deadlines) / sizeof(*deadlines) && !job->cancelled; ++d) {
+            if (!mm_timespec_set(deadlines[d])) {
+                continue;
+            }
+            double left = mm_timespec_ms(&now, deadlines[d]);
+            if (left > 0) {
+                next = next < 0 || left < next ? left : next;
+                continue;
+            }
+            memset(deadlines[d], 0, sizeof(*deadlines[d]));
+            double elapsed = mm_timespec_ms(&job->start, &now) / 1000.0;
+            if (deadlines[d] == &job->kill_at) {
+                kill(-job->pid, SIGKILL);
+            } else if (deadlines[d] == &job->timeout_at) {
+                printf("\"%.*s\" is over its timeout of %us, stopping it\n", (int)target.size, target.data, s->timeout_s[job->node]);
+                job->timed_out = 1;
+                minimake_stop_job(job, &now);
+            } else {
+                int retry = m->retry_stragglers && !job->retried && !job->timed_out;
+                printf("\"%.*s\" is taking long: %.1fs so far, usually %.1fs%s\n", (int)target.size, target.data,
+                    elapsed, s->baseline[job->node].median_ms / 1000.0, retry ? ", running it again" : "");
+                if (retry) {
+                    job->retrying = 1;
+                    minimake_stop_job(job, &now);
+                }
+            }
+            fflush(stdout);
+            /* look at all of them again, since it may have got a new one */
+            d = (size_t)-1;
+        }
+    }
+    return next < 0 ? -1 : (int)next + 1;
+}
+
+/* regressions need this much history to be told from noise */
+#define MINIMAKE_REGRESSION_MIN_SAMPLES 5
+/* and to be at least this much slower (by 20%, and 200ms), so that a 10ms step taking 30ms doesn't count */
+#define MINIMAKE_REGRESSION_MIN_RATIO 1.2
+#define MINIMAKE_REGRESSION_MIN_MS 200
+/* the modified z-score (Iglewicz and Hoaglin) above which a duration is an outlier */
+#define MINIMAKE_REGRESSION_MIN_SCORE 3.5
+
+/*
+ * How far `ms` is off `baseline`, in (robust) standard deviations; any slowdown of a target that always took
+ * the same time counts as far off. Returns 0 unless it's a regression, i.e. slower by enough to matter.
+ */
+static double minimake_regression_score(const mm_baseline* baseline, uint32_t ms) {
+    if (baseline->samples < MINIMAKE_REGRESSION_MIN_SAMPLES || ms < baseline->median_ms * MINIMAKE_REGRESSION_MIN_RATIO
+        || ms < baseline->median_ms + MINIMAKE_REGRESSION_MIN_MS) {
+        return 0;
+    }
+    double score = baseline->mad_ms ? 0.6745 * (ms - baseline->median_ms) / baseline->mad_ms : INFINITY;
+    return score > MINIMAKE_REGRESSION_MIN_SCORE ? score : 0;
+}
+
+/* writes `name` as a JSON string */
+static void minimake_write_json_string(FILE* file, mm_sv name) {
+    fputc('"', file);
+    for (size_t i = 0; i < name.size; ++i) {
+        unsigned char c = name.data[i];
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/*
+ * After a build, compares how long each target took with how long it usually takes (before this build), and lists
+ * the ones which got markedly slower: a change to a header everything includes, a compiler flag, or a machine
+ * which is busy with something else all show up here long before anyone notices the whole build got slower.
+ * With minimake.regressions_file, they are also written there, for CI to pick up; the file is rewritten on
+ * every build, so an empty one means nothing regressed.
+ */
+static void minimake_report_regressions(minimake* m, mm_scheduler* s) {
+    FILE* file = NULL;
+    if (m->regressions_file) {
+        file = fopen(m->regressions_file, "w");
+        if (!file) {
+            printf("WARNING: can't write regressions to \"%s\": %s\n", m->regressions_file, strerror(errno));
+        }
+    }
+    int found = 0;
+    for (size_t node = 0; node < s->g.n_nodes; ++node) {
+        uint32_t ms = s->took_ms[node];
+        double score = ms == UINT32_MAX ? 0 : minimake_regression_score(&s->baseline[node], ms);
+        if (score == 0) {
+            continue;
+        }
+        mm_baseline* baseline = &s->baseline[node];
+        mm_sv target = s->g.names[node];
+        if (!found++) {
+            printf("slower than usual:\n");
+        }
+        printf("  %.*s %.1fs, usually %.1fs (+%.0f%%)\n", (int)target.size, target.data, ms / 1000.0,
+            baseline->median_ms / 1000.0, baseline->median_ms ? 100.0 * ms / baseline->median_ms - 100 : 100);
+        if (file) {
+            fprintf(file, "{\"target\":");
+            minimake_write_json_string(file, target);
+            fprintf(file, ",\"ms\":%u,\"median_ms\":%u,\"mad_ms\":%u,\"samples\":%u,\"score\":", ms,
+                baseline->median_ms, baseline->mad_ms, baseline->samples);
+            /* JSON has no infinity */
+            if (isinf(score)) {
+                fprintf(file, "null}\n");
+            } else {
+                fprintf(file, "%.2f}\n", score);
+            }
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+}
+
+/* makes `node`, which is outdated, under its lock, unless another minimake made it while we were waiting for that lock */
+static void minimake_start_target(minimake* m, mm_scheduler* s, size_t node, int missing, int wait) {
+    char filename[PATH_MAX];
+    char dep_filename[PATH_MAX];
+    mm_sv target = s->g.names[node];
+    snprintf(filename, sizeof(filename), "%.*s", (int)target.size, target.data);
+    int retry = s->state[node] == MM_TARGET_PARKED;
+    s->state[node] = MM_TARGET_RUNNING;
+
+    if (m->mode == MINIMAKE_MODE_TOUCH) {
+        if (!(s->g.flags[node] & MM_NODE_HAS_RULE)) {
+            sprintf(ERR_BUF, "no rule to make \"%s\"", filename);
+            minimake_fail(s, (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "no context" });
+            return;
+        }
+        /* the actual touching happens all at once, see minimake_touch_made() */
+        printf("touch %s\n", filename);
+        minimake_finish_target(m, s, node, 1);
+        return;
+    }
+
+    /* we need to be made, so the missing intermediates we're made from are needed after all. they're made
+    first, and then we get another look */
+    size_t waiting = 0;
+    for (size_t e = s->g.deps_start[node]; e < s->g.deps_start[node + 1]; ++e) {
+        size_t dep = s->g.deps[e];
+        struct stat dep_st;
+        snprintf(dep_filename, sizeof(dep_filename), "%.*s", (int)s->g.names[dep].size, s->g.names[dep].data);
+        if (s->state[dep] == MM_TARGET_SKIPPED && minimake_stat(m, dep_filename, &dep_st) < 0 && errno == ENOENT) {
+            s->forced[dep] = 1;
+            mm_ready_push(s, dep);
+        }
+        waiting += s->forced[dep] && s->state[dep] != MM_TARGET_DONE;
+    }
+    if (waiting) {
+        s->state[node] = MM_TARGET_WAITING;
+        s->pending[node] = waiting;
+        return;
+    }
+
+    if (m->mode == MINIMAKE_MODE_DRY_RUN) {
+        /* only prints the commands */
+        mm_sv changed = { .data = NULL, .size = 0 };
+        struct stat st;
+        minimake_result result = minimake_result_ok;
+        if (minimake_uses_changed(m, target)) {
+            result = minimake_changed_inputs(m, target, minimake_stat(m, filename, &st) == 0 ? &st : NULL, &changed);
+        }
+        if (result.ok) {
+            result = minimake_make(m, &target, changed, &s->cmd, &s->cmd_capacity);
+        }
+        if (changed.data) {
+            m->free((void*)changed.data);
+        }
+        if (!result.ok) {
+            minimake_fail(s, result);
+            return;
+        }
+        minimake_finish_target(m, s, node, 1);
+        return;
+    }
+
+    /* another minimake is making it, or one of its inputs; we get back to it once that's done */
+    if (minimake_lock_target(m, s, node, F_WRLCK, wait) < 0) {
+        if (!retry) {
+            printf("\"%.*s\" is being made by another minimake, waiting for it to finish\n", (int)target.size, target.data);
+            fflush(stdout);
+        }
+        s->state[node] = MM_TARGET_PARKED;
+        s->parked[s->n_parked++] = (mm_parked) { .node = node, .missing = missing };
+        return;
+    }
+
+    /* the target itself is the record of a finished build: if it's up to date now, the other process made it */
+    struct stat st;
+    int outdated = 1;
+    int exists = minimake_stat(m, filename, &st) == 0;
+    minimake_result result = minimake_result_ok;
+    if (exists) {
+        result = minimake_is_outdated(m, &target, &st, &outdated);
+    } else if (node != s->goal) {
+        /* whatever was asked for explicitly is kept, even if it's intermediate */
+        minimake_stage(m, &s->g.names[node], filename);
+    }
+    if (result.ok && outdated && !(s->g.flags[node] & MM_NODE_HAS_RULE)) {
+        sprintf(ERR_BUF, "no rule to make \"%s\"", filename);
+        result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "no context" };
+    }
+    mm_sv changed = { .data = NULL, .size = 0 };
+    if (result.ok && outdated && minimake_uses_changed(m, target)) {
+        result = minimake_changed_inputs(m, target, exists ? &st : NULL, &changed);
+    }
+    if (!result.ok || !outdated) {
+        minimake_lock_target(m, s, node, F_UNLCK, 0);
+        if (result.ok) {
+            minimake_finish_target(m, s, node, 0);
+        } else {
+            minimake_fail(s, result);
+        }
+        return;
+    }
+
+    mm_job* job = &s->jobs[s->n_jobs++];
+    memset(job, 0, sizeof(*job));
+    job->node = node;
+    job->pidfd = -1;
+    job->missing = missing;
+    job->changed = changed;
+    if (exists) {
+        job->old_mtime = st.st_mtim;
+    }
+    job->slots = s->slots[node];
+    s->slots_used += job->slots;
+    job->numa_node = m->topology ? minimake_place_job(m->topology, job->slots) : SIZE_MAX;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    MM_PROBE(job__start, s->g.names[node].data, s->g.names[node].size, job->slots, job->numa_node);
+    minimake_set_deadlines(m, s, job);
+    int started = minimake_job_next(m, s, job);
+    if (started <= 0) {
+        /* either there are no commands, which is done already, or they can't be run */
+        mm_job done = *job;
+        --s->n_jobs;
+        minimake_end_job(m, s, &done, started == 0);
+    }
+}
+
+/* all dependencies of `node` are done, so find out whether it's outdated, and if so, start making it */
+static void minimake_check_target(minimake* m, mm_scheduler* s, size_t node) {
+    char filename[PATH_MAX];
+    mm_sv target = s->g.names[node];
+    if (s->g.flags[node] & MM_NODE_VARIANTS) {
+        /* not a file, just all the variants together */
+        minimake_finish_target(m, s, node, 0);
+        return;
+    }
+    /* 1. check if that file exists */
+    if (target.size >= PATH_MAX) {
+        minimake_fail(s, (minimake_result) { .ok = 0, .message = "path too long", .context = "target" });
+        return;
+    }
+    memcpy(filename, target.data, target.size);
+    filename[target.size] = 0;
+    struct stat st;
+    int missing = 0;
+    int outdated = 0;
+    MM_PROBE(check__start, target.data, target.size);
+    int exists = minimake_stat(m, filename, &st) == 0;
+    if (exists && minimake_remove_stale_stage(m, filename, &st)) {
+        exists = 0;
+        errno = ENOENT;
+    }
+    if (!exists) {
+        if (errno != ENOENT) {
+            sprintf(ERR_BUF, "error determining if \"%s\" exists: %s", filename, strerror(errno));
+            minimake_fail(s, (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "stat" });
+            return;
+        }
+        if (node != s->goal && minimake_may_be_missing(m, target)) {
+            /* made later, if something which depends on it turns out to be outdated */
+            MM_PROBE(check__done, target.data, target.size, 0, 1);
+            s->state[node] = MM_TARGET_SKIPPED;
+            minimake_notify_users(s, node, MM_TARGET_PENDING);
+            return;
+        }
+        /* 2a. if it doesn't exist, execute the commands */
+        missing = 1;
+        outdated = 1;
+    } else {
+        /* 2b. does exist, check that the modified time of all dependencies is older than the target's modification time */
+        minimake_result result = minimake_is_outdated(m, &target, &st, &outdated);
+        if (!result.ok) {
+            minimake_fail(s, result);
+            return;
+        }
+    }
+    MM_PROBE(check__done, target.data, target.size, outdated, missing);
+    if (!outdated) {
+        minimake_finish_target(m, s, node, 0);
+        return;
+    }
+    if (m->mode == MINIMAKE_MODE_QUESTION) {
+        if (!(s->g.flags[node] & MM_NODE_HAS_RULE)) {
+            /* not outdated, but broken, which a build would have told us too */
+            sprintf(ERR_BUF, "no rule to make \"%s\"", filename);
+            minimake_fail(s, (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "no context" });
+            return;
+        }
+        /* that's all we wanted to know */
+        m->outdated = 1;
+        s->stop = 1;
+        return;
+    }
+    minimake_prefetch_ahead(m, s->chain, (ssize_t)s->key[node], &s->prefetched);
+    minimake_start_target(m, s, node, missing, 0);
+}
+
+/*
+ * A cancelled job may have left its target half written, which, having a new mtime, would look up to date to
+ * the next build, so like make does when interrupted, we delete it, if the job changed it.
+ * Staged intermediates are symlinks, which minimake_unstage() takes care of.
+ */
+static void minimake_delete_partial_output(minimake* m, mm_scheduler* s, mm_job* job) {
+    char filename[PATH_MAX];
+    struct stat st;
+    mm_sv target = s->g.names[job->node];
+    snprintf(filename, sizeof(filename), "%.*s", (int)target.size, target.data);
+    if (lstat(filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (st.st_mtim.tv_sec == job->old_mtime.tv_sec && st.st_mtim.tv_nsec == job->old_mtime.tv_nsec) {
+        return;
+    }
+    printf("deleting \"%s\"\n", filename);
+    if (unlink(filename) == 0) {
+        minimake_stat_cache_invalidate(m);
+    }
+}
+
+/* asks all running jobs, with everything they started, to stop; those still there at `kill_at` are killed */
+static void minimake_cancel_jobs(mm_scheduler* s) {
+    if (s->n_jobs > 0) {
+        printf("cancelling %zu running job%s\n", s->n_jobs, s->n_jobs == 1 ? "" : "s");
+        fflush(stdout);
+    }
+    for (size_t i = 0; i < s->n_jobs; ++i) {
+        s->jobs[i].cancelled = 1;
+        /* the job isn't reaped yet, so its pid, and the group named after it, can't have been reused */
+        kill(-s->jobs[i].pid, SIGTERM);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s->kill_at = mm_timespec_after_ms(&now, MINIMAKE_CANCEL_GRACE_MS);
+    s->cancelling = 1;
+}
+
+/* returns how many process groups of cancelled jobs still have processes in them */
+static size_t minimake_count_lingering(mm_scheduler* s) {
+    size_t kept = 0;
+    for (size_t i = 0; i < s->n_lingering; ++i) {
+        if (kill(-s->lingering[i], 0) == 0) {
+            s->lingering[kept++] = s->lingering[i];
+        }
+    }
+    s->n_lingering = kept;
+    return kept;
+}
+
+/* collects the jobs whose commands exited, and starts their next commands */
+static void minimake_reap(minimake* m, mm_scheduler* s) {
+    for (size_t i = 0; i < s->n_jobs;) {
+        mm_job* job = &s->jobs[i];
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(job->pid, &status, WNOHANG, &usage);
+        if (pid == 0 || (pid < 0 && errno == EINTR)) {
+            ++i;
+            continue;
+        }
+        if (job->pidfd >= 0) {
+            close(job->pidfd);
+            job->pidfd = -1;
+        }
+        if (s->timeline && pid > 0) {
+            double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+            s->timeline->exited_cpu += cpu > job->cpu_seen ? cpu - job->cpu_seen : 0;
+        }
+        int ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        int stopped = job->cancelled || job->timed_out || job->retrying;
+        if (ok && stopped) {
+            /* it may have been done before it was asked to stop; if not, it's not going to be */
+            mm_job rest = *job;
+            ok = minimake_job_advance(m, s, &rest).data == NULL;
+        }
+        if (!ok && stopped) {
+            if (job->cancelled) {
+                if (pid > 0 && kill(-job->pid, 0) == 0) {
+                    s->lingering[s->n_lingering++] = job->pid;
+                }
+            } else {
+                /* whatever it started goes too, before it's run again, or another build has a go at it */
+                kill(-job->pid, SIGKILL);
+            }
+            minimake_delete_partial_output(m, s, job);
+        }
+        if (!ok && job->retrying && !job->cancelled && !s->stop) {
+            job->retrying = 0;
+            job->retried = 1;
+            job->rule = 0;
+            job->command = 0;
+            clock_gettime(CLOCK_MONOTONIC, &job->start);
+            MM_PROBE(job__start, s->g.names[job->node].data, s->g.names[job->node].size, job->slots, job->numa_node);
+            minimake_set_deadlines(m, s, job);
+            int next = minimake_job_next(m, s, job);
+            if (next > 0) {
+                ++i;
+                continue;
+            }
+            ok = next == 0;
+        } else if (!ok && job->cancelled) {
+            /* not an error of its own */
+        } else if (!ok) {
+            /* ERR_BUF may still hold the first error */
+            static char message[sizeof(ERR_BUF)];
+            mm_sv command = m->rules[job->rule].commands[job->command - 1];
+            if (job->timed_out) {
+                snprintf(message, sizeof(message), "command \"%.*s\" timed out after %us", (int)command.size, command.data, s->timeout_s[job->node]);
+            } else {
+                snprintf(message, sizeof(message), "command \"%.*s\" failed", (int)command.size, command.data);
+            }
+            if (s->result.ok) {
+                memcpy(ERR_BUF, message, sizeof(message));
+            }
+            minimake_fail(s, (minimake_result) { .ok = 0, .message = s->result.ok ? ERR_BUF : message, .context = job->missing ? "command" : "rebuild due to mtime" });
+        } else if (!stopped) {
+            /* on to its next command, even after another job failed, which with -k doesn't cancel this one */
+            int next = minimake_job_next(m, s, job);
+            if (next > 0) {
+                ++i;
+                continue;
+            }
+            ok = next == 0;
+        }
+        mm_job done = *job;
+        s->jobs[i] = s->jobs[--s->n_jobs];
+        minimake_end_job(m, s, &done, ok);
+    }
+}
+
+/*
+ * Rules for commands which keep several CPUs busy by themselves (a link with LTO, a test runner) can say so
+ * with a special target: the dependencies of ".SLOTS_4" take four of the `max_jobs` slots each, instead of
+ * one. More than `max_jobs` is taken as `max_jobs`, so those still run, just alone.
+ */
+#define MINIMAKE_SLOTS_TARGET ".SLOTS_"
+/* and those of ".TIMEOUT_60" may take up to a minute, overriding --timeout */
+#define MINIMAKE_TIMEOUT_TARGET ".TIMEOUT_"
+
+/* for every special target `prefix`<n>, with n > 0, sets values[node] to n (but at most `max`) for its dependencies */
+static void minimake_load_special_numbers(minimake* m, minimake_graph* g, const char* prefix, uint32_t* values, uint32_t max) {
+    size_t prefix_size = strlen(prefix);
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        if (rule->target.size <= prefix_size || memcmp(rule->target.data, prefix, prefix_size) != 0) {
+            continue;
+        }
+        uint64_t value = 0;
+        for (size_t i = prefix_size; i < rule->target.size && value <= max; ++i) {
+            char c = rule->target.data[i];
+            if (c < '0' || c > '9') {
+                value = 0;
+                break;
+            }
+            value = value * 10 + (c - '0');
+        }
+        if (value == 0) {
+            continue;
+        }
+        for (size_t k = 0; k < rule->n_dependencies; ++k) {
+            size_t node = minimake_graph_find(g, rule->dependencies[k]);
+            if (node != SIZE_MAX) {
+                values[node] = (uint32_t)(value < max ? value : max);
+            }
+        }
+    }
+}
+
+static void minimake_load_job_slots(minimake* m, mm_scheduler* s, size_t max_jobs) {
+    for (size_t node = 0; node < s->g.n_nodes; ++node) {
+        s->slots[node] = 1;
+    }
+    minimake_load_special_numbers(m, &s->g, MINIMAKE_SLOTS_TARGET, s->slots, max_jobs < UINT32_MAX ? (uint32_t)max_jobs : UINT32_MAX);
+}
+
+/*
+ * Gives every node its class: the one it was given, or else the highest class of the targets in this build
+ * which depend on it, so that what a high priority target waits for is high priority too, and what only low
+ * priority targets need is low priority. Returns whether any class was given at all.
+ * This runs before the scheduler starts, so `pending` and `ready` are free to use.
+ */
+static int minimake_load_priorities(minimake* m, mm_scheduler* s) {
+    size_t n = s->g.n_nodes;
+    uint8_t* declared = s->forced;
+    size_t* users_left = s->pending;
+    size_t* queue = s->ready;
+    int any = 0;
+    memset(s->priority, MM_PRIORITY_UNSET, n);
+    memset(declared, 0, n);
+    for (size_t j = 0; j < m->n_rules; ++j) {
+        minimake_rule* rule = &m->rules[j];
+        mm_priority priority = MM_PRIORITY_UNSET;
+        if (mm_sv_eq(rule->target, minimake_cstr_stringview(".PRIORITY_HIGH"))) {
+            priority = MM_PRIORITY_HIGH;
+        } else if (mm_sv_eq(rule->target, minimake_cstr_stringview(".PRIORITY_LOW"))) {
+            priority = MM_PRIORITY_LOW;
+        }
+        for (size_t k = 0; priority != MM_PRIORITY_UNSET && k < rule->n_dependencies; ++k) {
+            size_t node = minimake_graph_find(&s->g, rule->dependencies[k]);
+            if (node != SIZE_MAX) {
+                s->priority[node] = priority;
+                declared[node] = 1;
+                any = 1;
+            }
+        }
+    }
+    if (!any) {
+        memset(s->priority, MM_PRIORITY_NORMAL, n);
+        return 0;
+    }
+    /* from the users down to their dependencies, a node once all its users in this build have been seen */
+    size_t head = 0;
+    size_t tail = 0;
+    for (size_t node = 0; node < n; ++node) {
+        users_left[node] = 0;
+        for (size_t e = s->g.users_start[node]; e < s->g.users_start[node + 1]; ++e) {
+            users_left[node] += s->key[s->g.users[e]] != SIZE_MAX;
+        }
+        if (users_left[node] == 0) {
+            queue[tail++] = node;
+        }
+    }
+    while (head < tail) {
+        size_t node = queue[head++];
+        if (s->priority[node] == MM_PRIORITY_UNSET) {
+            s->priority[node] = MM_PRIORITY_NORMAL;
+        }
+        if (s->key[node] == SIZE_MAX) {
+            continue;
+        }
+        for (size_t e = s->g.deps_start[node]; e < s->g.deps_start[node + 1]; ++e) {
+            size_t dep = s->g.deps[e];
+            if (!declared[dep] && s->priority[dep] < s->priority[node]) {
+                s->priority[dep] = s->priority[node];
+            }
+            if (--users_left[dep] == 0) {
+                queue[tail++] = dep;
+            }
+        }
+    }
+    /* whatever is left is part of a cycle */
+    for (size_t node = 0; node < n; ++node) {
+        if (s->priority[node] == MM_PRIORITY_UNSET) {
+            s->priority[node] = MM_PRIORITY_NORMAL;
+        }
+    }
+    memset(declared, 0, n);
+    return 1;
+}
+
+static int minimake_write_file(const char* path, const char* content) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, content, strlen(content));
+    close(fd);
+    return written < 0 ? -1 : 0;
+}
+
+static void minimake_teardown_priorities(mm_priorities* p) {
+    for (int priority = 0; priority < MM_PRIORITIES; ++priority) {
+        if (p->cgroup_fds[priority] >= 0) {
+            close(p->cgroup_fds[priority]);
+        }
+        p->cgroup_fds[priority] = -1;
+        if (p->cgroup_dirs[priority][0]) {
+            /* fails if a command left something running in it, which then keeps its cgroup */
+            rmdir(p->cgroup_dirs[priority]);
+        }
+        p->cgroup_dirs[priority][0] = 0;
+    }
+}
+
+/*
+ * Creates the cgroup of each class, under ours. A cgroup with processes in it can't pass controllers on to
+ * cgroups under it, so first we move into a leaf of our own cgroup, "minimake", which we stay in (and which
+ * is left for the next minimake run from there), and then enable the cpu and io controllers for our cgroup's
+ * children. So this needs a cgroup v2 hierarchy in which we may do that, with the cpu controller available
+ * to our cgroup, like systemd's Delegate= gives a service in its own cgroup. That also means nothing but
+ * minimake may run in our cgroup. Without all that, low priority commands are run nicer than the rest instead.
+ */
+static void minimake_setup_priorities(mm_priorities* p, int use_cgroups) {
+    /* cgroup paths are short, and this leaves room for the mount point and our names */
+    char line[PATH_MAX / 2];
+    char self[PATH_MAX / 2] = "";
+    char path[PATH_MAX + 64];
+    char pid[32];
+    memset(p, 0, sizeof(*p));
+    for (int priority = 0; priority < MM_PRIORITIES; ++priority) {
+        p->cgroup_fds[priority] = -1;
+    }
+    p->nice[MM_PRIORITY_LOW] = 10;
+    FILE* file = use_cgroups ? fopen("/proc/self/cgroup", "r") : NULL;
+    if (!file) {
+        return;
+    }
+    int found = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            /* we append "/name" to it, so the root, "/", becomes "" */
+            snprintf(self, sizeof(self), "%s", strcmp(line + 3, "/") == 0 ? "" : line + 3);
+            found = 1;
+        }
+    }
+    fclose(file);
+    if (!found) {
+        return;
+    }
+    /* the cgroup v2 hierarchy is mounted at /sys/fs/cgroup, or, on hybrid setups, next to the v1 ones */
+    const char* mount = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified";
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    snprintf(path, sizeof(path), "%s%s/minimake", mount, self);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s%s/minimake/cgroup.procs", mount, self);
+    if (minimake_write_file(path, pid) < 0) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s%s/cgroup.subtree_control", mount, self);
+    if (minimake_write_file(path, "+cpu") < 0) {
+        /* other processes in our cgroup, or no cpu controller for it; back to where we were */
+        snprintf(path, sizeof(path), "%s%s/cgroup.procs", mount, self);
+        (void)minimake_write_file(path, pid);
+        snprintf(path, sizeof(path), "%s%s/minimake", mount, self);
+        /* fails if another minimake is in it, which then keeps it */
+        rmdir(path);
+        return;
+    }
+    /* the io controller is a bonus */
+    (void)minimake_write_file(path, "+io");
+    for (int priority = MM_PRIORITY_LOW; priority < MM_PRIORITIES; ++priority) {
+        char* dir = p->cgroup_dirs[priority];
+        char weight[32];
+        snprintf(dir, PATH_MAX, "%s%s/minimake-%s-%s", mount, self, pid, mm_priority_names[priority]);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            dir[0] = 0;
+            break;
+        }
+        snprintf(weight, sizeof(weight), "%d", mm_priority_weights[priority]);
+        snprintf(path, sizeof(path), "%s/cpu.weight", dir);
+        int ok = minimake_write_file(path, weight) == 0;
+        snprintf(weight, sizeof(weight), "default %d", mm_priority_weights[priority]);
+        snprintf(path, sizeof(path), "%s/io.weight", dir);
+        (void)minimake_write_file(path, weight);
+        snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+        p->cgroup_fds[priority] = ok ? open(path, O_WRONLY | O_CLOEXEC) : -1;
+        if (p->cgroup_fds[priority] < 0) {
+            break;
+        }
+    }
+    if (p->cgroup_fds[MM_PRIORITIES - 1] < 0) {
+        minimake_teardown_priorities(p);
+        return;
+    }
+    p->nice[MM_PRIORITY_LOW] = 0;
+}
+
+static void minimake_on_interrupt(int sig) {
+    minimake_interrupted = sig;
+}
+
+/* how often we try again to take the locks of targets another minimake is making */
+#define MINIMAKE_LOCK_RETRY_MS 50
+
+/*
+ * Tries to start the parked targets again, oldest first, as far as there are job slots for them. Only when
+ * we have nothing else to do (and so hold no locks), `wait` lets the first one wait for its lock.
+ */
+static void minimake_retry_parked(minimake* m, mm_scheduler* s, size_t max_jobs, int wait) {
+    size_t n_parked = s->n_parked;
+    size_t kept = 0;
+    for (size_t i = 0; i < n_parked; ++i) {
+        mm_parked parked = s->parked[i];
+        if (s->stop || s->slots_used + s->slots[parked.node] > max_jobs) {
+            s->parked[kept++] = parked;
+            continue;
+        }
+        /* if it's parked again, it goes to the end, behind those we haven't tried yet */
+        size_t end = s->n_parked;
+        minimake_start_target(m, s, parked.node, parked.missing, wait && i == 0);
+        if (s->n_parked > end) {
+            s->parked[kept++] = s->parked[--s->n_parked];
+        }
+    }
+    /* anything parked while retrying was appended after the first n_parked entries, and moved down above */
+    s->n_parked = kept;
+}
+
+/* without a pidfd to wait on, this is how often we check whether a command is done */
+#define MINIMAKE_REAP_INTERVAL_MS 10
+
+minimake_result minimake_execute_chain(minimake* m, mm_sv* chain, size_t chain_len) {
+    mm_scheduler s;
+    mm_cpu_timeline timeline;
+    size_t max_jobs = m->max_jobs ? m->max_jobs : 1;
+    memset(&s, 0, sizeof(s));
+    memset(&timeline, 0, sizeof(timeline));
+    memset(ERR_BUF, 0, sizeof(ERR_BUF));
+    mm_set_clear(m, &m->made);
+    m->outdated = 0;
+    s.result = minimake_result_ok;
+    s.keep_going = m->keep_going;
+    s.chain = chain;
+    /* chain entries from here on have had their inputs prefetched */
+    s.prefetched = chain_len;
+    minimake_result result = minimake_graph_build(m, &s.g);
+    if (!result.ok) {
+        return result;
+    }
+    s.goal = minimake_graph_find(&s.g, chain[0]);
+    if (s.goal == SIZE_MAX) {
+        /* a target no rule mentions, or a special one; the graph has room for one more node */
+        s.goal = minimake_graph_add(&s.g, chain[0]);
+        s.g.deps_start[s.goal + 1] = s.g.deps_start[s.goal];
+        s.g.users_start[s.goal + 1] = s.g.users_start[s.goal];
+    }
+    size_t n = s.g.n_nodes;
+    s.key = m->alloc(sizeof(size_t) * n);
+    s.pending = m->alloc(sizeof(size_t) * n);
+    s.state = m->alloc(n);
+    s.forced = m->alloc(n);
+    s.readers = m->alloc(sizeof(uint32_t) * n);
+    s.slots = m->alloc(sizeof(uint32_t) * n);
+    s.priority = m->alloc(n);
+    s.timeout_s = m->alloc(sizeof(uint32_t) * n);
+    s.ready = m->alloc(sizeof(size_t) * n);
+    s.jobs = m->alloc(sizeof(mm_job) * max_jobs);
+    /* one more, for the target minimake_retry_parked() parks again before moving it down */
+    s.parked = m->alloc(sizeof(mm_parked) * (n + 1));
+    s.fds = m->alloc(sizeof(struct pollfd) * max_jobs);
+    s.lingering = m->alloc(sizeof(pid_t) * max_jobs);
+    if (!s.key || !s.pending || !s.state || !s.forced || !s.readers || !s.slots || !s.priority || !s.timeout_s || !s.ready || !s.jobs || !s.parked || !s.fds || !s.lingering) {
+        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating scheduler" };
+        goto cleanup;
+    }
+    memset(s.key, 0xff, sizeof(size_t) * n);
+    memset(s.state, MM_TARGET_PENDING, n);
+    memset(s.forced, 0, n);
+    memset(s.readers, 0, sizeof(uint32_t) * n);
+    minimake_load_job_slots(m, &s, max_jobs);
+    for (size_t node = 0; node < n; ++node) {
+        s.timeout_s[node] = m->timeout_s;
+    }
+    minimake_load_special_numbers(m, &s.g, MINIMAKE_TIMEOUT_TARGET, s.timeout_s, UINT32_MAX / 1000);
+    if ((m->straggler_factor > 0 || m->regressions) && m->mode == MINIMAKE_MODE_BUILD) {
+        /* the history is only needed for a moment, the baselines made from it for the whole build */
+        mm_history* history = m->alloc(sizeof(mm_history) * n);
+        s.baseline = m->alloc(sizeof(mm_baseline) * n);
+        s.took_ms = m->regressions ? m->alloc(sizeof(uint32_t) * n) : NULL;
+        if (!history || !s.baseline || (m->regressions && !s.took_ms)) {
+            if (history) {
+                m->free(history);
+            }
+            result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating history" };
+            goto cleanup;
+        }
+        minimake_load_history(&s.g, history);
+        for (size_t node = 0; node < n; ++node) {
+            s.baseline[node] = minimake_baseline(&history[node]);
+        }
+        m->free(history);
+        if (s.took_ms) {
+            memset(s.took_ms, 0xff, sizeof(uint32_t) * n);
+        }
+    }
+    /* the chain may contain a target many times, but only its last entry matters, since that's the one
+    all of its dependencies come after */
+    for (size_t i = 0; i < chain_len; ++i) {
+        size_t node = i == 0 ? s.goal : minimake_graph_find(&s.g, chain[i]);
+        if (node != SIZE_MAX) {
+            s.key[node] = i;
+        }
+    }
+    int prioritized = minimake_load_priorities(m, &s);
+    minimake_setup_priorities(&s.priorities, prioritized && m->mode == MINIMAKE_MODE_BUILD);
+    for (size_t node = 0; node < n; ++node) {
+        s.pending[node] = 0;
+        if (s.key[node] == SIZE_MAX) {
+            continue;
+        }
+        for (size_t e = s.g.deps_start[node]; e < s.g.deps_start[node + 1]; ++e) {
+            s.pending[node] += s.key[s.g.deps[e]] != SIZE_MAX;
+        }
+        if (s.pending[node] == 0) {
+            mm_ready_push(&s, node);
+        }
+    }
+
+    if (m->cpu_timeline_ms && m->mode == MINIMAKE_MODE_BUILD
+        && minimake_read_cpu_times(&timeline.last_busy, &timeline.last_total) == 0) {
+        timeline.n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        timeline.ticks_per_second = sysconf(_SC_CLK_TCK);
+        clock_gettime(CLOCK_MONOTONIC, &timeline.start);
+        timeline.last = timeline.start;
+        timeline.tick = timeline.start;
+        s.timeline = &timeline;
+    }
+
+    /* jobs run in process groups of their own, so a ^C on the terminal only reaches us, and we pass it on */
+    static const int interrupts[] = { SIGINT, SIGTERM, SIGHUP };
+    struct sigaction old_actions[sizeof(interrupts) / sizeof(*interrupts)];
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = minimake_on_interrupt;
+    sigemptyset(&action.sa_mask);
+    minimake_interrupted = 0;
+    for (size_t i = 0; i < sizeof(interrupts) / sizeof(*interrupts); ++i) {
+        sigaction(interrupts[i], &action, &old_actions[i]);
+    }
+
+    for (;;) {
+        minimake_timeline_tick(&s);
+        if (minimake_interrupted && !s.cancelling) {
+            s.keep_going = 0;
+            minimake_fail(&s, (minimake_result) { .ok = 0, .message = "interrupted", .context = strsignal(minimake_interrupted) });
+        }
+        /* without -k, the first error ends the build right away, instead of waiting for the other jobs */
+        if (!s.result.ok && !s.keep_going && !s.cancelling) {
+            minimake_cancel_jobs(&s);
+        }
+        minimake_retry_parked(m, &s, max_jobs, 0);
+        /* the target furthest back still goes first, even if it has to wait for slots while smaller ones could run */
+        while (!s.stop && s.n_ready > 0 && s.slots_used + s.slots[s.ready[0]] <= max_jobs) {
+            size_t node = mm_ready_pop(&s);
+            if (s.forced[node]) {
+                minimake_start_target(m, &s, node, 0, 0);
+            } else {
+                minimake_check_target(m, &s, node);
+            }
+        }
+        if (s.n_jobs == 0 && minimake_count_lingering(&s) == 0) {
+            if (s.n_parked == 0 || s.stop) {
+                break;
+            }
+            /* everything left is being made by someone else, and we hold no locks, so we can wait for them */
+            minimake_retry_parked(m, &s, max_jobs, 1);
+            continue;
+        }
+        /* wait for a command to exit, for the next sample to be due, for a job to run out of time, or to retry
+        parked targets; we don't wait for their locks while jobs of ours are running, since those hold locks
+        another minimake may be waiting for */
+        int timeout = s.n_lingering > 0 ? MINIMAKE_REAP_INTERVAL_MS : -1;
+        if (s.n_parked > 0 && !s.stop && (timeout < 0 || timeout > MINIMAKE_LOCK_RETRY_MS)) {
+            timeout = MINIMAKE_LOCK_RETRY_MS;
+        }
+        int deadline = minimake_check_deadlines(m, &s);
+        timeout = timeout < 0 || (deadline >= 0 && deadline < timeout) ? deadline : timeout;
+        for (size_t i = 0; i < s.n_jobs; ++i) {
+            s.fds[i] = (struct pollfd) { .fd = s.jobs[i].pidfd, .events = POLLIN };
+            if (s.jobs[i].pidfd < 0) {
+                timeout = MINIMAKE_REAP_INTERVAL_MS;
+            }
+        }
+        if (s.cancelling && !s.killed) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = mm_timespec_ms(&now, &s.kill_at);
+            if (left <= 0) {
+                for (size_t i = 0; i < s.n_jobs; ++i) {
+                    kill(-s.jobs[i].pid, SIGKILL);
+                }
+                for (size_t i = 0; i < s.n_lingering; ++i) {
+                    kill(-s.lingering[i], SIGKILL);
+                }
+                /* which can't be ignored, so there's no need to wait for them */
+                s.n_lingering = 0;
+                s.killed = 1;
+            } else {
+                int left_ms = (int)left + 1;
+                timeout = timeout < 0 || left_ms < timeout ? left_ms : timeout;
+            }
+        }
+        if (s.timeline) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double due = m->cpu_timeline_ms - mm_timespec_ms(&timeline.last, &now);
+            int due_ms = due > 0 ? (int)due + 1 : 0;
+            timeout = timeout < 0 || due_ms < timeout ? due_ms : timeout;
+            if (due <= 0) {
+                minimake_sample_cpu(m, &s);
+                continue;
+            }
+        }
+        (void)poll(s.fds, s.n_jobs, timeout);
+        minimake_timeline_tick(&s);
+        minimake_reap(m, &s);
+    }
+    if (s.timeline && s.ran_commands) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        /* /proc/stat counts in ticks of 10ms, so a very short last sample would be mostly noise */
+        if (mm_timespec_ms(&timeline.last, &now) >= m->cpu_timeline_ms / 2.0) {
+            minimake_sample_cpu(m, &s);
+        }
+        minimake_print_cpu_timeline(&timeline, m->cpu_timeline_ms);
+    }
+
+    result = s.result;
+    if (result.ok && m->mode == MINIMAKE_MODE_TOUCH) {
+        result = minimake_touch_made(m);
+    }
+    if (s.took_ms && s.ran_commands && !minimake_interrupted) {
+        minimake_report_regressions(m, &s);
+    }
+    if (!s.ran_commands && m->made.size == 0 && result.ok && m->mode != MINIMAKE_MODE_QUESTION) {
+        /* no work has been done! */
+        if (s.g.flags[s.goal] & MM_NODE_VARIANTS) {
+            for (size_t e = s.g.deps_start[s.goal]; e < s.g.deps_start[s.goal + 1]; ++e) {
+                mm_sv name = s.g.names[s.g.deps[e]];
+                printf("\"%.*s\" is up to date\n", (int)name.size, name.data);
+            }
+        } else {
+            printf("\"%.*s\" is up to date\n", (int)chain[0].size, chain[0].data);
+        }
+    }
+    minimake_teardown_priorities(&s.priorities);
+    for (size_t i = 0; i < sizeof(interrupts) / sizeof(*interrupts); ++i) {
+        sigaction(interrupts[i], &old_actions[i], NULL);
+    }
+cleanup:
+    minimake_unstage(m);
+    mm_set_clear(m, &m->made);
+    void* arrays[] = { s.key, s.pending, s.state, s.forced, s.readers, s.slots, s.priority, s.timeout_s, s.baseline, s.took_ms, s.ready, s.jobs, s.parked, s.fds, s.lingering, s.cmd, timeline.samples };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); ++i) {
+        if (arrays[i]) {
+            m->free(arrays[i]);
+        }
+    }
+    minimake_graph_free(m, &s.g);
+    if (minimake_interrupted) {
+        /* now that everything is cleaned up, go the way the signal would have taken us */
+        fflush(stdout);
+        raise(minimake_interrupted);
+    }
+    return result;
+}
+
+/* how long the watched files need to stay untouched before we consider an edit finished */
+#define MINIMAKE_WATCH_SETTLE_MS 150
+
+/*
+ * Turns this process (and thus everything it runs) into a background task, which only gets otherwise idle disk
+ * time. Not idle CPU time, though: every job holds the lock of its target, which a minimake started by hand may
+ * be waiting for, and at SCHED_IDLE, that one would wait for as long as the CPUs are busy (with its own jobs,
+ * say). We can't switch back to normal priority for each job instead: jobs inherit both SCHED_IDLE and a
+ * higher nice value, and only a privileged process may give either up again.
+ */
+static void minimake_become_idle(void) {
+    /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE; there's no glibc wrapper. best-effort */
+    (void)syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+}
+
+/* splits `path` into the directory to watch and the name inotify will report */
+static void minimake_split_path(const char* path, char* dir, const char** name) {
+    const char* slash = strrchr(path, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+        *name = path;
+    } else if (slash == path) {
+        strcpy(dir, "/");
+        *name = slash + 1;
+    } else {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = 0;
+        *name = slash + 1;
+    }
+}
+
+/* a file watch mode reacts to: `name` in the directory watched through `wd` */
+typedef struct {
+    int wd;
+    char* name;
+    /* `name` is a missing directory on the way to the file, so it appearing means the file can be watched now */
+    _Bool missing;
+} mm_watched;
+
+/*
+ * Watch mode: keeps `chain` up to date by rebuilding as soon as its source files (the dependencies without a rule)
+ * have been edited and left alone for a moment, so that by the time someone asks for the target, it's usually
+ * already made. It all runs at idle I/O priority, so it doesn't get in the way of the editor or anything else.
+ * An explicitly started minimake needs no cooperation for this: it finds the targets we already made up to date,
+ * and waits on the lock of whatever we are making right now.
+ * Returns once `makefile` changes, since the chain may then be different, or once a missing directory of a
+ * source appears, since only then can the source be watched.
+ */
+minimake_result minimake_watch(minimake* m, const char* makefile, mm_sv* chain, size_t chain_len) {
+    char path[PATH_MAX];
+    char dir[PATH_MAX];
+    const char* name;
+    minimake_result result = minimake_result_ok;
+    _Alignas(struct inotify_event) char events[4096];
+
+    minimake_become_idle();
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "inotify" };
+    }
+    /* one per source, and the makefile last; NULL names are for targets, which aren't watched */
+    mm_watched* watched = m->alloc(sizeof(mm_watched) * (chain_len + 1));
+    if (!watched) {
+        close(fd);
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating watches" };
+    }
+    memset(watched, 0, sizeof(mm_watched) * (chain_len + 1));
+    /* watch directories instead of files, since editors like to replace files instead of writing them */
+    for (size_t i = 0; i <= chain_len; ++i) {
+        if (i == chain_len) {
+            snprintf(path, sizeof(path), "%s", makefile);
+        } else if (minimake_find_rule(m, chain[i]) || chain[i].size >= PATH_MAX) {
+            continue;
+        } else {
+            memcpy(path, chain[i].data, chain[i].size);
+            path[chain[i].size] = 0;
+        }
+        minimake_split_path(path, dir, &name);
+        int wd;
+        /* a directory which doesn't exist yet can't be watched, but its nearest parent which does can, for it to appear */
+        while ((wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)) < 0
+            && errno == ENOENT && strcmp(dir, ".") != 0 && strcmp(dir, "/") != 0) {
+            snprintf(path, sizeof(path), "%s", dir);
+            minimake_split_path(path, dir, &name);
+            watched[i].missing = 1;
+        }
+        if (wd < 0) {
+            sprintf(ERR_BUF, "can't watch \"%s\": %s", dir, strerror(errno));
+            result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "inotify" };
+            goto cleanup;
+        }
+        watched[i].wd = wd;
+        watched[i].name = strdup(name);
+    }
+
+    for (int changed = 1;;) {
+        if (changed) {
+            result = minimake_execute_chain(m, chain, chain_len);
+            if (!result.ok) {
+                /* nothing to do but wait for the next edit */
+                printf("ERROR: %s (%s)\n", result.message, result.context);
+                result = minimake_result_ok;
+            }
+            fflush(stdout);
+            changed = 0;
+        }
+
+        /* block until something happens, then keep reading until it has settled */
+        struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+        for (int timeout = -1; poll(&pfd, 1, timeout) != 0; timeout = changed ? MINIMAKE_WATCH_SETTLE_MS : -1) {
+            ssize_t len = read(fd, events, sizeof(events));
+            if (len < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "inotify" };
+                goto cleanup;
+            }
+            for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+                struct inotify_event* event = (struct inotify_event*)p;
+                if (event->len == 0) {
+                    continue;
+                }
+                /* by what we watched, not by name, since "./a.c" and "a.c" are the same file */
+                for (size_t i = 0; i <= chain_len; ++i) {
+                    if (!watched[i].name || watched[i].wd != event->wd || strcmp(watched[i].name, event->name) != 0) {
+                        continue;
+                    }
+                    if (i == chain_len) {
+                        printf("\"%s\" changed\n", makefile);
+                        goto cleanup;
+                    }
+                    if (watched[i].missing) {
+                        printf("\"%s\" appeared\n", event->name);
+                        goto cleanup;
+                    }
+                    changed = 1;
+                }
+            }
+        }
+        /* whatever other minimake processes cached about these files is now wrong */
+        if (changed) {
+            minimake_stat_cache_invalidate(m);
+        }
+    }
+
+cleanup:
+    for (size_t i = 0; i <= chain_len; ++i) {
+        free(watched[i].name);
+    }
+    m->free(watched);
+    close(fd);
+    return result;
+}
+
+/* the target to make when none is given: like make, that's the first one, ignoring special targets like .INTERMEDIATE */
+mm_sv minimake_default_target(minimake* m) {
+    for (size_t i = 0; i < m->n_rules; ++i) {
+        if (m->rules[i].target.data[0] != '.') {
+            return m->rules[i].target;
+        }
+    }
+    return (mm_sv) { .data = NULL, .size = 0 };
+}
+
+static int minimake_remove_one(int dirfd, const char* name, void* arg) {
+    (void)arg;
+    if (unlinkat(dirfd, name, 0) == 0) {
+        return 0;
+    }
+    /* the target of a rule like "build: ; mkdir build" */
+    if (errno == EISDIR) {
+        return unlinkat(dirfd, name, AT_REMOVEDIR) < 0 ? errno : 0;
+    }
+    return errno;
+}
+
+static int mm_sv_compare_longest_first(const void* a, const void* b) {
+    const mm_sv* x = a;
+    const mm_sv* y = b;
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+/* removes, as far as they became empty, the directories containing `removed` (all of which are relative paths) */
+static minimake_result minimake_prune_dirs(minimake* m, mm_sv* removed, size_t n_removed) {
+    char dir[PATH_MAX];
+    mm_set dirs = { 0 };
+    minimake_result result = minimake_result_ok;
+    for (size_t i = 0; i < n_removed; ++i) {
+        mm_sv parent = removed[i];
+        /* every ancestor, deepest first, stopping at the first one we already know */
+        while (parent.size > 0) {
+            while (parent.size > 0 && parent.data[parent.size - 1] != '/') {
+                --parent.size;
+            }
+            while (parent.size > 0 && parent.data[parent.size - 1] == '/') {
+                --parent.size;
+            }
+            if (parent.size == 0 || mm_set_insert(m, &dirs, parent) != 1) {
+                break;
+            }
+        }
+    }
+    mm_sv* sorted = m->alloc(sizeof(mm_sv) * (dirs.size + 1));
+    if (!sorted) {
+        mm_set_clear(m, &dirs);
+        return (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating directories" };
+    }
+    size_t n_sorted = 0;
+    for (size_t i = 0; i < dirs.capacity; ++i) {
+        if (dirs.slots[i].data) {
+            sorted[n_sorted++] = dirs.slots[i];
+        }
+    }
+    /* a directory's path is longer than its parent's, so children go first */
+    qsort(sorted, n_sorted, sizeof(mm_sv), mm_sv_compare_longest_first);
+    for (size_t i = 0; i < n_sorted; ++i) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)sorted[i].size, sorted[i].data);
+        if (rmdir(dir) == 0) {
+            printf("rmdir %s\n", dir);
+        } else if (errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT) {
+            sprintf(ERR_BUF, "can't remove \"%s\": %s", dir, strerror(errno));
+            result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "clean" };
+        }
+    }
+    m->free(sorted);
+    mm_set_clear(m, &dirs);
+    return result;
+}
+
+/*
+ * Removes everything `chain` produces, that is, every target in it which has commands. Sources and targets
+ * without commands are left alone, and if `prune` is set, so are directories which are empty afterwards.
+ * Targets which are directories are removed once they're empty, and otherwise left in place.
+ * Removal happens in bulk, in parallel, relative to directory file descriptors, see minimake_for_each_path().
+ */
+minimake_result minimake_clean(minimake* m, mm_sv* chain, size_t chain_len, int prune) {
+    minimake_result result = minimake_result_ok;
+    mm_set outputs = { 0 };
+    mm_path_op* ops = NULL;
+    mm_sv* removed = NULL;
+    for (size_t i = 0; i < chain_len; ++i) {
+        int has_commands = 0;
+        for (size_t j = 0; !has_commands && j < m->n_rules; ++j) {
+            has_commands = m->rules[j].n_commands > 0 && mm_sv_eq(m->rules[j].target, chain[i]);
+        }
+        if (has_commands && mm_set_insert(m, &outputs, chain[i]) < 0) {
+            result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating outputs" };
+            goto cleanup;
+        }
+    }
+    ops = m->alloc(sizeof(mm_path_op) * (outputs.size + 1));
+    removed = m->alloc(sizeof(mm_sv) * (outputs.size + 1));
+    if (!ops || !removed) {
+        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating outputs" };
+        goto cleanup;
+    }
+    size_t n_ops = 0;
+    for (size_t i = 0; i < outputs.capacity; ++i) {
+        if (outputs.slots[i].data) {
+            ops[n_ops++] = (mm_path_op) { .path = outputs.slots[i], .err = 0 };
+        }
+    }
+    minimake_for_each_path(ops, n_ops, minimake_remove_one, NULL);
+    /* a directory target may only have been emptied by the removal of other targets in it, after it was tried.
+    ops are sorted, so going backwards, directories come after what's in them */
+    for (size_t i = n_ops; i-- > 0;) {
+        if (ops[i].err == ENOTEMPTY) {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%.*s", (int)ops[i].path.size, ops[i].path.data);
+            ops[i].err = rmdir(dir) < 0 ? errno : 0;
+        }
+    }
+    minimake_stat_cache_invalidate(m);
+
+    size_t n_removed = 0;
+    for (size_t i = 0; i < n_ops; ++i) {
+        if (ops[i].err == 0) {
+            printf("rm %.*s\n", (int)ops[i].path.size, ops[i].path.data);
+            /* never prune outside of the tree */
+            mm_sv path = ops[i].path;
+            if (path.data[0] != '/' && !memmem(path.data, path.size, "..", 2)) {
+                removed[n_removed++] = path;
+            }
+        } else if (ops[i].err == ENOTEMPTY || ops[i].err == EEXIST) {
+            /* a directory target with more than targets in it, which we don't know to be ours to remove */
+            printf("left %.*s in place, it isn't empty\n", (int)ops[i].path.size, ops[i].path.data);
+        } else if (ops[i].err != ENOENT) {
+            printf("can't remove %.*s: %s\n", (int)ops[i].path.size, ops[i].path.data, strerror(ops[i].err));
+            sprintf(ERR_BUF, "failed to remove some targets");
+            result = (minimake_result) { .ok = 0, .message = ERR_BUF, .context = "clean" };
+        }
+    }
+    if (prune) {
+        minimake_result prune_result = minimake_prune_dirs(m, removed, n_removed);
+        if (result.ok) {
+            result = prune_result;
+        }
+    }
+
+cleanup:
+    if (ops) {
+        m->free(ops);
+    }
+    if (removed) {
+        m->free(removed);
+    }
+    mm_set_clear(m, &outputs);
+    return result;
+}
+
+static void minimake_set_duration(size_t node, long long duration_ms, void* arg) {
+    /* later lines are newer */
+    ((double*)arg)[node] = duration_ms / 1000.0;
+}
+
+static void minimake_set_logged(size_t node, long long duration_ms, void* arg) {
+    (void)duration_ms;
+    ((uint8_t*)arg)[node] = 1;
+}
+
+/* the latest recorded duration of every node in `g`, from the build log, in seconds (0 if there is none) */
+static void minimake_load_durations(minimake_graph* g, double* seconds) {
+    memset(seconds, 0, sizeof(double) * g->n_nodes);
+    minimake_read_log(g, minimake_set_duration, seconds);
+}
+
+/* what changing a source costs, see minimake_analyze() */
+typedef struct {
+    size_t node;
+    size_t n_targets;
+    double seconds;
+} mm_impact;
+
+static int mm_impact_compare(const void* a, const void* b) {
+    const mm_impact* x = a;
+    const mm_impact* y = b;
+    if (x->seconds != y->seconds) {
+        return x->seconds < y->seconds ? 1 : -1;
+    }
+    return (x->n_targets < y->n_targets) - (x->n_targets > y->n_targets);
+}
+
+/* phony targets with more dependencies than this are worth a warning */
+#define MINIMAKE_FAN_IN_WARNING 32
+
+/*
+ * Finds out which files are expensive to touch, and which parts of the makefile make incremental builds slower
+ * than they need to be. For every source (a node without a rule), it counts the targets which have to be made
+ * again when it changes, and adds up how long they took the last time they were made (see the build log), and
+ * prints the `limit` most expensive ones. Then it warns about:
+ * - dependencies on directories, since a directory's mtime changes whenever an entry is added or removed
+ * - targets with lots of dependencies which are not files, since they are never up to date, and neither is
+ *   anything depending on them. That's rules without commands, and those whose commands ran (see the build
+ *   log) but didn't make the file; any other missing target may just not have been made yet
+ * - redundant dependencies, which a target also has indirectly, and so only cost time to check
+ */
+minimake_result minimake_analyze(minimake* m, size_t limit) {
+    minimake_graph g;
+    char filename[PATH_MAX];
+    minimake_result result = minimake_graph_build(m, &g);
+    if (!result.ok) {
+        return result;
+    }
+    double* seconds = m->alloc(sizeof(double) * (g.n_nodes + 1));
+    /* when a node was last visited, by which search; saves clearing a visited flag for every search */
+    size_t* visited = m->alloc(sizeof(size_t) * (g.n_nodes + 1));
+    size_t* stack = m->alloc(sizeof(size_t) * (g.n_nodes + 1));
+    mm_impact* impacts = m->alloc(sizeof(mm_impact) * (g.n_nodes + 1));
+    /* whether the build log shows the node was made */
+    uint8_t* logged = m->alloc(g.n_nodes + 1);
+    if (!seconds || !visited || !stack || !impacts || !logged) {
+        result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "allocating analysis" };
+        goto cleanup;
+    }
+    memset(visited, 0xff, sizeof(size_t) * (g.n_nodes + 1));
+    minimake_load_durations(&g, seconds);
+    memset(logged, 0, g.n_nodes + 1);
+    minimake_read_log(&g, minimake_set_logged, logged);
+
+    size_t n_impacts = 0;
+    for (size_t source = 0; source < g.n_nodes; ++source) {
+        if (g.flags[source] & MM_NODE_HAS_RULE) {
+            continue;
+        }
+        mm_impact impact = { .node = source, .n_targets = 0, .seconds = 0 };
+        size_t n_stack = 0;
+        stack[n_stack++] = source;
+        visited[source] = source;
+        while (n_stack > 0) {
+            size_t node = stack[--n_stack];
+            for (size_t e = g.users_start[node]; e < g.users_start[node + 1]; ++e) {
+                size_t user = g.users[e];
+                if (visited[user] != source) {
+                    visited[user] = source;
+                    ++impact.n_targets;
+                    impact.seconds += seconds[user];
+                    stack[n_stack++] = user;
+                }
+            }
+        }
+        impacts[n_impacts++] = impact;
+    }
+    qsort(impacts, n_impacts, sizeof(mm_impact), mm_impact_compare);
+    printf("what changing a source makes again (targets, seconds they took to make last time):\n");
+    for (size_t i = 0; i < n_impacts && i < limit; ++i) {
+        mm_sv name = g.names[impacts[i].node];
+        printf("%8zu %10.2f  %.*s\n", impacts[i].n_targets, impacts[i].seconds, (int)name.size, name.data);
+    }
+    if (n_impacts > limit) {
+        printf("(and %zu more)\n", n_impacts - limit);
+    }
+
+    printf("\nwarnings:\n");
+    size_t n_warnings = 0;
+    for (size_t node = 0; node < g.n_nodes; ++node) {
+        mm_sv name = g.names[node];
+        struct stat st;
+        snprintf(filename, sizeof(filename), "%.*s", (int)name.size, name.data);
+        int exists = minimake_stat(m, filename, &st) == 0;
+        if (exists && S_ISDIR(st.st_mode) && g.users_start[node + 1] > g.users_start[node]) {
+            printf("  \"%.*s\" is a directory, so %zu target(s) depending on it are made again whenever a file in it is added or removed\n",
+                (int)name.size, name.data, g.users_start[node + 1] - g.users_start[node]);
+            ++n_warnings;
+        }
+        size_t n_deps = g.deps_start[node + 1] - g.deps_start[node];
+        int never_a_file = !(g.flags[node] & MM_NODE_HAS_COMMANDS) || logged[node];
+        if (!exists && (g.flags[node] & MM_NODE_HAS_RULE) && never_a_file && n_deps > MINIMAKE_FAN_IN_WARNING) {
+            printf("  \"%.*s\" has %zu dependencies but is not a file, so it's never up to date; all of them are checked every time, and %zu target(s) depending on it are always made again\n",
+                (int)name.size, name.data, n_deps, g.users_start[node + 1] - g.users_start[node]);
+            ++n_warnings;
+        }
+        /* mark everything reachable through the dependencies' dependencies; direct dependencies which get
+        marked are redundant. node + g.n_nodes can't clash with the ids used by the impact searches */
+        size_t search = node + g.n_nodes;
+        size_t n_stack = 0;
+        for (size_t e = g.deps_start[node]; e < g.deps_start[node + 1]; ++e) {
+            size_t dep = g.deps[e];
+            for (size_t f = g.deps_start[dep]; f < g.deps_start[dep + 1]; ++f) {
+                if (visited[g.deps[f]] != search) {
+                    visited[g.deps[f]] = search;
+                    stack[n_stack++] = g.deps[f];
+                }
+            }
+        }
+        while (n_stack > 0) {
+            size_t dep = stack[--n_stack];
+            for (size_t f = g.deps_start[dep]; f < g.deps_start[dep + 1]; ++f) {
+                if (visited[g.deps[f]] != search) {
+                    visited[g.deps[f]] = search;
+                    stack[n_stack++] = g.deps[f];
+                }
+            }
+        }
+        for (size_t e = g.deps_start[node]; e < g.deps_start[node + 1]; ++e) {
+            if (visited[g.deps[e]] == search) {
+                mm_sv dep = g.names[g.deps[e]];
+                printf("  \"%.*s\" depends on \"%.*s\" through other dependencies already, so listing it is redundant\n",
+                    (int)name.size, name.data, (int)dep.size, dep.data);
+                ++n_warnings;
+            }
+        }
+    }
+    if (n_warnings == 0) {
+        printf("  none\n");
+    }
+
+cleanup:
+    if (seconds) {
+        m->free(seconds);
+    }
+    if (visited) {
+        m->free(visited);
+    }
+    if (stack) {
+        m->free(stack);
+    }
+    if (impacts) {
+        m->free(impacts);
+    }
+    if (logged) {
+        m->free(logged);
+    }
+    minimake_graph_free(m, &g);
+    return result;
+}
+
+/*
+ * Finds a shortest dependency path from `from` to `to`, that is, a list of nodes starting with `from`, each
+ * depending on the next, ending with `to`. It searches breadth-first from both ends at once (along dependencies
+ * from `from`, along users from `to`), always advancing the smaller frontier, so on big graphs each side only
+ * has to explore about half the distance. `path` needs room for all nodes; returns the number of nodes in the
+ * path, or 0 if there is none.
+ */
+size_t minimake_graph_path(minimake* m, minimake_graph* g, size_t from, size_t to, size_t* path) {
+    if (from == to) {
+        path[0] = from;
+        return 1;
+    }
+    size_t n = g->n_nodes;
+    size_t length = 0;
+    /* per node: where we came from on either side (SIZE_MAX if not seen yet), and both sides' queues */
+    size_t* parent[2] = { m->alloc(sizeof(size_t) * n), m->alloc(sizeof(size_t) * n) };
+    size_t* queue[2] = { m->alloc(sizeof(size_t) * n), m->alloc(sizeof(size_t) * n) };
+    size_t head[2] = { 0, 0 };
+    size_t tail[2] = { 1, 1 };
+    size_t meet = SIZE_MAX;
+    if (!parent[0] || !parent[1] || !queue[0] || !queue[1]) {
+        goto cleanup;
+    }
+    memset(parent[0], 0xff, sizeof(size_t) * n);
+    memset(parent[1], 0xff, sizeof(size_t) * n);
+    queue[0][0] = from;
+    parent[0][from] = from;
+    queue[1][0] = to;
+    parent[1][to] = to;
+
+    while (meet == SIZE_MAX && head[0] < tail[0] && head[1] < tail[1]) {
+        /* side 0 walks dependencies, side 1 walks users */
+        int side = tail[0] - head[0] <= tail[1] - head[1] ? 0 : 1;
+        size_t* start = side == 0 ? g->deps_start : g->users_start;
+        size_t* edges = side == 0 ? g->deps : g->users;
+        /* one whole level, so the first meeting point is on a shortest path */
+        size_t level_end = tail[side];
+        for (; meet == SIZE_MAX && head[side] < level_end; ++head[side]) {
+            size_t node = queue[side][head[side]];
+            for (size_t e = start[node]; e < start[node + 1]; ++e) {
+                size_t next = edges[e];
+                if (parent[side][next] != SIZE_MAX) {
+                    continue;
+                }
+                parent[side][next] = node;
+                queue[side][tail[side]++] = next;
+                if (parent[!side][next] != SIZE_MAX) {
+                    meet = next;
+                    break;
+                }
+            }
+        }
+    }
+    if (meet == SIZE_MAX) {
+        goto cleanup;
+    }
+    /* from `from` to the meeting point, that's backwards along side 0's parents */
+    for (size_t node = meet;; node = parent[0][node]) {
+        path[length++] = node;
+        if (node == from) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < length / 2; ++i) {
+        size_t tmp = path[i];
+        path[i] = path[length - 1 - i];
+        path[length - 1 - i] = tmp;
+    }
+    /* and on to `to` along side 1's parents */
+    for (size_t node = meet; node != to;) {
+        node = parent[1][node];
+        path[length++] = node;
+    }
+
+cleanup:
+    for (int side = 0; side < 2; ++side) {
+        if (parent[side]) {
+            m->free(parent[side]);
+        }
+        if (queue[side]) {
+            m->free(queue[side]);
+        }
+    }
+    return length;
+}
+
+/*
+ * Counts the distinct dependency paths from `from` to `to`, saturating at UINT64_MAX. Only nodes on some such
+ * path matter (reachable from `from`, and reaching `to`), and in those, the number of paths to a node is the
+ * sum of the numbers of paths to the nodes depending on it, which we add up in topological order.
+ * Sets `cyclic` (and returns 0) if there is a cycle on the way, since then there are infinitely many.
+ */
+uint64_t minimake_graph_count_paths(minimake* m, minimake_graph* g, size_t from, size_t to, int* cyclic) {
+    size_t n = g->n_nodes;
+    uint64_t count = 0;
+    /* bit 1: reachable from `from`, bit 2: reaches `to` */
+    uint8_t* reach = m->alloc(n);
+    size_t* stack = m->alloc(sizeof(size_t) * n);
+    size_t* pending = m->alloc(sizeof(size_t) * n);
+    uint64_t* paths = m->alloc(sizeof(uint64_t) * n);
+    *cyclic = 0;
+    if (!reach || !stack || !pending || !paths) {
+        goto cleanup;
+    }
+    memset(reach, 0, n);
+    for (int side = 0; side < 2; ++side) {
+        size_t* start = side == 0 ? g->deps_start : g->users_start;
+        size_t* edges = side == 0 ? g->deps : g->users;
+        uint8_t bit = side == 0 ? 1 : 2;
+        size_t n_stack = 0;
+        stack[n_stack++] = side == 0 ? from : to;
+        reach[stack[0]] |= bit;
+        while (n_stack > 0) {
+            size_t node = stack[--n_stack];
+            for (size_t e = start[node]; e < start[node + 1]; ++e) {
+                if (!(reach[edges[e]] & bit)) {
+                    reach[edges[e]] |= bit;
+                    stack[n_stack++] = edges[e];
+                }
+            }
+        }
+    }
+    if (reach[from] != 3) {
+        goto cleanup;
+    }
+    /* Kahn's algorithm over the nodes on paths, counting for each how many of its users are still to be done */
+    size_t n_on_path = 0;
+    for (size_t node = 0; node < n; ++node) {
+        paths[node] = 0;
+        pending[node] = 0;
+        if (reach[node] != 3) {
+            continue;
+        }
+        ++n_on_path;
+        for (size_t e = g->users_start[node]; e < g->users_start[node + 1]; ++e) {
+            pending[node] += reach[g->users[e]] == 3;
+        }
+    }
+    size_t n_stack = 0;
+    size_t n_done = 0;
+    paths[from] = 1;
+    stack[n_stack++] = from;
+    while (n_stack > 0) {
+        size_t node = stack[--n_stack];
+        ++n_done;
+        for (size_t e = g->deps_start[node]; e < g->deps_start[node + 1]; ++e) {
+            size_t dep = g->deps[e];
+            if (reach[dep] != 3) {
+                continue;
+            }
+            paths[dep] = paths[dep] > UINT64_MAX - paths[node] ? UINT64_MAX : paths[dep] + paths[node];
+            if (--pending[dep] == 0) {
+                stack[n_stack++] = dep;
+            }
+        }
+    }
+    /* whatever is left over waits on itself */
+    if (n_done != n_on_path || pending[from] != 0) {
+        *cyclic = 1;
+        goto cleanup;
+    }
+    count = paths[to];
+
+cleanup:
+    if (reach) {
+        m->free(reach);
+    }
+    if (stack) {
+        m->free(stack);
+    }
+    if (pending) {
+        m->free(pending);
+    }
+    if (paths) {
+        m->free(paths);
+    }
+    return count;
+}
+
+#ifndef MINIMAKE_TESTS
+
+static int minimake_tool_clean(minimake* m, int argc, char** argv) {
+    int prune = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+        case 'p':
+            prune = 1;
+            break;
+        default:
+            printf("usage: minimake -T clean [-p] [target]\n"
+                   "  -p  also remove directories which are empty afterwards\n");
+            return 1;
+        }
+    }
+    mm_sv target = optind < argc ? minimake_cstr_stringview(argv[optind]) : minimake_default_target(m);
+    if (!target.data) {
+        printf("ERROR: no targets (Makefile)\n");
+        return 1;
+    }
+    if (optind >= argc && m->n_variants > 0) {
+        /* what a build of the variants makes, see minimake_instantiate_variants() */
+        target = minimake_cstr_stringview(MINIMAKE_VARIANTS_TARGET);
+    }
+    mm_sv* chain;
+    size_t chain_len;
+    minimake_result result = minimake_resolve(m, target, &chain, &chain_len);
+    if (result.ok) {
+        result = minimake_clean(m, chain, chain_len, prune);
+        m->free(chain);
+    }
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+    return 0;
+}
+
+static int minimake_tool_analyze(minimake* m, int argc, char** argv) {
+    size_t limit = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            limit = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            printf("usage: minimake -T analyze [-n count]\n"
+                   "  -n  how many of the most expensive sources to show (default 20)\n");
+            return 1;
+        }
+    }
+    minimake_result result = minimake_analyze(m, limit);
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+    return 0;
+}
+
+static int minimake_tool_query(minimake* m, int argc, char** argv) {
+    int count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c")) != -1) {
+        switch (opt) {
+        case 'c':
+            count = 1;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind + 3 != argc || strcmp(argv[optind], "path") != 0) {
+        printf("usage: minimake -T query path [-c] <from> <to>\n"
+               "  shows how <from> depends on <to>, through one of the shortest dependency paths\n"
+               "  -c  also count all distinct paths\n");
+        return 1;
+    }
+    minimake_graph g;
+    minimake_result result = minimake_graph_build(m, &g);
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+    int rc = 1;
+    size_t* path = NULL;
+    size_t from = minimake_graph_find(&g, minimake_cstr_stringview(argv[optind + 1]));
+    size_t to = minimake_graph_find(&g, minimake_cstr_stringview(argv[optind + 2]));
+    if (from == SIZE_MAX || to == SIZE_MAX) {
+        printf("\"%s\" is not in the makefile\n", from == SIZE_MAX ? argv[optind + 1] : argv[optind + 2]);
+        goto cleanup;
+    }
+    path = m->alloc(sizeof(size_t) * g.n_nodes);
+    size_t length = path ? minimake_graph_path(m, &g, from, to, path) : 0;
+    if (length == 0) {
+        printf("\"%s\" does not depend on \"%s\"\n", argv[optind + 1], argv[optind + 2]);
+        goto cleanup;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        printf("%s%.*s\n", i == 0 ? "" : "  -> ", (int)g.names[path[i]].size, g.names[path[i]].data);
+    }
+    if (count) {
+        int cyclic;
+        uint64_t n_paths = minimake_graph_count_paths(m, &g, from, to, &cyclic);
+        if (cyclic) {
+            printf("infinitely many paths, there is a dependency cycle\n");
+        } else {
+            printf("%s%llu distinct path(s)\n", n_paths == UINT64_MAX ? "at least " : "", (unsigned long long)n_paths);
+        }
+    }
+    rc = 0;
+
+cleanup:
+    if (path) {
+        m->free(path);
+    }
+    minimake_graph_free(m, &g);
+    return rc;
+}
+
+/* tools are run with `-T tool`, and get all arguments after it, with argv[0] being the tool's name */
+static int minimake_run_tool(minimake* m, const char* tool, int argc, char** argv) {
+    /* start over with getopt */
+    optind = 0;
+    if (strcmp(tool, "clean") == 0) {
+        return minimake_tool_clean(m, argc, argv);
+    }
+    if (strcmp(tool, "analyze") == 0) {
+        return minimake_tool_analyze(m, argc, argv);
+    }
+    if (strcmp(tool, "query") == 0) {
+        return minimake_tool_query(m, argc, argv);
+    }
+    printf("ERROR: unknown tool \"%s\", available tools are: clean, analyze, query\n", tool);
+    return 1;
+}
+
+/* long options without a short equivalent */
+enum {
+    MINIMAKE_OPT_SHM_STAT_CACHE = 256,
+    MINIMAKE_OPT_WATCH,
+    MINIMAKE_OPT_PREFETCH,
+    MINIMAKE_OPT_CPU_TIMELINE,
+    MINIMAKE_OPT_PLACEMENT,
+    MINIMAKE_OPT_TIMEOUT,
+    MINIMAKE_OPT_STRAGGLERS,
+    MINIMAKE_OPT_RETRY_STRAGGLERS,
+    MINIMAKE_OPT_REGRESSIONS,
+    MINIMAKE_OPT_VARIANT,
+    MINIMAKE_OPT_SET,
+};
+
+static void minimake_usage(const char* argv0) {
+    printf("usage: %s [options] [target]\n"
+           "\n"
+           "options:\n"
+           "  -h, --help            show this help\n"
+           "  -j, --jobs N          run up to N commands at once\n"
+           "  -k, --keep-going      after a command fails, make what doesn't depend on it, instead of cancelling the others\n"
+           "  -n, --dry-run         print the commands which would run, without running them\n"
+           "  -q, --question        run nothing, just exit with 0 if the target is up to date, or 1 if it isn't\n"
+           "  -t, --touch           instead of running commands, mark outdated targets as up to date\n"
+           "  -T, --tool TOOL ...   run a tool, which gets all following arguments; available tools:\n"
+           "                          clean [-p] [target]  remove the files made for the target\n"
+           "                          analyze [-n count]   find expensive sources and slow makefile patterns\n"
+           "                          query path [-c] A B  show why A depends on B\n"
+           "  --shm-stat-cache      share file metadata with other minimake processes in this directory\n"
+           "  --watch               stay running, and make the target in the background whenever its sources change\n"
+           "  --prefetch            read sources of upcoming commands into the page cache ahead of time\n"
+           "  --cpu-timeline[=MS]   sample CPU utilization every MS ms (default 100) while building, and print a timeline\n"
+           "  --placement           spread jobs over NUMA nodes, pinning each to the CPUs of one\n"
+           "  --timeout SECONDS     stop jobs which take longer than this, and fail\n"
+           "  --stragglers[=F]      warn about jobs taking F times (default 3) longer than they usually do\n"
+           "  --retry-stragglers    like --stragglers, but also stop such jobs and run them again, once\n"
+           "  --regressions[=FILE]  after building, list targets which took much longer than usual, and write them to FILE\n"
+           "  --variant DIR         build the target in DIR instead, along with any other variants\n"
+           "  --set NAME=VALUE      put NAME=VALUE in the environment of the last variant's commands\n",
+        argv0);
+}
+
+int main(int argc, char** argv) {
+    memset(ERR_BUF, 0, sizeof(ERR_BUF));
+    minimake m = minimake_init(NULL, NULL);
+
+    static const struct option long_options[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "keep-going", no_argument, NULL, 'k' },
+        { "dry-run", no_argument, NULL, 'n' },
+        { "question", no_argument, NULL, 'q' },
+        { "touch", no_argument, NULL, 't' },
+        { "tool", required_argument, NULL, 'T' },
+        { "shm-stat-cache", no_argument, NULL, MINIMAKE_OPT_SHM_STAT_CACHE },
+        { "watch", no_argument, NULL, MINIMAKE_OPT_WATCH },
+        { "prefetch", no_argument, NULL, MINIMAKE_OPT_PREFETCH },
+        { "cpu-timeline", optional_argument, NULL, MINIMAKE_OPT_CPU_TIMELINE },
+        { "placement", no_argument, NULL, MINIMAKE_OPT_PLACEMENT },
+        { "timeout", required_argument, NULL, MINIMAKE_OPT_TIMEOUT },
+        { "stragglers", optional_argument, NULL, MINIMAKE_OPT_STRAGGLERS },
+        { "retry-stragglers", no_argument, NULL, MINIMAKE_OPT_RETRY_STRAGGLERS },
+        { "regressions", optional_argument, NULL, MINIMAKE_OPT_REGRESSIONS },
+        { "variant", required_argument, NULL, MINIMAKE_OPT_VARIANT },
+        { "set", required_argument, NULL, MINIMAKE_OPT_SET },
+        { NULL, 0, NULL, 0 },
+    };
+    int watch = 0;
+    const char* tool = NULL;
+    int opt;
+    /* "+", since everything after -T belongs to the tool */
+    while (!tool && (opt = getopt_long(argc, argv, "+hj:knqtT:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            minimake_usage(argv[0]);
+            return 0;
+        case 'j': {
+            char* end;
+            unsigned long jobs = strtoul(optarg, &end, 10);
+            if (*end || jobs == 0) {
+                printf("ERROR: invalid number of jobs \"%s\"\n", optarg);
+                return 1;
+            }
+            m.max_jobs = jobs;
+            break;
+        }
+        case 'k':
+            m.keep_going = 1;
+            break;
+        case 'n':
+            m.mode = MINIMAKE_MODE_DRY_RUN;
+            break;
+        case 'q':
+            m.mode = MINIMAKE_MODE_QUESTION;
+            break;
+        case 't':
+            m.mode = MINIMAKE_MODE_TOUCH;
+            break;
+        case 'T':
+            tool = optarg;
+            break;
+        case MINIMAKE_OPT_SHM_STAT_CACHE: {
+            minimake_result result = minimake_attach_stat_cache(&m);
+            if (!result.ok) {
+                printf("ERROR: %s (%s)\n", result.message, result.context);
+                return 1;
+            }
+            break;
+        }
+        case MINIMAKE_OPT_WATCH:
+            watch = 1;
+            break;
+        case MINIMAKE_OPT_PREFETCH:
+            m.prefetch = 1;
+            break;
+        case MINIMAKE_OPT_CPU_TIMELINE: {
+            char* end = "";
+            unsigned long interval = optarg ? strtoul(optarg, &end, 10) : 100;
+            if (*end || interval == 0 || interval > 60000) {
+                printf("ERROR: invalid sampling interval \"%s\"\n", optarg);
+                return 1;
+            }
+            m.cpu_timeline_ms = (unsigned)interval;
+            break;
+        }
+        case MINIMAKE_OPT_TIMEOUT: {
+            char* end;
+            unsigned long timeout = strtoul(optarg, &end, 10);
+            if (*end || timeout == 0 || timeout > UINT32_MAX / 1000) {
+                printf("ERROR: invalid timeout \"%s\"\n", optarg);
+                return 1;
+            }
+            m.timeout_s = (unsigned)timeout;
+            break;
+        }
+        case MINIMAKE_OPT_STRAGGLERS: {
+            char* end = "";
+            double factor = optarg ? strtod(optarg, &end) : 3;
+            if (*end || !(factor > 1) || factor > 1000) {
+                printf("ERROR: invalid straggler factor \"%s\"\n", optarg);
+                return 1;
+            }
+            m.straggler_factor = factor;
+            break;
+        }
+        case MINIMAKE_OPT_RETRY_STRAGGLERS:
+            m.retry_stragglers = 1;
+            if (m.straggler_factor == 0) {
+                m.straggler_factor = 3;
+            }
+            break;
+        case MINIMAKE_OPT_REGRESSIONS:
+            m.regressions = 1;
+            m.regressions_file = optarg;
+            break;
+        case MINIMAKE_OPT_VARIANT:
+        case MINIMAKE_OPT_SET: {
+            minimake_result result = opt == MINIMAKE_OPT_VARIANT ? minimake_add_variant(&m, optarg) : minimake_add_variant_setting(&m, optarg);
+            if (!result.ok) {
+                printf("ERROR: %s (%s)\n", result.message, result.context);
+                return 1;
+            }
+            break;
+        }
+        case MINIMAKE_OPT_PLACEMENT: {
+            minimake_result result = minimake_load_topology(&m, "/sys/devices/system/node");
+            if (!result.ok) {
+                printf("ERROR: %s (%s)\n", result.message, result.context);
+                return 1;
+            }
+            break;
+        }
+        default:
+            minimake_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char* buffer = NULL;
+    size_t size = 0;
+    minimake_result result = minimake_read_makefile(&m, "Makefile", &buffer, &size);
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+    buffer[size] = 0;
+    result = minimake_parse(&m, "Minimakefile", buffer);
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+
+    /* a tool's arguments aren't targets */
+    mm_sv target = !tool && optind < argc ? minimake_cstr_stringview(argv[optind]) : minimake_default_target(&m);
+    if (m.n_variants > 0 && target.data) {
+        /* before any tool runs, so it sees the variants' rules too, and e.g. clean removes what they made */
+        int prepare = !tool && (m.mode == MINIMAKE_MODE_BUILD || m.mode == MINIMAKE_MODE_TOUCH);
+        result = minimake_instantiate_variants(&m, target, prepare);
+        if (!result.ok) {
+            printf("ERROR: %s (%s)\n", result.message, result.context);
+            return 1;
+        }
+        target = minimake_cstr_stringview(MINIMAKE_VARIANTS_TARGET);
+    }
+
+    if (tool) {
+        int rc = minimake_run_tool(&m, tool, argc - optind + 1, argv + optind - 1);
+        m.free(buffer);
+        minimake_free(&m);
+        return rc;
+    }
+
+    mm_sv* chain;
+    size_t chain_len;
+
+    if (!target.data) {
+        printf("ERROR: no targets (Makefile)\n");
+        return 1;
+    }
+
+    result = minimake_resolve(&m, target, &chain, &chain_len);
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+
+    if (watch) {
+        result = minimake_watch(&m, "Makefile", chain, chain_len);
+        if (result.ok) {
+            /* the makefile changed, so start over with the new one */
+            fflush(stdout);
+            execv("/proc/self/exe", argv);
+            result = (minimake_result) { .ok = 0, .message = strerror(errno), .context = "restarting" };
+        }
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        return 1;
+    }
+
+    /* now we have the chain, so we can start walking it */
+    result = minimake_execute_chain(&m, chain, chain_len);
+    if (!result.ok) {
+        printf("ERROR: %s (%s)\n", result.message, result.context);
+        /* like make, keep "not up to date" and "broken" apart */
+        return m.mode == MINIMAKE_MODE_QUESTION ? 2 : 1;
+    }
+    if (m.outdated) {
+        return 1;
+    }
+
+    m.free(chain);
+    m.free(buffer);
+    minimake_free(&m);
+    return 0;
+}
+
+#else /* MINIMAKE_TESTS */
+
+UTEST_MAIN()
+
+UTEST(tokenize, empty) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 0);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, target_only) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "target:\n";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 3);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, target_dependency) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "target: dependency\n";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 4);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, target_dependency_command) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "target: dependency\n\tcommand\n";
+    size_t size = strlen(buffer);
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 6);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_COMMAND);
+    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_NEWLINE);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, words) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "these are words\nand these are too";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 8);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[6].type, MINIMAKE_TOK_WORD);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, specials_only) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = ":\n\n\n:::";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 7);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[6].type, MINIMAKE_TOK_COLON);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, comments) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "target: # comment\n";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 3);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, comments_and_words) {
+    minimake m = minimake_init(NULL, NULL);
+    const char* buffer = "target: # comment\nword\n";
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 5);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_NEWLINE);
+    minimake_free(&m);
+}
+
+UTEST(tokenize, complex_case) {
+    const char* makefile = "simple_rule: test-dep\n"
+                           "\ttouch simple_rule\n"
+                           "test-dep: foo bar\n";
+    minimake m = minimake_init(NULL, NULL);
+    minimake_token* tokens = NULL;
+    size_t n_tokens = 0;
+    minimake_result result = minimake_tokenize(&m, makefile, &tokens, &n_tokens);
+    if (!result.ok) {
+        printf("error: %s\n", result.message);
+    }
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(n_tokens, 11);
+    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_COMMAND);
+    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_NEWLINE);
+    ASSERT_EQ(tokens[6].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[7].type, MINIMAKE_TOK_COLON);
+    ASSERT_EQ(tokens[8].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[9].type, MINIMAKE_TOK_WORD);
+    ASSERT_EQ(tokens[10].type, MINIMAKE_TOK_NEWLINE);
+    minimake_free(&m);
+}
+
+UTEST(resolve, simple_rule) {
+    minimake m = minimake_init(malloc, free);
+
+    char* makefile = "simple_rule: test-dep\n"
+                     "\ttouch simple_rule\n"
+                     "test-dep: foo bar\n";
+
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    ASSERT_TRUE(result.ok);
+
+    mm_sv* chain;
+    size_t chain_len;
+    result = minimake_resolve(&m, minimake_cstr_stringview("test-test"), &chain, &chain_len);
+    ASSERT_TRUE(result.ok);
+
+    minimake_free(&m);
+}
+
+UTEST(parse, many_rules) {
+    minimake m = minimake_init(NULL, NULL);
+    char makefile[4096] = { 0 };
+    for (int i = 0; i < 100; ++i) {
+        sprintf(makefile + strlen(makefile), "t%d: a b\n\ttouch t%d\n", i, i);
+    }
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(m.n_rules, 100);
+    ASSERT_EQ(m.rules[99].n_dependencies, 2);
+    ASSERT_EQ(m.rules[99].n_commands, 1);
+    minimake_free(&m);
+}
+
+UTEST(parse, search_path) {
+    minimake m = minimake_init(NULL, NULL);
+    char* makefile = "VPATH = src:lib\n"
+                     "vpath %.h include\n"
+                     "vpath %.h gen\n"
+                     "VPATH += extra\n"
+                     "vpath %.c\n"
+                     "prog: main.o\n"
+                     "\tcc -o prog main.o\n"
+                     "vpath: x\n";
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(m.n_rules, 2);
+    ASSERT_EQ(m.n_vpaths, 5);
+    ASSERT_TRUE(mm_sv_eq(m.vpaths[0].dir, minimake_cstr_stringview("src")));
+    ASSERT_TRUE(mm_sv_eq(m.vpaths[1].dir, minimake_cstr_stringview("lib")));
+    ASSERT_TRUE(mm_sv_eq(m.vpaths[3].pattern, minimake_cstr_stringview("%.h")));
+    ASSERT_TRUE(mm_sv_eq(m.vpaths[3].dir, minimake_cstr_stringview("gen")));
+    ASSERT_TRUE(mm_sv_eq(m.vpaths[4].dir, minimake_cstr_stringview("extra")));
+    ASSERT_TRUE(minimake_vpath_matches(m.vpaths[2].pattern, minimake_cstr_stringview("a.h")));
+    ASSERT_FALSE(minimake_vpath_matches(m.vpaths[2].pattern, minimake_cstr_stringview("a.c")));
+    minimake_free(&m);
+}
+
+UTEST(parse, special_target_without_commands) {
+    minimake m = minimake_init(NULL, NULL);
+    char* makefile = "lib: gen.o\n"
+                     "\tcp gen.o lib\n"
+                     "\n"
+                     ".INTERMEDIATE: gen.c gen.o\n"
+                     "\n"
+                     "gen.o: gen.c\n"
+                     "\tcp gen.c gen.o\n";
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(m.n_rules, 3);
+    ASSERT_EQ(m.rules[1].n_commands, 0);
+    ASSERT_TRUE(minimake_is_special(&m, ".INTERMEDIATE", minimake_cstr_stringview("gen.o")));
+    ASSERT_FALSE(minimake_is_special(&m, ".INTERMEDIATE", minimake_cstr_stringview("lib")));
+    minimake_free(&m);
+}
+
+UTEST(parse, expand_command) {
+    minimake m = minimake_init(NULL, NULL);
+    char* cmd = NULL;
+    size_t cmd_capacity = 0;
+    mm_sv changed = minimake_cstr_stringview("b.o c.o");
+    ASSERT_TRUE(minimake_expand_command(&m, minimake_cstr_stringview("ar r lib.a $?; echo $$? $$HOME $x"), changed, &cmd, &cmd_capacity));
+    ASSERT_STREQ(cmd, "ar r lib.a b.o c.o; echo $? $HOME $x");
+    ASSERT_EQ(minimake_expanded_size(minimake_cstr_stringview("ar r lib.a $?; echo $$? $$HOME $x"), changed), strlen(cmd));
+    ASSERT_TRUE(minimake_expand_command(&m, minimake_cstr_stringview("touch $? $"), (mm_sv) { .data = NULL, .size = 0 }, &cmd, &cmd_capacity));
+    ASSERT_STREQ(cmd, "touch  $");
+    m.free(cmd);
+    minimake_free(&m);
+}
+
+UTEST(parse, normalize_c) {
+    char source[] = "/* header */\n#define  X \"a  // b\"  // x\n\n\tint\ty; /* z\n */ char c = '\\'';\n";
+    size_t size = minimake_normalize_c(source, strlen(source));
+    ASSERT_EQ(size, strlen("#define X \"a  // b\"\nint y; char c = '\\'';\n"));
+    ASSERT_EQ(memcmp(source, "#define X \"a  // b\"\nint y; char c = '\\'';\n", size), 0);
+}
+
+UTEST(set, insert_and_grow) {
+    minimake m = minimake_init(NULL, NULL);
+    mm_set set = { 0 };
+    char names[200][8];
+    for (int i = 0; i < 200; ++i) {
+        sprintf(names[i], "t%d", i);
+        ASSERT_EQ(mm_set_insert(&m, &set, minimake_cstr_stringview(names[i])), 1);
+    }
+    ASSERT_EQ(mm_set_insert(&m, &set, minimake_cstr_stringview("t42")), 0);
+    ASSERT_EQ(set.size, 200);
+    ASSERT_TRUE(mm_set_contains(&set, minimake_cstr_stringview("t199")));
+    ASSERT_FALSE(mm_set_contains(&set, minimake_cstr_stringview("t200")));
+    mm_set_clear(&m, &set);
+    ASSERT_FALSE(mm_set_contains(&set, minimake_cstr_stringview("t1")));
+    minimake_free(&m);
+}
+
+UTEST(graph, build) {
+    minimake m = minimake_init(NULL, NULL);
+    char* makefile = "app: a.o b.o\n"
+                     "\tcc -o app a.o b.o\n"
+                     "a.o: a.c common.h\n"
+                     "\tcc -c a.c\n"
+                     "b.o: b.c common.h\n"
+                     "\tcc -c b.c\n"
+                     ".SECONDARY: a.o\n";
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    ASSERT_TRUE(result.ok);
+    minimake_graph g;
+    result = minimake_graph_build(&m, &g);
+    ASSERT_TRUE(result.ok);
+    /* app, a.o, b.o, a.c, common.h, b.c */
+    ASSERT_EQ(g.n_nodes, 6);
+    size_t app = minimake_graph_find(&g, minimake_cstr_stringview("app"));
+    size_t header = minimake_graph_find(&g, minimake_cstr_stringview("common.h"));
+    ASSERT_NE(app, SIZE_MAX);
+    ASSERT_NE(header, SIZE_MAX);
+    ASSERT_EQ(minimake_graph_find(&g, minimake_cstr_stringview(".SECONDARY")), SIZE_MAX);
+    ASSERT_EQ(g.deps_start[app + 1] - g.deps_start[app], 2);
+    ASSERT_EQ(g.users_start[header + 1] - g.users_start[header], 2);
+    ASSERT_EQ(g.users_start[app + 1] - g.users_start[app], 0);
+    ASSERT_TRUE(g.flags[app] & MM_NODE_HAS_COMMANDS);
+    ASSERT_FALSE(g.flags[header] & MM_NODE_HAS_RULE);
+    minimake_graph_free(&m, &g);
+    minimake_free(&m);
+}
+UTEST(graph, path) {
+    minimake m = minimake_init(NULL, NULL);
+    char* makefile = "app: a.o b.o lib.a\n"
+                     "\tcc -o app a.o b.o lib.a\n"
+                     "lib.a: c.o\n"
+                     "\tar rcs lib.a c.o\n"
+                     "a.o: a.c common.h\n"
+                     "\tcc -c a.c\n"
+                     "b.o: b.c common.h\n"
+                     "\tcc -c b.c\n"
+                     "c.o: c.c common.h\n"
+                     "\tcc -c c.c\n";
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    ASSERT_TRUE(result.ok);
+    minimake_graph g;
+    result = minimake_graph_build(&m, &g);
+    ASSERT_TRUE(result.ok);
+    size_t app = minimake_graph_find(&g, minimake_cstr_stringview("app"));
+    size_t header = minimake_graph_find(&g, minimake_cstr_stringview("common.h"));
+    size_t source = minimake_graph_find(&g, minimake_cstr_stringview("c.c"));
+    size_t path[16];
+    ASSERT_EQ(minimake_graph_path(&m, &g, app, source, path), 4);
+    ASSERT_EQ(path[0], app);
+    ASSERT_EQ(path[1], minimake_graph_find(&g, minimake_cstr_stringview("lib.a")));
+    ASSERT_EQ(path[3], source);
+    ASSERT_EQ(minimake_graph_path(&m, &g, source, app, path), 0);
+    int cyclic;
+    ASSERT_EQ(minimake_graph_count_paths(&m, &g, app, header, &cyclic), 3);
+    ASSERT_FALSE(cyclic);
+    minimake_graph_free(&m, &g);
+    minimake_free(&m);
+}
+
+/* a temporary directory the tests run builds in */
+typedef struct {
+    char cwd[PATH_MAX];
+    char dir[32];
+} mm_test_dir;
+
+/* creates a temporary directory with the (empty) files `sources`, and changes into it */
+static int mm_test_enter(mm_test_dir* d, const char* sources) {
+    char cmd[PATH_MAX];
+    snprintf(d->dir, sizeof(d->dir), "/tmp/minimake-test-XXXXXX");
+    if (!getcwd(d->cwd, sizeof(d->cwd)) || !mkdtemp(d->dir) || chdir(d->dir) < 0) {
+        return -1;
+    }
+    if (!*sources) {
+        return 0;
+    }
+    snprintf(cmd, sizeof(cmd), "touch %s", sources);
+    return system(cmd) == 0 ? 0 : -1;
+}
+
+static void mm_test_leave(mm_test_dir* d) {
+    char cmd[PATH_MAX];
+    (void)!chdir(d->cwd);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", d->dir);
+    (void)!system(cmd);
+}
+
+/* parses `makefile` into `m`, and makes `target`, in the current directory */
+static minimake_result mm_test_make(minimake* m, const char* makefile, const char* target) {
+    char* buffer = strdup(makefile);
+    minimake_result result = minimake_parse(m, "Not A Real Makefile", buffer);
+    mm_sv* chain = NULL;
+    size_t chain_len = 0;
+    if (result.ok) {
+        result = minimake_resolve(m, minimake_cstr_stringview(target), &chain, &chain_len);
+    }
+    if (result.ok) {
+        result = minimake_execute_chain(m, chain, chain_len);
+    }
+    if (chain) {
+        m->free(chain);
+    }
+    /* the rules point into the buffer, so it stays until they're gone */
+    minimake_free(m);
+    free(buffer);
+    return result;
+}
+
+/* reads what the test's commands appended to the file "order" */
+static void mm_test_read_order(char* order, size_t size) {
+    memset(order, 0, size);
+    FILE* file = fopen("order", "r");
+    if (file) {
+        size_t len = fread(order, 1, size - 1, file);
+        order[len] = 0;
+        fclose(file);
+    }
+}
+
+/* builds `target` of `makefile` in a new temporary directory, with `jobs` jobs, and reads back the file "order",
+which the test's commands append their target to */
+static minimake_result mm_test_build(const char* makefile, const char* sources, const char* target, size_t jobs, char* order, size_t size) {
+    mm_test_dir d;
+    minimake m = minimake_init(NULL, NULL);
+    m.max_jobs = jobs;
+    memset(order, 0, size);
+    if (mm_test_enter(&d, sources) < 0) {
+        return (minimake_result) { .ok = 0, .message = "can't set up a directory", .context = "test" };
+    }
+    minimake_result result = mm_test_make(&m, makefile, target);
+    mm_test_read_order(order, size);
+    mm_test_leave(&d);
+    return result;
+}
+
+/* sends stdout to the file "stdout" from here on, returning what to restore it to */
+static int mm_test_capture(void) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int fd = open("stdout", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    return saved;
+}
 
+/* restores stdout, and reads what was written to it since mm_test_capture() */
+static void mm_test_captured(int saved, char* out, size_t size) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    memset(out, 0, size);
+    int fd = open("stdout", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        (void)!read(fd, out, size - 1);
+        close(fd);
+    }
+}
+
+#define MM_TEST_RULE(target, deps) target ": " deps "\n\techo " target " >> order\n\ttouch " target "\n"
+
+UTEST(scheduler, serial_order) {
+    /* with a single job, targets are made in the order the serial walk of the chain made them: from its end,
+    skipping what's done already */
+    const char* makefile = MM_TEST_RULE("all", "app docs") MM_TEST_RULE("app", "a.o b.o") MM_TEST_RULE("docs", "app b.c")
+        MM_TEST_RULE("a.o", "a.c h") MM_TEST_RULE("b.o", "b.c h");
+    minimake m = minimake_init(NULL, NULL);
+    char* buffer = strdup(makefile);
+    ASSERT_TRUE(minimake_parse(&m, "Not A Real Makefile", buffer).ok);
     mm_sv* chain;
     size_t chain_len;
+    ASSERT_TRUE(minimake_resolve(&m, minimake_cstr_stringview("all"), &chain, &chain_len).ok);
+    char expected[256] = { 0 };
+    mm_set seen = { 0 };
+    for (size_t i = chain_len; i-- > 0;) {
+        if (minimake_find_rule(&m, chain[i]) && mm_set_insert(&m, &seen, chain[i]) == 1) {
+            sprintf(expected + strlen(expected), "%.*s\n", (int)chain[i].size, chain[i].data);
+        }
+    }
+    mm_set_clear(&m, &seen);
+    m.free(chain);
+    minimake_free(&m);
+    free(buffer);
+
+    char order[256];
+    ASSERT_TRUE(mm_test_build(makefile, "a.c b.c h", "all", 1, order, sizeof(order)).ok);
+    ASSERT_STREQ(order, expected);
+}
+
+UTEST(scheduler, parallel_order) {
+    /* with several jobs, the order may differ, but never before what a target depends on */
+    const char* makefile = MM_TEST_RULE("all", "app docs") MM_TEST_RULE("app", "a.o b.o") MM_TEST_RULE("docs", "app b.c")
+        MM_TEST_RULE("a.o", "a.c h") MM_TEST_RULE("b.o", "b.c h");
+    char order[256];
+    ASSERT_TRUE(mm_test_build(makefile, "a.c b.c h", "all", 4, order, sizeof(order)).ok);
+    const char* before[][2] = { { "a.o\n", "app\n" }, { "b.o\n", "app\n" }, { "app\n", "docs\n" }, { "docs\n", "all\n" } };
+    for (size_t i = 0; i < sizeof(before) / sizeof(*before); ++i) {
+        char* first = strstr(order, before[i][0]);
+        char* second = strstr(order, before[i][1]);
+        ASSERT_TRUE(first && second && first < second);
+    }
+    ASSERT_EQ(strlen(order), strlen("all\napp\ndocs\na.o\nb.o\n"));
+}
+
+UTEST(scheduler, failure) {
+    /* nothing which depends on a failed target is made, and nothing new starts after the failure */
+    const char* makefile = MM_TEST_RULE("all", "app b.o") "app: a.o\n\tfalse\n" MM_TEST_RULE("a.o", "a.c") MM_TEST_RULE("b.o", "b.c");
+    char order[256];
+    minimake_result result = mm_test_build(makefile, "a.c b.c", "all", 1, order, sizeof(order));
+    ASSERT_FALSE(result.ok);
+    ASSERT_STREQ(result.context, "command");
+    ASSERT_FALSE(strstr(order, "all\n"));
+    /* b.o comes before app in the serial order, so it's made, but nothing after app's failure is */
+    ASSERT_STREQ(order, "a.o\nb.o\n");
+    result = mm_test_build(makefile, "a.c b.c", "all", 4, order, sizeof(order));
+    ASSERT_FALSE(result.ok);
+    ASSERT_FALSE(strstr(order, "all\n"));
+    /* and a missing source fails before anything runs */
+    result = mm_test_build(makefile, "b.c", "all", 4, order, sizeof(order));
+    ASSERT_FALSE(result.ok);
+    ASSERT_FALSE(strstr(order, "a.o\n"));
+    ASSERT_FALSE(strstr(order, "app\n"));
+}
+
+UTEST(scheduler, lock_order) {
+    /* two builds taking overlapping targets in opposite orders; each waits for what the other is making, but
+    neither holds on to its own locks while doing so */
+    const char* makefile = "X: B G A\n\ttouch X\nY: A H B\n\ttouch Y\n"
+                           "A:\n\tsleep 1\n\ttouch A\nB:\n\tsleep 1\n\ttouch B\n"
+                           "G:\n\tsleep 0.3\n\ttouch G\nH:\n\tsleep 0.3\n\ttouch H\n";
+    mm_test_dir d;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    fflush(stdout);
+    pid_t other = fork();
+    if (other == 0) {
+        /* a deadlock shows up as a timeout rather than a hanging test */
+        alarm(20);
+        minimake m = minimake_init(NULL, NULL);
+        m.max_jobs = 2;
+        _exit(mm_test_make(&m, makefile, "Y").ok ? 0 : 1);
+    }
+    ASSERT_GT(other, 0);
+    usleep(100 * 1000);
+    minimake m = minimake_init(NULL, NULL);
+    m.max_jobs = 2;
+    unsigned left = alarm(20);
+    minimake_result result = mm_test_make(&m, makefile, "X");
+    alarm(left);
+    int status = -1;
+    waitpid(other, &status, 0);
+    struct stat st;
+    int made = stat("X", &st) == 0 && stat("Y", &st) == 0;
+    mm_test_leave(&d);
+    ASSERT_TRUE(result.ok);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ASSERT_TRUE(made);
+}
+
+UTEST(scheduler, lock_wait) {
+    /* the only target is being made by another build, so it's all we have parked, and we wait for it */
+    const char* makefile = "A:\n\tsleep 0.5\n\techo A >> order\n\ttouch A\n";
+    mm_test_dir d;
+    char order[64];
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    fflush(stdout);
+    pid_t other = fork();
+    if (other == 0) {
+        minimake m = minimake_init(NULL, NULL);
+        _exit(mm_test_make(&m, makefile, "A").ok ? 0 : 1);
+    }
+    ASSERT_GT(other, 0);
+    usleep(100 * 1000);
+    minimake m = minimake_init(NULL, NULL);
+    minimake_result result = mm_test_make(&m, makefile, "A");
+    int status = -1;
+    waitpid(other, &status, 0);
+    mm_test_read_order(order, sizeof(order));
+    mm_test_leave(&d);
+    ASSERT_TRUE(result.ok);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    /* once it's there, it's up to date */
+    ASSERT_STREQ(order, "A\n");
+}
 
-    mm_sv target;
-    if (argc > 1) {
-        target = minimake_cstr_stringview(argv[1]);
-    } else {
-        target = m.rules[0].target;
+UTEST(scheduler, interrupted_wait) {
+    /* a build waiting for a lock still goes when it's told to */
+    const char* makefile = "A:\n\tsleep 2\n\ttouch A\n";
+    mm_test_dir d;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    fflush(stdout);
+    pid_t children[2];
+    for (int i = 0; i < 2; ++i) {
+        children[i] = fork();
+        if (children[i] == 0) {
+            minimake m = minimake_init(NULL, NULL);
+            _exit(mm_test_make(&m, makefile, "A").ok ? 0 : 1);
+        }
+        usleep(200 * 1000);
     }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kill(children[1], SIGTERM);
+    int status[2] = { -1, -1 };
+    waitpid(children[1], &status[1], 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    waitpid(children[0], &status[0], 0);
+    mm_test_leave(&d);
+    ASSERT_TRUE(WIFEXITED(status[0]) && WEXITSTATUS(status[0]) == 0);
+    ASSERT_TRUE(WIFSIGNALED(status[1]) && WTERMSIG(status[1]) == SIGTERM);
+    /* rather than once the other build is done */
+    ASSERT_LT((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000, 1000);
+}
 
-    result = minimake_resolve(&m, target, &chain, &chain_len);
-    if (!result.ok) {
-        printf("ERROR: %s (%s)\n", result.message, result.context);
-        return 1;
+UTEST(scheduler, placement) {
+    cpu_set_t cpus;
+    ASSERT_EQ(minimake_parse_cpulist("0-3,8,10-11\n", &cpus), 7);
+    ASSERT_TRUE(CPU_ISSET(8, &cpus));
+    ASSERT_FALSE(CPU_ISSET(9, &cpus));
+    ASSERT_EQ(minimake_parse_cpulist("3-1", &cpus), -1);
+
+    mm_topology t;
+    memset(&t, 0, sizeof(t));
+    t.n_nodes = 2;
+    t.n_cpus[0] = 4;
+    t.n_cpus[1] = 2;
+    size_t placed[3];
+    for (size_t i = 0; i < 3; ++i) {
+        placed[i] = minimake_place_job(&t, 1);
     }
+    ASSERT_EQ(placed[0], 0);
+    ASSERT_EQ(placed[1], 1);
+    ASSERT_EQ(placed[2], 0);
+}
 
-    /* now we have the chain, so we can start walking it */
-    result = minimake_execute_chain(&m, chain, chain_len);
-    if (!result.ok) {
-        printf("ERROR: %s (%s)\n", result.message, result.context);
-        return 1;
+UTEST(scheduler, topology) {
+    mm_test_dir d;
+    cpu_set_t allowed;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+    int forbidden = CPU_SETSIZE - 1;
+    while (forbidden > 0 && CPU_ISSET(forbidden, &allowed)) {
+        --forbidden;
     }
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    /* no nodes at all, so everything we may run on is one */
+    minimake m = minimake_init(NULL, NULL);
+    minimake_result result = minimake_load_topology(&m, "nodes");
+    ASSERT_TRUE(result.ok);
+    size_t n_nodes = m.topology->n_nodes;
+    int same = CPU_EQUAL(&m.topology->cpus[0], &allowed);
+    minimake_free(&m);
 
-    m.free(chain);
-    m.free(buffer);
+    /* node1 is offline, node2's list is broken, and node3 has only a CPU we can't run on */
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "mkdir -p nodes/node0 nodes/node2 nodes/node3 && echo 0-%d > nodes/node0/cpulist"
+        " && echo x > nodes/node2/cpulist && echo %d > nodes/node3/cpulist", CPU_SETSIZE - 1, forbidden);
+    int made = system(cmd);
+    m = minimake_init(NULL, NULL);
+    result = minimake_load_topology(&m, "nodes");
+    mm_test_leave(&d);
+    ASSERT_EQ(n_nodes, 1);
+    ASSERT_TRUE(same);
+    ASSERT_EQ(made, 0);
+    ASSERT_TRUE(result.ok);
+    ASSERT_EQ(m.topology->n_nodes, 1);
+    ASSERT_EQ(m.topology->n_cpus[0], (size_t)CPU_COUNT(&allowed));
+    ASSERT_TRUE(CPU_EQUAL(&m.topology->cpus[0], &allowed));
     minimake_free(&m);
-    return 0;
 }
 
-#else /* MINIMAKE_TESTS */
+UTEST(scheduler, baseline) {
+    mm_history history;
+    memset(&history, 0, sizeof(history));
+    ASSERT_EQ(minimake_baseline(&history).median_ms, 0);
+    uint32_t durations[] = { 300, 100, 200, 90000 };
+    for (size_t i = 0; i < 4; ++i) {
+        minimake_add_history(0, durations[i], &history);
+    }
+    /* the one hang doesn't count for much */
+    mm_baseline baseline = minimake_baseline(&history);
+    ASSERT_EQ(baseline.median_ms, 250);
+    ASSERT_EQ(baseline.mad_ms, 100);
+    ASSERT_EQ(baseline.samples, 4);
+    /* too little history to tell */
+    ASSERT_EQ(minimake_regression_score(&baseline, 5000), 0);
+    for (size_t i = 0; i < MINIMAKE_HISTORY; ++i) {
+        minimake_add_history(0, 1000, &history);
+    }
+    baseline = minimake_baseline(&history);
+    ASSERT_EQ(baseline.median_ms, 1000);
+    ASSERT_EQ(baseline.mad_ms, 0);
+    ASSERT_EQ(baseline.samples, MINIMAKE_HISTORY);
+    ASSERT_EQ(minimake_regression_score(&baseline, 1100), 0);
+    ASSERT_NE(minimake_regression_score(&baseline, 1300), 0);
+    /* some noise makes it harder to stand out */
+    for (size_t i = 0; i < 6; ++i) {
+        minimake_add_history(0, 1200, &history);
+        minimake_add_history(0, 800, &history);
+    }
+    baseline = minimake_baseline(&history);
+    ASSERT_EQ(baseline.mad_ms, 200);
+    ASSERT_EQ(minimake_regression_score(&baseline, 1900), 0);
+    ASSERT_NE(minimake_regression_score(&baseline, 2100), 0);
+}
 
-UTEST_MAIN()
+UTEST(scheduler, cpu_timeline) {
+    unsigned long long busy, total;
+    ASSERT_EQ(minimake_parse_cpu_times("cpu  100 5 20 800 50 1 2 3 0 0\ncpu0 1 2 3 4 5 6 7 8\n", &busy, &total), 0);
+    ASSERT_EQ(busy, 131ull);
+    ASSERT_EQ(total, 981ull);
+    ASSERT_EQ(minimake_parse_cpu_times("intr 1 2 3\n", &busy, &total), -1);
+    /* 4 CPUs, and half the ticks in between were busy */
+    ASSERT_EQ(minimake_cpu_busy(131, 981, 331, 1381, 4), 2.0);
+    /* nothing in between, or the counters went backwards */
+    ASSERT_EQ(minimake_cpu_busy(131, 981, 131, 981, 4), 0.0);
+    ASSERT_EQ(minimake_cpu_busy(331, 1381, 131, 981, 4), 0.0);
 
-UTEST(tokenize, empty) {
+    mm_cpu_summary summary = minimake_summarize_cpu(NULL, 0, 4);
+    ASSERT_EQ(summary.seconds, 0.0);
+    ASSERT_EQ(summary.utilization, 0.0);
+    /* a second of four jobs, then one job, then none, then one with a couple of others ending */
+    mm_cpu_sample samples[] = {
+        { .at_ms = 1000, .jobs = 4, .busy = 4, .jobs_busy = 4 },
+        { .at_ms = 2000, .jobs = 1, .busy = 1, .jobs_busy = 1 },
+        { .at_ms = 3000, .jobs = 0, .busy = 0, .jobs_busy = 0 },
+        { .at_ms = 4000, .jobs = 1.5f, .busy = 3, .jobs_busy = 1.5f },
+    };
+    summary = minimake_summarize_cpu(samples, 4, 4);
+    ASSERT_EQ(summary.seconds, 4.0);
+    ASSERT_EQ(summary.utilization, 50.0);
+    ASSERT_EQ(summary.serial_seconds, 1.0);
+    ASSERT_EQ(summary.idle_seconds, 1.0);
+}
+
+UTEST(scheduler, ready_order) {
+    /* the ready target furthest back in the chain goes first, unless another one has a higher priority */
+    size_t key[] = { 4, 0, 7, 2, 9 };
+    size_t ready[5];
+    uint8_t state[5];
+    uint8_t priority[5];
+    mm_scheduler s;
+    memset(&s, 0, sizeof(s));
+    memset(priority, MM_PRIORITY_NORMAL, sizeof(priority));
+    s.priority = priority;
+    s.key = key;
+    s.ready = ready;
+    s.state = state;
+    for (size_t node = 0; node < 5; ++node) {
+        mm_ready_push(&s, node);
+    }
+    ASSERT_EQ(s.n_ready, 5);
+    ASSERT_EQ(state[3], MM_TARGET_READY);
+    ASSERT_EQ(mm_ready_pop(&s), 4);
+    ASSERT_EQ(mm_ready_pop(&s), 2);
+    mm_ready_push(&s, 4);
+    ASSERT_EQ(mm_ready_pop(&s), 4);
+    ASSERT_EQ(mm_ready_pop(&s), 0);
+    ASSERT_EQ(mm_ready_pop(&s), 3);
+    ASSERT_EQ(mm_ready_pop(&s), 1);
+    ASSERT_EQ(s.n_ready, 0);
+
+    priority[1] = MM_PRIORITY_HIGH;
+    priority[4] = MM_PRIORITY_LOW;
+    for (size_t node = 0; node < 5; ++node) {
+        mm_ready_push(&s, node);
+    }
+    ASSERT_EQ(mm_ready_pop(&s), 1);
+    ASSERT_EQ(mm_ready_pop(&s), 2);
+    ASSERT_EQ(mm_ready_pop(&s), 0);
+    ASSERT_EQ(mm_ready_pop(&s), 3);
+    ASSERT_EQ(mm_ready_pop(&s), 4);
+}
+
+UTEST(modes, question) {
+    const char* makefile = MM_TEST_RULE("out", "in") "broken: missing.h\n\ttouch broken\n";
+    mm_test_dir d;
+    char order[64];
+    char out[256];
+    ASSERT_EQ(mm_test_enter(&d, "in"), 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
-    ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 0);
-    minimake_free(&m);
+    m.mode = MINIMAKE_MODE_QUESTION;
+    int saved = mm_test_capture();
+    minimake_result outdated = mm_test_make(&m, makefile, "out");
+    int was_outdated = m.outdated;
+    m = minimake_init(NULL, NULL);
+    minimake_result built = mm_test_make(&m, makefile, "out");
+    m = minimake_init(NULL, NULL);
+    m.mode = MINIMAKE_MODE_QUESTION;
+    minimake_result up_to_date = mm_test_make(&m, makefile, "out");
+    int was_up_to_date = !m.outdated;
+    m = minimake_init(NULL, NULL);
+    m.mode = MINIMAKE_MODE_QUESTION;
+    /* main() exits with 2 for this, rather than 1 for outdated */
+    minimake_result broken = mm_test_make(&m, makefile, "broken");
+    int broken_outdated = m.outdated;
+    mm_test_captured(saved, out, sizeof(out));
+    mm_test_read_order(order, sizeof(order));
+    mm_test_leave(&d);
+    ASSERT_TRUE(outdated.ok);
+    ASSERT_TRUE(was_outdated);
+    ASSERT_TRUE(built.ok);
+    ASSERT_TRUE(up_to_date.ok);
+    ASSERT_TRUE(was_up_to_date);
+    ASSERT_FALSE(broken.ok);
+    ASSERT_STREQ(broken.message, "no rule to make \"missing.h\"");
+    ASSERT_FALSE(broken_outdated);
+    /* only the real build ran, or printed, anything */
+    ASSERT_STREQ(order, "out\n");
+    ASSERT_STREQ(out, "echo out >> order\ntouch out\n");
 }
 
-UTEST(tokenize, target_only) {
+UTEST(modes, dry_run) {
+    mm_test_dir d;
+    char out[256];
+    struct stat st;
+    ASSERT_EQ(mm_test_enter(&d, "in"), 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "target:\n";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    m.mode = MINIMAKE_MODE_DRY_RUN;
+    int saved = mm_test_capture();
+    minimake_result result = mm_test_make(&m, MM_TEST_RULE("out", "in"), "out");
+    mm_test_captured(saved, out, sizeof(out));
+    int touched = stat("out", &st) == 0 || stat("order", &st) == 0;
+    mm_test_leave(&d);
     ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 3);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
-    minimake_free(&m);
+    ASSERT_FALSE(touched);
+    ASSERT_STREQ(out, "echo out >> order\ntouch out\n");
 }
 
-UTEST(tokenize, target_dependency) {
+UTEST(modes, touch) {
+    const char* makefile = MM_TEST_RULE("out", "mid") MM_TEST_RULE("mid", "in") "broken: missing.h\n\ttouch broken\n";
+    mm_test_dir d;
+    char order[64];
+    char out[256];
+    struct stat st;
+    ASSERT_EQ(mm_test_enter(&d, "in"), 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "target: dependency\n";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    m.mode = MINIMAKE_MODE_TOUCH;
+    int saved = mm_test_capture();
+    minimake_result result = mm_test_make(&m, makefile, "out");
+    m = minimake_init(NULL, NULL);
+    m.mode = MINIMAKE_MODE_TOUCH;
+    minimake_result broken = mm_test_make(&m, makefile, "broken");
+    mm_test_captured(saved, out, sizeof(out));
+    mm_test_read_order(order, sizeof(order));
+    int made = stat("out", &st) == 0 && stat("mid", &st) == 0;
+    mm_test_leave(&d);
     ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 4);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
-    minimake_free(&m);
+    ASSERT_TRUE(made);
+    /* the files are there, but nothing ran */
+    ASSERT_STREQ(order, "");
+    ASSERT_STREQ(out, "touch mid\ntouch out\n");
+    ASSERT_FALSE(broken.ok);
 }
 
-UTEST(tokenize, target_dependency_command) {
+UTEST(log, compact) {
+    mm_test_dir d;
+    char line[64];
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    mkdir(MINIMAKE_STATE_DIR, 0777);
+    FILE* file = fopen(MINIMAKE_STATE_DIR "/log", "w");
+    /* the durations count up, so we can tell which lines are kept */
+    for (int i = 0; i < 100; ++i) {
+        fprintf(file, "%d %d a\n", i, i);
+        if (i % 2 == 0) {
+            fprintf(file, "%d %d c d\n", i, i);
+        }
+    }
+    fprintf(file, "1 1 b\n");
+    fclose(file);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "target: dependency\n\tcommand\n";
-    size_t size = strlen(buffer);
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
-    ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 6);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_COMMAND);
-    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_NEWLINE);
+    minimake_compact_log(&m);
+    int n_a = 0, n_b = 0, n_c = 0, oldest_a = -1, oldest_c = -1;
+    file = fopen(MINIMAKE_STATE_DIR "/log", "r");
+    while (file && fgets(line, sizeof(line), file)) {
+        int when, duration, name = 0;
+        sscanf(line, "%d %d %n", &when, &duration, &name);
+        if (strcmp(line + name, "a\n") == 0) {
+            oldest_a = n_a++ == 0 ? duration : oldest_a;
+        } else if (strcmp(line + name, "b\n") == 0) {
+            ++n_b;
+        } else if (strcmp(line + name, "c d\n") == 0) {
+            oldest_c = n_c++ == 0 ? duration : oldest_c;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    mm_test_leave(&d);
+    ASSERT_EQ(n_a, MINIMAKE_HISTORY);
+    ASSERT_EQ(oldest_a, 100 - MINIMAKE_HISTORY);
+    ASSERT_EQ(n_b, 1);
+    ASSERT_EQ(n_c, MINIMAKE_HISTORY);
+    ASSERT_EQ(oldest_c, 100 - 2 * MINIMAKE_HISTORY);
+}
+
+/* runs analyze on `makefile` in the current directory, with the build log `log`, and reads back what it printed */
+static minimake_result mm_test_analyze(const char* makefile, const char* log, size_t limit, char* out, size_t size) {
+    char* buffer = strdup(makefile);
+    minimake m = minimake_init(NULL, NULL);
+    mkdir(MINIMAKE_STATE_DIR, 0777);
+    FILE* file = fopen(MINIMAKE_STATE_DIR "/log", "w");
+    if (file) {
+        fputs(log, file);
+        fclose(file);
+    }
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", buffer);
+    int saved = mm_test_capture();
+    if (result.ok) {
+        result = minimake_analyze(&m, limit);
+    }
+    mm_test_captured(saved, out, size);
     minimake_free(&m);
+    free(buffer);
+    return result;
 }
 
-UTEST(tokenize, words) {
+UTEST(analyze, impact) {
+    mm_test_dir d;
+    char out[1024];
+    ASSERT_EQ(mm_test_enter(&d, "a.c b.c h"), 0);
+    /* the latest duration of a.o counts */
+    minimake_result result = mm_test_analyze(
+        "app: a.o b.o\n\ttouch app\n"
+        "a.o: a.c h\n\ttouch a.o\n"
+        "b.o: b.c h\n\ttouch b.o\n",
+        "1 1000 a.o\n1 3000 b.o\n1 500 app\n2 2000 a.o\n", 2, out, sizeof(out));
+    mm_test_leave(&d);
+    ASSERT_TRUE(result.ok);
+    ASSERT_STREQ(out,
+        "what changing a source makes again (targets, seconds they took to make last time):\n"
+        "       3       5.50  h\n"
+        "       2       3.50  b.c\n"
+        "(and 1 more)\n"
+        "\nwarnings:\n"
+        "  none\n");
+}
+
+#define MM_TEST_FAN_IN " d0 d1 d2 d3 d4 d5 d6 d7 d8 d9 d10 d11 d12 d13 d14 d15 d16 d17 d18 d19 d20 d21 d22 d23 d24 d25 d26 d27 d28 d29 d30 d31 d32\n"
+
+UTEST(analyze, warnings) {
+    mm_test_dir d;
+    char out[4096];
+    ASSERT_EQ(mm_test_enter(&d, "z"), 0);
+    mkdir("dir", 0777);
+    /* "phony" has no commands, "made" was made but didn't turn up, and "new" just hasn't been made yet */
+    minimake_result result = mm_test_analyze(
+        "x.o: dir y z\n\ttouch x.o\n"
+        "y: z\n\ttouch y\n"
+        "phony:" MM_TEST_FAN_IN
+        "made:" MM_TEST_FAN_IN "\ttrue\n"
+        "new:" MM_TEST_FAN_IN "\ttouch new\n",
+        "1 100 made\n", 10, out, sizeof(out));
+    mm_test_leave(&d);
+    ASSERT_TRUE(result.ok);
+    ASSERT_TRUE(strstr(out, "  \"dir\" is a directory, so 1 target(s)") != NULL);
+    ASSERT_TRUE(strstr(out, "  \"phony\" has 33 dependencies but is not a file") != NULL);
+    ASSERT_TRUE(strstr(out, "  \"made\" has 33 dependencies but is not a file") != NULL);
+    ASSERT_TRUE(strstr(out, "\"new\" has") == NULL);
+    ASSERT_TRUE(strstr(out, "  \"x.o\" depends on \"z\" through other dependencies already") != NULL);
+    ASSERT_TRUE(strstr(out, "  none\n") == NULL);
+}
+
+UTEST(stage, stale_link) {
+    /* a killed build's staged target, newer than its source, is still made again */
+    char stale[] = "/dev/shm/minimake-XXXXXX";
+    char staged[64];
+    char order[64];
+    mm_test_dir d;
+    struct stat st;
+    ASSERT_EQ(mm_test_enter(&d, "in"), 0);
+    ASSERT_TRUE(mkdtemp(stale) != NULL);
+    snprintf(staged, sizeof(staged), "%s/out", stale);
+    close(open(staged, O_WRONLY | O_CREAT, 0666));
+    ASSERT_EQ(symlink(staged, "out"), 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "these are words\nand these are too";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    minimake_result result = mm_test_make(&m, MM_TEST_RULE("out", "in"), "out");
+    mm_test_read_order(order, sizeof(order));
+    int replaced = lstat("out", &st) == 0 && S_ISREG(st.st_mode);
+    /* and what the link pointed to is gone from memory, with its directory */
+    int stale_removed = lstat(stale, &st) < 0 && errno == ENOENT;
+    mm_test_leave(&d);
     ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 8);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[6].type, MINIMAKE_TOK_WORD);
-    minimake_free(&m);
+    ASSERT_STREQ(order, "out\n");
+    ASSERT_TRUE(replaced);
+    ASSERT_TRUE(stale_removed);
 }
 
-UTEST(tokenize, specials_only) {
+UTEST(changed, many_dependencies) {
+    /* "$?" lists only the dependency newer than the target, even with as many dependencies as a rule can have */
+    char makefile[2048] = "out:";
+    char sources[1024] = "";
+    char changed[64];
+    mm_test_dir d;
+    struct timespec past[2] = { { .tv_sec = 1000000000, .tv_nsec = 0 }, { .tv_sec = 1000000000, .tv_nsec = 0 } };
+    for (int i = 0; i < 64; ++i) {
+        snprintf(makefile + strlen(makefile), sizeof(makefile) - strlen(makefile), " d%d", i);
+        snprintf(sources + strlen(sources), sizeof(sources) - strlen(sources), " d%d", i);
+    }
+    snprintf(makefile + strlen(makefile), sizeof(makefile) - strlen(makefile), "\n\techo $? > changed\n\ttouch out\n");
+    ASSERT_EQ(mm_test_enter(&d, sources), 0);
+    /* everything but d50 is older than the target */
+    close(open("out", O_WRONLY | O_CREAT, 0666));
+    for (int i = 0; i < 64; ++i) {
+        char name[8];
+        snprintf(name, sizeof(name), "d%d", i);
+        if (i != 50) {
+            utimensat(AT_FDCWD, name, past, 0);
+        }
+    }
+    utimensat(AT_FDCWD, "out", past, 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = ":\n\n\n:::";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    /* keeps the commands out of the test's output */
+    int saved = mm_test_capture();
+    minimake_result result = mm_test_make(&m, makefile, "out");
+    mm_test_captured(saved, changed, sizeof(changed));
+    memset(changed, 0, sizeof(changed));
+    FILE* file = fopen("changed", "r");
+    if (file) {
+        (void)!fread(changed, 1, sizeof(changed) - 1, file);
+        fclose(file);
+    }
+    mm_test_leave(&d);
     ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 7);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[6].type, MINIMAKE_TOK_COLON);
-    minimake_free(&m);
+    ASSERT_STREQ(changed, "d50\n");
 }
 
-UTEST(tokenize, comments) {
+UTEST(variants, rules) {
+    /* every variant gets a copy of the rules, whose targets are in its directory, while sources stay shared */
+    char makefile[] = "out: mid in\n\tcat mid in > out\nmid: in\n\tcp in mid\n";
+    char debug[] = "debug";
+    char release[] = "build/release";
+    char cflags[] = "CFLAGS=-O2";
+    char ndebug[] = "NDEBUG=1";
+    char no_name[] = "=1";
+    char no_value[] = "CFLAGS";
+    mm_test_dir d;
+    struct stat st;
+    ASSERT_EQ(mm_test_enter(&d, "in"), 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "target: # comment\n";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
     ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 3);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
+    /* --set goes with the --variant before it */
+    ASSERT_FALSE(minimake_add_variant_setting(&m, cflags).ok);
+    ASSERT_TRUE(minimake_add_variant(&m, debug).ok);
+    ASSERT_TRUE(minimake_add_variant(&m, release).ok);
+    ASSERT_TRUE(minimake_add_variant_setting(&m, cflags).ok);
+    ASSERT_TRUE(minimake_add_variant_setting(&m, ndebug).ok);
+    ASSERT_FALSE(minimake_add_variant_setting(&m, no_name).ok);
+    ASSERT_FALSE(minimake_add_variant_setting(&m, no_value).ok);
+    ASSERT_EQ(m.variants[0].n_env, 0);
+    ASSERT_EQ(m.variants[1].n_env, 2);
+    ASSERT_STREQ(m.variants[1].env[0], "CFLAGS=-O2");
+    ASSERT_STREQ(m.variants[1].env[1], "NDEBUG=1");
+    /* as for a dry run */
+    result = minimake_instantiate_variants(&m, minimake_cstr_stringview("out"), 0);
+    int untouched = stat("debug", &st) < 0 && stat("build", &st) < 0;
+    mm_test_leave(&d);
+    ASSERT_TRUE(result.ok);
+    ASSERT_TRUE(untouched);
+    ASSERT_EQ(m.n_rules, 7);
+    minimake_rule* out = &m.rules[4];
+    ASSERT_EQ(out->variant, 2);
+    ASSERT_TRUE(mm_sv_eq(out->target, minimake_cstr_stringview("build/release/out")));
+    ASSERT_EQ(out->n_dependencies, 2);
+    ASSERT_TRUE(mm_sv_eq(out->dependencies[0], minimake_cstr_stringview("build/release/mid")));
+    ASSERT_TRUE(mm_sv_eq(out->dependencies[1], minimake_cstr_stringview("in")));
+    /* the commands stay as they are, and run in the variant's directory */
+    ASSERT_TRUE(mm_sv_eq(out->commands[0], m.rules[0].commands[0]));
+    ASSERT_TRUE(mm_sv_eq(m.rules[3].target, minimake_cstr_stringview("debug/mid")));
+    ASSERT_EQ(m.rules[0].variant, 0);
+    ASSERT_TRUE(mm_sv_eq(m.rules[0].target, minimake_cstr_stringview("out")));
+    minimake_rule* all = &m.rules[6];
+    ASSERT_TRUE(mm_sv_eq(all->target, minimake_cstr_stringview(MINIMAKE_VARIANTS_TARGET)));
+    ASSERT_EQ(all->n_dependencies, 2);
+    ASSERT_TRUE(mm_sv_eq(all->dependencies[0], minimake_cstr_stringview("debug/out")));
+    ASSERT_TRUE(mm_sv_eq(all->dependencies[1], minimake_cstr_stringview("build/release/out")));
     minimake_free(&m);
 }
 
-UTEST(tokenize, comments_and_words) {
+UTEST(watch, priority) {
+    /* the watcher's jobs hold locks others wait for, so only their disk time is idle */
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        minimake_become_idle();
+        /* IOPRIO_WHO_PROCESS */
+        long ioprio = syscall(SYS_ioprio_get, 1, 0);
+        _exit(sched_getscheduler(0) == SCHED_OTHER && getpriority(PRIO_PROCESS, 0) == 0 && ioprio >> 13 == 3 ? 0 : 1);
+    }
+    ASSERT_GT(child, 0);
+    int status = -1;
+    waitpid(child, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* watches `target` of `makefile` from a child process, whose output goes to the file "watch"; returns its pid */
+static pid_t mm_test_watch(const char* makefile, const char* target) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = open("watch", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        dup2(fd, STDOUT_FILENO);
+        char* buffer = strdup(makefile);
+        minimake m = minimake_init(NULL, NULL);
+        mm_sv* chain = NULL;
+        size_t chain_len = 0;
+        minimake_result result = minimake_parse(&m, "Not A Real Makefile", buffer);
+        if (result.ok) {
+            result = minimake_resolve(&m, minimake_cstr_stringview(target), &chain, &chain_len);
+        }
+        if (result.ok) {
+            result = minimake_watch(&m, "Makefile", chain, chain_len);
+        }
+        fflush(stdout);
+        _exit(result.ok ? 0 : 1);
+    }
+    return child;
+}
+
+/* waits, for up to five seconds, for `file` to hold `text` */
+static int mm_test_wait_for(const char* file, const char* text) {
+    char content[1024];
+    for (int i = 0; i < 500; ++i) {
+        memset(content, 0, sizeof(content));
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            (void)!read(fd, content, sizeof(content) - 1);
+            close(fd);
+        }
+        if (strstr(content, text)) {
+            return 1;
+        }
+        usleep(10000);
+    }
+    return 0;
+}
+
+UTEST(watch, rebuild) {
+    /* an edit to a source makes the target again, however the makefile spells the source's name */
+    const char* makefile = MM_TEST_RULE("out", "./a.c");
+    struct timespec old[2] = { { .tv_sec = 1000000000, .tv_nsec = 0 }, { .tv_sec = 1000000000, .tv_nsec = 0 } };
+    mm_test_dir d;
+    ASSERT_EQ(mm_test_enter(&d, "a.c"), 0);
+    pid_t child = mm_test_watch(makefile, "out");
+    int built = mm_test_wait_for("order", "out\n");
+    /* mtimes are compared to the second, so rather than wait for the next one, make "out" older than the edit */
+    utimensat(AT_FDCWD, "out", old, 0);
+    FILE* file = fopen("a.c", "w");
+    fputs("int a;\n", file);
+    fclose(file);
+    int rebuilt = mm_test_wait_for("order", "out\nout\n");
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    mm_test_leave(&d);
+    ASSERT_TRUE(built);
+    ASSERT_TRUE(rebuilt);
+}
+
+UTEST(watch, missing_dir) {
+    /* a source in a directory which doesn't exist yet doesn't stop the watch, which starts over once it appears */
+    const char* makefile = MM_TEST_RULE("out", "gen/a.c");
+    mm_test_dir d;
+    int status = -1;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    pid_t child = mm_test_watch(makefile, "out");
+    /* the first build fails, since there's no gen/a.c */
+    int waiting = mm_test_wait_for("watch", "ERROR");
+    int made_dir = mkdir("gen", 0777) == 0;
+    int restarted = mm_test_wait_for("watch", "\"gen\" appeared\n");
+    for (int i = 0; i < 500 && waitpid(child, &status, WNOHANG) == 0; ++i) {
+        usleep(10000);
+    }
+    if (!WIFEXITED(status)) {
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+    }
+    mm_test_leave(&d);
+    ASSERT_TRUE(waiting);
+    ASSERT_TRUE(made_dir);
+    ASSERT_TRUE(restarted);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* tries to take a lock on the byte of `target` in the lock table, through its own open file description */
+static int mm_test_lock(int fd, const char* target, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)(minimake_hash(minimake_cstr_stringview(target)) >> 24);
+    fl.l_len = 1;
+    return fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+UTEST(locks, conflicts) {
+    /* as far as the locks are concerned, another open file description is another minimake */
+    mm_test_dir d;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
     minimake m = minimake_init(NULL, NULL);
-    const char* buffer = "target: # comment\nword\n";
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, buffer, &tokens, &n_tokens);
-    ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 5);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_NEWLINE);
+    int writing = minimake_lock(&m, minimake_cstr_stringview("a"), F_WRLCK, 0);
+    int other = open(MINIMAKE_STATE_DIR "/lock", O_RDWR | O_CLOEXEC);
+    /* someone making "a" keeps others from reading or making it */
+    int other_reads_a = mm_test_lock(other, "a", F_RDLCK);
+    /* but not from anything else */
+    int other_writes_b = mm_test_lock(other, "b", F_WRLCK);
+    int reading_b = minimake_lock(&m, minimake_cstr_stringview("b"), F_RDLCK, 0);
+    minimake_lock(&m, minimake_cstr_stringview("a"), F_UNLCK, 0);
+    int other_writes_a = mm_test_lock(other, "a", F_WRLCK);
+    close(other);
     minimake_free(&m);
+    mm_test_leave(&d);
+    ASSERT_EQ(writing, 0);
+    ASSERT_EQ(other_reads_a, -1);
+    ASSERT_EQ(other_writes_b, 0);
+    ASSERT_EQ(reading_b, -1);
+    ASSERT_EQ(other_writes_a, 0);
 }
 
-UTEST(tokenize, complex_case) {
-    const char* makefile = "simple_rule: test-dep\n"
-                           "\ttouch simple_rule\n"
-                           "test-dep: foo bar\n";
+UTEST(stat_cache, shared) {
+    /* two minimakes in one directory see each other's lookups, until one of them runs a command */
+    mm_test_dir d;
+    char table[64];
+    char cwd[PATH_MAX];
+    struct stat st[6];
+    int found[6];
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != NULL);
+    snprintf(table, sizeof(table), "/dev/shm/minimake-%016llx", (unsigned long long)minimake_hash(minimake_cstr_stringview(cwd)));
+    minimake a = minimake_init(NULL, NULL);
+    minimake b = minimake_init(NULL, NULL);
+    ASSERT_TRUE(minimake_attach_stat_cache(&a).ok);
+    ASSERT_TRUE(minimake_attach_stat_cache(&b).ok);
+    FILE* file = fopen("f", "w");
+    fputs("abc", file);
+    fclose(file);
+    found[0] = minimake_stat(&a, "f", &st[0]) == 0;
+    found[1] = minimake_stat(&a, "g", &st[1]) == 0;
+    file = fopen("f", "a");
+    fputs("def", file);
+    fclose(file);
+    fclose(fopen("g", "w"));
+    /* answered from what a saw */
+    found[2] = minimake_stat(&b, "f", &st[2]) == 0;
+    found[3] = minimake_stat(&b, "g", &st[3]) == 0;
+    minimake_stat_cache_invalidate(&a);
+    found[4] = minimake_stat(&b, "f", &st[4]) == 0;
+    found[5] = minimake_stat(&b, "g", &st[5]) == 0;
+    minimake_free(&a);
+    /* b still uses the table */
+    int kept = access(table, F_OK) == 0;
+    minimake_free(&b);
+    int removed = access(table, F_OK) < 0;
+    mm_test_leave(&d);
+    ASSERT_TRUE(found[0]);
+    ASSERT_EQ(st[0].st_size, 3);
+    ASSERT_FALSE(found[1]);
+    ASSERT_TRUE(found[2]);
+    ASSERT_EQ(st[2].st_size, 3);
+    ASSERT_FALSE(found[3]);
+    ASSERT_TRUE(found[4]);
+    ASSERT_EQ(st[4].st_size, 6);
+    ASSERT_TRUE(found[5]);
+    ASSERT_TRUE(kept);
+    ASSERT_TRUE(removed);
+}
+
+UTEST(intermediate, not_remade) {
+    /* an intermediate deleted after the build isn't made again, until what it's made from changes */
+    const char* makefile = MM_TEST_RULE("out", "mid") MM_TEST_RULE("mid", "in") ".INTERMEDIATE: mid\n";
+    mm_test_dir d;
+    char order[3][64];
+    struct stat st;
+    struct timespec past[2] = { { .tv_sec = 1000000000, .tv_nsec = 0 }, { .tv_sec = 1000000000, .tv_nsec = 0 } };
+    struct timespec older[2] = { { .tv_sec = 900000000, .tv_nsec = 0 }, { .tv_sec = 900000000, .tv_nsec = 0 } };
+    ASSERT_EQ(mm_test_enter(&d, "in"), 0);
+    utimensat(AT_FDCWD, "in", past, 0);
+    minimake_result result[3];
+    int saved = mm_test_capture();
+    for (int i = 0; i < 3; ++i) {
+        if (i == 2) {
+            /* mtimes are compared to the second, so rather than touch "in", make "out" older than it */
+            utimensat(AT_FDCWD, "out", older, 0);
+        }
+        unlink("order");
+        minimake m = minimake_init(NULL, NULL);
+        result[i] = mm_test_make(&m, makefile, "out");
+        mm_test_read_order(order[i], sizeof(order[i]));
+    }
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    int mid_deleted = stat("mid", &st) < 0;
+    mm_test_leave(&d);
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(result[i].ok);
+    }
+    ASSERT_STREQ(order[0], "mid\nout\n");
+    ASSERT_STREQ(order[1], "");
+    ASSERT_TRUE(strstr(output, "\"out\" is up to date") != NULL);
+    ASSERT_STREQ(order[2], "mid\nout\n");
+    ASSERT_TRUE(mid_deleted);
+}
+
+UTEST(normalized, comment_edit) {
+    /* an edit to a normalized dependency which only touches comments doesn't make the target again, and the
+    normalized versions are remembered, so the next build doesn't look at their content again */
+    const char* makefile = MM_TEST_RULE("a.o", "a.c") ".NORMALIZE_C: a.c\n";
+    const char* versions[] = { "int x;\n", "/* x */\nint x; // still x\n", "/* x */\nint x; // still x\n", "int y;\n" };
+    mm_test_dir d;
+    char order[4][64];
+    size_t n_remembered[4];
+    minimake_result result[4];
+    struct timespec made[2] = { { .tv_sec = 1000000010, .tv_nsec = 0 }, { .tv_sec = 1000000010, .tv_nsec = 0 } };
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    int saved = mm_test_capture();
+    for (int i = 0; i < 4; ++i) {
+        if (i != 2) {
+            /* each version is newer than the last, and than the target */
+            struct timespec edited[2] = { { .tv_sec = 1000000000 + 20 * i, .tv_nsec = 0 }, { .tv_sec = 1000000000 + 20 * i, .tv_nsec = 0 } };
+            FILE* file = fopen("a.c", "w");
+            fputs(versions[i], file);
+            fclose(file);
+            utimensat(AT_FDCWD, "a.c", edited, 0);
+        }
+        unlink("order");
+        minimake m = minimake_init(NULL, NULL);
+        result[i] = mm_test_make(&m, makefile, "a.o");
+        mm_test_read_order(order[i], sizeof(order[i]));
+        if (i == 0) {
+            utimensat(AT_FDCWD, "a.o", made, 0);
+        }
+        n_remembered[i] = 0;
+        FILE* file = fopen(MINIMAKE_STATE_DIR "/normalized", "r");
+        for (int c; file && (c = fgetc(file)) != EOF;) {
+            n_remembered[i] += c == '\n';
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    mm_test_leave(&d);
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(result[i].ok);
+    }
+    ASSERT_STREQ(order[0], "a.o\n");
+    ASSERT_STREQ(order[1], "");
+    ASSERT_STREQ(order[2], "");
+    ASSERT_STREQ(order[3], "a.o\n");
+    /* the first build remembers the version it was made from, the second the edited one, the third nothing new */
+    ASSERT_EQ(n_remembered[0], 1);
+    ASSERT_EQ(n_remembered[1], 2);
+    ASSERT_EQ(n_remembered[2], 2);
+}
+
+/* parses `makefile`, and cleans `target`, pruning empty directories, in the current directory */
+static minimake_result mm_test_clean(const char* makefile, const char* target) {
+    char* buffer = strdup(makefile);
     minimake m = minimake_init(NULL, NULL);
-    minimake_token* tokens = NULL;
-    size_t n_tokens = 0;
-    minimake_result result = minimake_tokenize(&m, makefile, &tokens, &n_tokens);
-    if (!result.ok) {
-        printf("error: %s\n", result.message);
+    minimake_result result = minimake_parse(&m, "Not A Real Makefile", buffer);
+    mm_sv* chain = NULL;
+    size_t chain_len = 0;
+    if (result.ok) {
+        result = minimake_resolve(&m, minimake_cstr_stringview(target), &chain, &chain_len);
+    }
+    if (result.ok) {
+        result = minimake_clean(&m, chain, chain_len, 1);
+    }
+    if (chain) {
+        m.free(chain);
     }
-    ASSERT_TRUE(result.ok);
-    ASSERT_EQ(n_tokens, 11);
-    ASSERT_EQ(tokens[0].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[1].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[2].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[3].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[4].type, MINIMAKE_TOK_COMMAND);
-    ASSERT_EQ(tokens[5].type, MINIMAKE_TOK_NEWLINE);
-    ASSERT_EQ(tokens[6].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[7].type, MINIMAKE_TOK_COLON);
-    ASSERT_EQ(tokens[8].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[9].type, MINIMAKE_TOK_WORD);
-    ASSERT_EQ(tokens[10].type, MINIMAKE_TOK_NEWLINE);
     minimake_free(&m);
+    free(buffer);
+    return result;
 }
 
-UTEST(resolve, simple_rule) {
-    minimake m = minimake_init(malloc, free);
+UTEST(clean, outputs) {
+    /* clean removes what rules with commands make, leaves sources alone, and prunes what's empty afterwards */
+    const char* makefile = "all: out/app lib/lib.a\n\ttouch all\n"
+                           "out/app: out/obj/a.o src.c\n\ttouch out/app\n"
+                           "out/obj/a.o: src.c\n\tmkdir -p out/obj\n\ttouch out/obj/a.o\n"
+                           "lib/lib.a: lib/x.h\n\ttouch lib/lib.a\n";
+    mm_test_dir d;
+    struct stat st;
+    ASSERT_EQ(mm_test_enter(&d, "src.c"), 0);
+    (void)!mkdir("lib", 0755);
+    close(open("lib/x.h", O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    int saved = mm_test_capture();
+    minimake m = minimake_init(NULL, NULL);
+    minimake_result built = mm_test_make(&m, makefile, "all");
+    int made = stat("out/obj/a.o", &st) == 0 && stat("out/app", &st) == 0 && stat("lib/lib.a", &st) == 0;
+    minimake_result cleaned = mm_test_clean(makefile, "all");
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    int out_gone = stat("out", &st) < 0;
+    int lib_kept = stat("lib/lib.a", &st) < 0 && stat("lib/x.h", &st) == 0;
+    int source_kept = stat("src.c", &st) == 0;
+    mm_test_leave(&d);
+    ASSERT_TRUE(built.ok);
+    ASSERT_TRUE(made);
+    ASSERT_TRUE(cleaned.ok);
+    ASSERT_TRUE(out_gone);
+    ASSERT_TRUE(lib_kept);
+    ASSERT_TRUE(source_kept);
+    ASSERT_TRUE(strstr(output, "rm out/obj/a.o\n") != NULL);
+    ASSERT_TRUE(strstr(output, "rmdir out/obj\n") != NULL);
+    ASSERT_TRUE(strstr(output, "rmdir out\n") != NULL);
+}
 
-    char* makefile = "simple_rule: test-dep\n"
-                     "\ttouch simple_rule\n"
-                     "test-dep: foo bar\n";
+UTEST(clean, directories) {
+    /* a target can be a directory, which goes once what's in it has gone, unless that's more than targets */
+    const char* makefile = "all: build/x.o notes\n\ttouch all\n"
+                           "build/x.o: build\n\ttouch build/x.o\n"
+                           "build:\n\tmkdir build\n"
+                           "notes:\n\tmkdir notes\n";
+    mm_test_dir d;
+    struct stat st;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    int saved = mm_test_capture();
+    minimake m = minimake_init(NULL, NULL);
+    minimake_result built = mm_test_make(&m, makefile, "all");
+    close(open("notes/mine", O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    minimake_result cleaned = mm_test_clean(makefile, "all");
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    int build_gone = stat("build", &st) < 0;
+    int notes_kept = stat("notes/mine", &st) == 0;
+    mm_test_leave(&d);
+    ASSERT_TRUE(built.ok);
+    ASSERT_TRUE(cleaned.ok);
+    ASSERT_TRUE(build_gone);
+    ASSERT_TRUE(notes_kept);
+    ASSERT_TRUE(strstr(output, "rm build\n") != NULL);
+    ASSERT_TRUE(strstr(output, "left notes in place, it isn't empty\n") != NULL);
+}
 
+UTEST(vpath, resolve) {
+    char makefile[] = "vpath %.h inc\n"
+                      "VPATH = src\n"
+                      "prog: a.c b.h c.h d.c gen.h missing.x\n"
+                      "\ttouch prog\n"
+                      "gen.h:\n"
+                      "\ttouch gen.h\n";
+    mm_test_dir d;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    int ok = mkdir("src", 0777) == 0 && mkdir("inc", 0777) == 0
+        && system("touch src/a.c src/b.h inc/b.h inc/c.h d.c src/d.c inc/gen.h") == 0;
+    minimake m = minimake_init(NULL, NULL);
     minimake_result result = minimake_parse(&m, "Not A Real Makefile", makefile);
+    mm_test_leave(&d);
+    ASSERT_TRUE(ok);
     ASSERT_TRUE(result.ok);
+    minimake_rule* prog = minimake_find_rule(&m, minimake_cstr_stringview("prog"));
+    ASSERT_TRUE(prog != NULL);
+    ASSERT_EQ(prog->n_dependencies, 6);
+    /* only in VPATH */
+    ASSERT_TRUE(mm_sv_eq(prog->dependencies[0], minimake_cstr_stringview("src/a.c")));
+    /* in both, but the matching vpath comes first */
+    ASSERT_TRUE(mm_sv_eq(prog->dependencies[1], minimake_cstr_stringview("inc/b.h")));
+    ASSERT_TRUE(mm_sv_eq(prog->dependencies[2], minimake_cstr_stringview("inc/c.h")));
+    /* where the makefile says it is, so not searched */
+    ASSERT_TRUE(mm_sv_eq(prog->dependencies[3], minimake_cstr_stringview("d.c")));
+    /* made by a rule */
+    ASSERT_TRUE(mm_sv_eq(prog->dependencies[4], minimake_cstr_stringview("gen.h")));
+    /* nowhere, which is for the build to complain about */
+    ASSERT_TRUE(mm_sv_eq(prog->dependencies[5], minimake_cstr_stringview("missing.x")));
+    minimake_free(&m);
+}
 
-    mm_sv* chain;
-    size_t chain_len;
-    result = minimake_resolve(&m, minimake_cstr_stringview("test-test"), &chain, &chain_len);
+UTEST(vpath, dir_cache) {
+    mm_test_dir d;
+    mm_dir_caches caches = { 0 };
+    int exists[4] = { -1, -1, -1, -1 };
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    int ok = mkdir("inc", 0777) == 0 && system("touch inc/a.h inc/b.h") == 0;
+    minimake m = minimake_init(NULL, NULL);
+    /* the first question about a directory is a stat, the next one lists it */
+    minimake_result result = minimake_dir_contains(&m, &caches, "inc/a.h", &exists[0]);
+    int listed_early = caches.n_dirs == 1 && caches.dirs[0].listed;
+    if (result.ok) {
+        result = minimake_dir_contains(&m, &caches, "inc/b.h", &exists[1]);
+    }
+    if (result.ok) {
+        result = minimake_dir_contains(&m, &caches, "inc/c.h", &exists[2]);
+    }
+    /* from then on, the listing answers, so a file created afterwards isn't seen */
+    ok &= system("touch inc/d.h") == 0;
+    if (result.ok) {
+        result = minimake_dir_contains(&m, &caches, "inc/d.h", &exists[3]);
+    }
+    size_t n_dirs = caches.n_dirs;
+    int listed = n_dirs == 1 && caches.dirs[0].listed;
+    minimake_free_dir_caches(&m, &caches);
+    mm_test_leave(&d);
+    ASSERT_TRUE(ok);
     ASSERT_TRUE(result.ok);
+    ASSERT_FALSE(listed_early);
+    ASSERT_TRUE(listed);
+    ASSERT_EQ(exists[0], 1);
+    ASSERT_EQ(exists[1], 1);
+    ASSERT_EQ(exists[2], 0);
+    ASSERT_EQ(exists[3], 0);
+}
 
-    minimake_free(&m);
+UTEST(scheduler, slots) {
+    /* a rule taking both of two slots never runs next to another job, and is told how many it got */
+    const char* makefile = "all: big small\n\ttouch all\n"
+                           "big:\n\techo big $$MINIMAKE_JOB_SLOTS >> order\n\tsleep 0.2\n\techo big >> order\n\ttouch big\n"
+                           "small:\n\techo small $$MINIMAKE_JOB_SLOTS >> order\n\tsleep 0.2\n\techo small >> order\n\ttouch small\n"
+                           ".SLOTS_2: big\n";
+    char order[256];
+    ASSERT_TRUE(mm_test_build(makefile, "", "all", 2, order, sizeof(order)).ok);
+    ASSERT_TRUE(strcmp(order, "big 2\nbig\nsmall 1\nsmall\n") == 0 || strcmp(order, "small 1\nsmall\nbig 2\nbig\n") == 0);
+}
+
+UTEST(scheduler, priorities) {
+    /* ready targets of a higher class go first, and what a target depends on gets its class, unless it has one */
+    const char* makefile = MM_TEST_RULE("all", "docs app") MM_TEST_RULE("docs", "b.o") MM_TEST_RULE("app", "a.o")
+        MM_TEST_RULE("a.o", "") MM_TEST_RULE("b.o", "");
+    char* prioritized = malloc(strlen(makefile) + 64);
+    char order[256];
+    sprintf(prioritized, "%s.PRIORITY_LOW: app\n.PRIORITY_HIGH: docs\n", makefile);
+    minimake_result plain = mm_test_build(makefile, "", "all", 1, order, sizeof(order));
+    ASSERT_TRUE(plain.ok);
+    ASSERT_STREQ(order, "a.o\nb.o\napp\ndocs\nall\n");
+    minimake_result result = mm_test_build(prioritized, "", "all", 1, order, sizeof(order));
+    free(prioritized);
+    ASSERT_TRUE(result.ok);
+    ASSERT_STREQ(order, "b.o\ndocs\na.o\napp\nall\n");
+}
+
+UTEST(scheduler, cancel) {
+    /* the first failure stops the jobs still running, right away, and deletes what they had half written. the
+    sleep replaces the shell, so no orphan is left for init to reap, which may take it a while */
+    const char* makefile = "all: slow bad\n\ttouch all\n"
+                           "slow:\n\ttouch slow\n\texec sleep 5\n"
+                           "bad:\n\tsleep 0.2\n\tfalse\n";
+    mm_test_dir d;
+    struct stat st;
+    struct timespec start, end;
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    minimake m = minimake_init(NULL, NULL);
+    m.max_jobs = 2;
+    int saved = mm_test_capture();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    minimake_result result = mm_test_make(&m, makefile, "all");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    int slow_deleted = stat("slow", &st) < 0;
+    mm_test_leave(&d);
+    ASSERT_FALSE(result.ok);
+    ASSERT_LT(mm_timespec_ms(&start, &end), 2000.0);
+    ASSERT_TRUE(strstr(output, "cancelling 1 running job\n") != NULL);
+    ASSERT_TRUE(slow_deleted);
+}
+
+UTEST(scheduler, keep_going) {
+    /* with -k, a failure only stops what depends on it */
+    const char* makefile = "all: a bad\n\ttouch all\nbad:\n\tfalse\n" MM_TEST_RULE("a", "");
+    mm_test_dir d;
+    char order[2][64];
+    minimake_result result[2];
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    int saved = mm_test_capture();
+    for (int keep_going = 0; keep_going < 2; ++keep_going) {
+        unlink("order");
+        minimake m = minimake_init(NULL, NULL);
+        m.keep_going = keep_going;
+        result[keep_going] = mm_test_make(&m, makefile, "all");
+        mm_test_read_order(order[keep_going], sizeof(order[keep_going]));
+    }
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    mm_test_leave(&d);
+    ASSERT_FALSE(result[0].ok);
+    ASSERT_STREQ(order[0], "");
+    ASSERT_FALSE(result[1].ok);
+    ASSERT_STREQ(order[1], "a\n");
+}
+
+UTEST(scheduler, timeout) {
+    /* a job over its timeout, set for all jobs or with .TIMEOUT_<n> for some, is stopped and fails the build */
+    const char* makefiles[] = { "hang:\n\texec sleep 5\n", "hang:\n\texec sleep 5\n.TIMEOUT_1: hang\n" };
+    mm_test_dir d;
+    struct timespec start, end;
+    minimake_result result[2];
+    double took_ms[2];
+    ASSERT_EQ(mm_test_enter(&d, ""), 0);
+    int saved = mm_test_capture();
+    for (int i = 0; i < 2; ++i) {
+        minimake m = minimake_init(NULL, NULL);
+        m.timeout_s = i == 0 ? 1 : 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result[i] = mm_test_make(&m, makefiles[i], "hang");
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        took_ms[i] = mm_timespec_ms(&start, &end);
+    }
+    char output[1024];
+    mm_test_captured(saved, output, sizeof(output));
+    mm_test_leave(&d);
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_FALSE(result[i].ok);
+        ASSERT_TRUE(strstr(result[i].message, "timed out after 1s") != NULL);
+        ASSERT_GE(took_ms[i], 1000.0);
+        ASSERT_LT(took_ms[i], 3000.0);
+    }
+    ASSERT_TRUE(strstr(output, "\"hang\" is over its timeout of 1s, stopping it\n") != NULL);
 }
 #endif
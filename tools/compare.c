@@ -0,0 +1,671 @@
+/*
+ * compare: runs minimake and GNU make side by side over a corpus of projects, and checks that they agree.
+ *
+ *     compare [-m make] [-r runs] [-c] [-k] <minimake> <syscount.so> [project directory...]
+ *
+ * Every minimake makefile is supposed to be a valid GNU makefile, which means the same makefile should make
+ * both tools run the same commands. For every project in the corpus (a few generated ones, plus the
+ * directories given, which are copied), both tools run, each in its own copy, these scenarios:
+ *   - full:  build the default target from scratch
+ *   - full-j4: the same, with 4 jobs at a time, in another copy
+ *   - noop:  build it again, which shouldn't run anything
+ *   - parse: ask (-q) whether a single source is up to date, which is little more than reading the makefile
+ * A full build has to run the same commands with both tools, and each tool has to run a target's commands
+ * after those of everything it depends on (the order of unrelated targets may differ). For every scenario,
+ * the wall time (the median of a few runs, for the quick ones), the libc calls counted by syscount.so,
+ * and the peak memory of the tool itself are reported.
+ *
+ * With -c, the page cache is dropped before every run (which takes root), so the tools start from a cold cache,
+ * as after a reboot or a checkout of a large tree.
+ *
+ * Exits with 1 if the tools disagree anywhere. The scratch directory is removed afterwards, unless -k is given.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 15
+
+typedef enum {
+    TOOL_MAKE,
+    TOOL_MINIMAKE,
+    N_TOOLS,
+} tool;
+
+static const char* tool_names[N_TOOLS] = { "make", "minimake" };
+static char tool_paths[N_TOOLS][PATH_MAX];
+static char syscount[PATH_MAX];
+/* -c: drop the page cache before every run */
+static int cold;
+
+/* a makefile, as far as we need to understand it: targets, their dependencies and commands */
+typedef struct {
+    char* target;
+    char** deps;
+    size_t n_deps;
+    char** commands;
+    size_t n_commands;
+} rule;
+
+typedef struct {
+    rule* rules;
+    size_t n_rules;
+} makefile;
+
+/* what one run of a tool did */
+typedef struct {
+    double wall_ms;
+    unsigned long calls;
+    unsigned long stats;
+    unsigned long spawns;
+    long maxrss_kb;
+    int status;
+    /* what it printed, one line per entry */
+    char** lines;
+    size_t n_lines;
+} run;
+
+static void* xalloc(size_t size) {
+    void* p = calloc(1, size ? size : 1);
+    if (!p) {
+        perror("compare");
+        exit(2);
+    }
+    return p;
+}
+
+static void* xgrow(void* p, size_t size) {
+    p = realloc(p, size ? size : 1);
+    if (!p) {
+        perror("compare");
+        exit(2);
+    }
+    return p;
+}
+
+static char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+    size_t capacity = 4096;
+    size_t len = 0;
+    char* data = xalloc(capacity);
+    for (size_t n; (n = fread(data + len, 1, capacity - len - 1, file)) > 0;) {
+        len += n;
+        if (capacity - len < 2) {
+            capacity *= 2;
+            data = xgrow(data, capacity);
+        }
+    }
+    fclose(file);
+    data[len] = 0;
+    if (size) {
+        *size = len;
+    }
+    return data;
+}
+
+static void write_file(const char* path, const char* data, size_t size) {
+    FILE* file = fopen(path, "w");
+    if (!file || fwrite(data, 1, size, file) != size || fclose(file) != 0) {
+        fprintf(stderr, "compare: can't write %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+}
+
+/* makes the directories on the way to `path` */
+static void make_parents(const char* path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char* slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = 0;
+        (void)mkdir(dir, 0777);
+        *slash = '/';
+    }
+}
+
+static char* trim(char* s) {
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    size_t len = strlen(s);
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r')) {
+        s[--len] = 0;
+    }
+    return s;
+}
+
+/* parses the minimake grammar; good enough for makefiles minimake accepts */
+static makefile parse_makefile(char* text) {
+    makefile mf = { 0 };
+    rule* current = NULL;
+    for (char* line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+        if (line[0] == '\t') {
+            if (current && *trim(line)) {
+                current->commands = xgrow(current->commands, sizeof(char*) * (current->n_commands + 1));
+                current->commands[current->n_commands++] = trim(line);
+            }
+            continue;
+        }
+        char* colon = strchr(line, ':');
+        if (line[0] == '#' || !colon) {
+            continue;
+        }
+        *colon = 0;
+        mf.rules = xgrow(mf.rules, sizeof(rule) * (mf.n_rules + 1));
+        current = &mf.rules[mf.n_rules++];
+        memset(current, 0, sizeof(*current));
+        current->target = trim(line);
+        /* strtok() is busy with the lines, so the dependencies are split by hand */
+        char* deps = colon + 1;
+        while (*deps) {
+            while (*deps == ' ' || *deps == '\t') {
+                ++deps;
+            }
+            if (!*deps) {
+                break;
+            }
+            char* end = deps;
+            while (*end && *end != ' ' && *end != '\t') {
+                ++end;
+            }
+            char saved = *end;
+            *end = 0;
+            current->deps = xgrow(current->deps, sizeof(char*) * (current->n_deps + 1));
+            current->deps[current->n_deps++] = strdup(deps);
+            *end = saved;
+            deps = end;
+        }
+    }
+    return mf;
+}
+
+/* the rule whose commands include `line`, or NULL */
+static rule* rule_of_command(makefile* mf, const char* line) {
+    for (size_t i = 0; i < mf->n_rules; ++i) {
+        for (size_t k = 0; k < mf->rules[i].n_commands; ++k) {
+            if (strcmp(mf->rules[i].commands[k], line) == 0) {
+                return &mf->rules[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* lines which aren't commands: make's own messages, and minimake's */
+static int is_chatter(const char* line) {
+    size_t len = strlen(line);
+    return strncmp(line, "make:", 5) == 0 || strncmp(line, "make[", 5) == 0
+        || (len > 14 && strcmp(line + len - 14, " is up to date") == 0);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* runs `argv` in `dir` with syscount.so preloaded, and collects what it did */
+static run run_tool(const char* dir, char** argv) {
+    char out[PATH_MAX];
+    char counts[PATH_MAX];
+    run r = { 0 };
+    snprintf(out, sizeof(out), "%s/../output", dir);
+    snprintf(counts, sizeof(counts), "%s/../counts", dir);
+    unlink(counts);
+    if (cold) {
+        sync();
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (fd < 0 || write(fd, "3", 1) != 1) {
+            perror("compare: dropping the page cache");
+            exit(2);
+        }
+        close(fd);
+    }
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0 || chdir(dir) < 0) {
+            _exit(127);
+        }
+        dup2(fd, 1);
+        dup2(fd, 2);
+        setenv("LD_PRELOAD", syscount, 1);
+        setenv("SYSCOUNT_OUT", counts, 1);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &r.status, 0) < 0) {
+        perror("compare");
+        exit(2);
+    }
+    r.wall_ms = now_ms() - start;
+    char* text = read_file(counts, NULL);
+    for (char* line = text ? strtok(text, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+        char kind[32];
+        long value;
+        if (sscanf(line, "%31s %ld", kind, &value) != 2) {
+            continue;
+        }
+        if (strcmp(kind, "maxrss") == 0) {
+            r.maxrss_kb = value;
+            continue;
+        }
+        r.calls += value;
+        if (strcmp(kind, "stat") == 0) {
+            r.stats = value;
+        } else if (strcmp(kind, "spawn") == 0) {
+            r.spawns = value;
+        }
+    }
+    free(text);
+    text = read_file(out, NULL);
+    for (char* line = text ? strtok(text, "\n") : NULL; line; line = strtok(NULL, "\n")) {
+        if (is_chatter(line)) {
+            continue;
+        }
+        r.lines = xgrow(r.lines, sizeof(char*) * (r.n_lines + 1));
+        r.lines[r.n_lines++] = strdup(line);
+    }
+    free(text);
+    return r;
+}
+
+static void free_run(run* r) {
+    for (size_t i = 0; i < r->n_lines; ++i) {
+        free(r->lines[i]);
+    }
+    free(r->lines);
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* whether both ran the same commands, ignoring order */
+static int same_commands(run* a, run* b) {
+    if (a->n_lines != b->n_lines) {
+        return 0;
+    }
+    char** x = xalloc(sizeof(char*) * a->n_lines);
+    char** y = xalloc(sizeof(char*) * b->n_lines);
+    memcpy(x, a->lines, sizeof(char*) * a->n_lines);
+    memcpy(y, b->lines, sizeof(char*) * b->n_lines);
+    qsort(x, a->n_lines, sizeof(char*), compare_strings);
+    qsort(y, b->n_lines, sizeof(char*), compare_strings);
+    int same = 1;
+    for (size_t i = 0; same && i < a->n_lines; ++i) {
+        same = strcmp(x[i], y[i]) == 0;
+    }
+    free(x);
+    free(y);
+    return same;
+}
+
+/* checks that every target's commands ran after the commands of everything it depends on */
+static int check_order(makefile* mf, run* r, const char* name) {
+    int ok = 1;
+    for (size_t i = 0; i < r->n_lines; ++i) {
+        rule* target = rule_of_command(mf, r->lines[i]);
+        for (size_t k = 0; target && k < target->n_deps; ++k) {
+            for (size_t j = i + 1; j < r->n_lines; ++j) {
+                rule* later = rule_of_command(mf, r->lines[j]);
+                if (later && strcmp(later->target, target->deps[k]) == 0) {
+                    printf("  %s ran \"%s\" (for %s) before \"%s\" (for %s, which it depends on)\n", name, r->lines[i],
+                        target->target, r->lines[j], later->target);
+                    ok = 0;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+static void print_row(const char* project, const char* scenario, tool t, run* r, double wall_ms) {
+    printf("%-14s %-7s %-9s %10.1f %10lu %8lu %8lu %10ld\n", project, scenario, tool_names[t], wall_ms, r->calls, r->stats,
+        r->spawns, r->maxrss_kb);
+}
+
+/* runs a shell command, formatted like printf() */
+static void run_command(const char* format, ...) {
+    char* command;
+    va_list ap;
+    va_start(ap, format);
+    int len = vasprintf(&command, format, ap);
+    va_end(ap);
+    if (len < 0 || system(command) != 0) {
+        fprintf(stderr, "compare: \"%s\" failed\n", len < 0 ? format : command);
+        exit(2);
+    }
+    free(command);
+}
+
+/*
+ * builds the project from scratch with both tools, each in its own copy of `source` (in `dirs`), with `argv`
+ * (whose first entry is filled in with the tool); returns whether they agree
+ */
+static int compare_full_build(makefile* mf, const char* scratch, const char* name, const char* source, const char* scenario,
+    char** argv, char dirs[N_TOOLS][PATH_MAX]) {
+    int ok = 1;
+    run full[N_TOOLS];
+    for (tool t = 0; t < N_TOOLS; ++t) {
+        snprintf(dirs[t], PATH_MAX, "%s/%s/%s/%s", scratch, name, scenario, tool_names[t]);
+        run_command("mkdir -p '%s' && cp -R '%s/.' '%s'", dirs[t], source, dirs[t]);
+    }
+    for (tool t = 0; t < N_TOOLS; ++t) {
+        argv[0] = tool_paths[t];
+        full[t] = run_tool(dirs[t], argv);
+        print_row(name, scenario, t, &full[t], full[t].wall_ms);
+        if (full[t].status != 0) {
+            printf("  %s failed:\n", tool_names[t]);
+            for (size_t i = 0; i < full[t].n_lines; ++i) {
+                printf("    %s\n", full[t].lines[i]);
+            }
+            ok = 0;
+        }
+        ok &= check_order(mf, &full[t], tool_names[t]);
+    }
+    if (!same_commands(&full[TOOL_MAKE], &full[TOOL_MINIMAKE])) {
+        printf("  make and minimake ran different commands in %s (%zu and %zu lines)\n", scenario, full[TOOL_MAKE].n_lines,
+            full[TOOL_MINIMAKE].n_lines);
+        ok = 0;
+    }
+    for (tool t = 0; t < N_TOOLS; ++t) {
+        free_run(&full[t]);
+    }
+    return ok;
+}
+
+/* runs every scenario for the project in `source` with both tools; returns whether they agree */
+static int compare_project(const char* scratch, const char* name, const char* source, const char* leaf, int runs) {
+    char dirs[N_TOOLS][PATH_MAX];
+    char parallel_dirs[N_TOOLS][PATH_MAX];
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/Makefile", source);
+    char* text = read_file(path, NULL);
+    if (!text) {
+        fprintf(stderr, "compare: no Makefile in %s\n", source);
+        return 0;
+    }
+    makefile mf = parse_makefile(text);
+    char* build[] = { NULL, NULL };
+    char* parallel[] = { NULL, "-j4", NULL };
+    char* question[] = { NULL, "-q", (char*)leaf, NULL };
+    int ok = compare_full_build(&mf, scratch, name, source, "full", build, dirs);
+    /* in parallel, the commands of unrelated targets interleave, which the order check allows for */
+    ok &= compare_full_build(&mf, scratch, name, source, "full-j4", parallel, parallel_dirs);
+
+    const char* scenarios[] = { "noop", "parse" };
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(*scenarios); ++s) {
+        for (tool t = 0; t < N_TOOLS; ++t) {
+            double wall[MAX_RUNS];
+            run r = { 0 };
+            char** argv = s == 0 ? build : question;
+            argv[0] = tool_paths[t];
+            for (int i = 0; i < runs; ++i) {
+                free_run(&r);
+                r = run_tool(dirs[t], argv);
+                wall[i] = r.wall_ms;
+            }
+            qsort(wall, runs, sizeof(double), compare_doubles);
+            print_row(name, scenarios[s], t, &r, wall[runs / 2]);
+            if (r.status != 0 || r.n_lines != 0) {
+                printf("  %s %s: expected nothing to do, got exit status %d and %zu lines of output\n", tool_names[t],
+                    scenarios[s], WIFEXITED(r.status) ? WEXITSTATUS(r.status) : -1, r.n_lines);
+                ok = 0;
+            }
+            free_run(&r);
+        }
+    }
+    free(text);
+    return ok;
+}
+
+/*
+ * The generated part of the corpus, each in the shape of a common kind of project. Commands only copy and
+ * concatenate files, so what's measured is the tools, not the commands.
+ */
+static void generate(const char* dir, const char* kind) {
+    char path[PATH_MAX + 64];
+    size_t capacity = 1 << 20;
+    size_t len = 0;
+    char* mf = xalloc(capacity);
+#define EMIT(...)                                                         \
+    do {                                                                  \
+        if (capacity - len < 4096) {                                      \
+            capacity *= 2;                                                \
+            mf = xgrow(mf, capacity);                                     \
+        }                                                                 \
+        len += snprintf(mf + len, capacity - len, __VA_ARGS__);           \
+    } while (0)
+#define SOURCE(...)                                                       \
+    do {                                                                  \
+        snprintf(path, sizeof(path), __VA_ARGS__);                        \
+        make_parents(path);                                               \
+        write_file(path, "x\n", 2);                                       \
+    } while (0)
+
+    if (strcmp(kind, "wide") == 0) {
+        /* one program of many objects, all including a few common headers. minimake rules have at most 64
+        dependencies, so the objects are grouped into partial links first */
+        EMIT("app: obj/part0.o obj/part1.o obj/part2.o obj/part3.o obj/part4.o obj/part5.o obj/part6.o obj/part7.o\n");
+        EMIT("\tcat obj/part0.o obj/part7.o > app\n\n");
+        for (int p = 0; p < 8; ++p) {
+            EMIT("obj/part%d.o:", p);
+            for (int i = p * 60; i < (p + 1) * 60; ++i) {
+                EMIT(" obj/f%d.o", i);
+            }
+            EMIT("\n\tcat obj/f%d.o > obj/part%d.o\n\n", p * 60, p);
+        }
+        for (int i = 0; i < 480; ++i) {
+            EMIT("obj/f%d.o: src/f%d.c include/a.h include/b.h include/c.h\n\tcat src/f%d.c include/a.h > obj/f%d.o\n\n", i, i, i, i);
+            SOURCE("%s/src/f%d.c", dir, i);
+        }
+        SOURCE("%s/include/a.h", dir);
+        SOURCE("%s/include/b.h", dir);
+        SOURCE("%s/include/c.h", dir);
+        SOURCE("%s/obj/.keep", dir);
+    } else if (strcmp(kind, "deep") == 0) {
+        /* a long chain of generated files, each made from the one before */
+        EMIT("out199: out198\n\tcp out198 out199\n\n");
+        for (int i = 198; i > 0; --i) {
+            EMIT("out%d: out%d\n\tcp out%d out%d\n\n", i, i - 1, i - 1, i);
+        }
+        EMIT("out0: seed\n\tcp seed out0\n\n");
+        SOURCE("%s/seed", dir);
+    } else if (strcmp(kind, "libraries") == 0) {
+        /* a program made of libraries, each with its own objects and headers, the later using the earlier */
+        EMIT("app: main.o");
+        for (int l = 0; l < 10; ++l) {
+            EMIT(" lib%d.a", l);
+        }
+        EMIT("\n\tcat main.o lib0.a > app\n\nmain.o: main.c lib9/api.h\n\tcp main.c main.o\n\n");
+        SOURCE("%s/main.c", dir);
+        for (int l = 0; l < 10; ++l) {
+            EMIT("lib%d.a:", l);
+            for (int i = 0; i < 30; ++i) {
+                EMIT(" lib%d/o%d.o", l, i);
+            }
+            EMIT("\n\tcat lib%d/o0.o > lib%d.a\n\n", l, l);
+            for (int i = 0; i < 30; ++i) {
+                EMIT("lib%d/o%d.o: lib%d/s%d.c lib%d/api.h%s", l, i, l, i, l, l > 0 ? "" : "\n");
+                if (l > 0) {
+                    EMIT(" lib%d/api.h\n", l - 1);
+                }
+                EMIT("\tcp lib%d/s%d.c lib%d/o%d.o\n\n", l, i, l, i);
+                SOURCE("%s/lib%d/s%d.c", dir, l, i);
+            }
+            SOURCE("%s/lib%d/api.h", dir, l);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/Makefile", dir);
+    write_file(path, mf, len);
+    free(mf);
+#undef EMIT
+#undef SOURCE
+}
+
+/* copies the makefile in `source`, and the sources it names (which have no rule, and exist), to `dir` */
+static void copy_project(const char* source, const char* dir) {
+    char from[PATH_MAX + 32];
+    char to[PATH_MAX + 32];
+    snprintf(from, sizeof(from), "%s/Makefile", source);
+    char* text = read_file(from, NULL);
+    if (!text) {
+        fprintf(stderr, "compare: no Makefile in %s\n", source);
+        exit(2);
+    }
+    run_command("mkdir -p '%s' && cp '%s' '%s/Makefile'", dir, from, dir);
+    makefile mf = parse_makefile(text);
+    for (size_t i = 0; i < mf.n_rules; ++i) {
+        for (size_t k = 0; k < mf.rules[i].n_deps; ++k) {
+            struct stat st;
+            int has_rule = 0;
+            for (size_t j = 0; j < mf.n_rules; ++j) {
+                has_rule |= strcmp(mf.rules[j].target, mf.rules[i].deps[k]) == 0;
+            }
+            snprintf(from, sizeof(from), "%s/%s", source, mf.rules[i].deps[k]);
+            if (has_rule || stat(from, &st) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            snprintf(to, sizeof(to), "%s/%s", dir, mf.rules[i].deps[k]);
+            make_parents(to);
+            run_command("cp -p '%s' '%s'", from, to);
+        }
+    }
+    free(text);
+}
+
+/* a dependency which has no rule, so it's a source */
+static const char* find_leaf(const char* dir) {
+    static char leaf[PATH_MAX];
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/Makefile", dir);
+    char* text = read_file(path, NULL);
+    makefile mf = parse_makefile(text);
+    leaf[0] = 0;
+    for (size_t i = 0; i < mf.n_rules && !leaf[0]; ++i) {
+        for (size_t k = 0; k < mf.rules[i].n_deps && !leaf[0]; ++k) {
+            int has_rule = 0;
+            for (size_t j = 0; j < mf.n_rules; ++j) {
+                has_rule |= strcmp(mf.rules[j].target, mf.rules[i].deps[k]) == 0;
+            }
+            if (!has_rule) {
+                snprintf(leaf, sizeof(leaf), "%s", mf.rules[i].deps[k]);
+            }
+        }
+    }
+    free(text);
+    return leaf;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: compare [-m make] [-r runs] [-c] [-k] <minimake> <syscount.so> [project directory...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    const char* make = "make";
+    int runs = 5;
+    int keep = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:r:ck")) != -1) {
+        switch (opt) {
+        case 'm':
+            make = optarg;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS) {
+                usage();
+            }
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
+    }
+    /* the tools run in other directories, so everything needs an absolute path */
+    if (!realpath(argv[optind], tool_paths[TOOL_MINIMAKE]) || !realpath(argv[optind + 1], syscount)) {
+        fprintf(stderr, "compare: %s: %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+    snprintf(tool_paths[TOOL_MAKE], sizeof(tool_paths[TOOL_MAKE]), "%s", make);
+    if (!strchr(make, '/')) {
+        /* look it up in PATH, since execv() doesn't */
+        char* path = strdup(getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+        tool_paths[TOOL_MAKE][0] = 0;
+        for (char* dir = strtok(path, ":"); dir && !tool_paths[TOOL_MAKE][0]; dir = strtok(NULL, ":")) {
+            char candidate[PATH_MAX];
+            snprintf(candidate, sizeof(candidate), "%s/%s", dir, make);
+            if (access(candidate, X_OK) == 0) {
+                snprintf(tool_paths[TOOL_MAKE], sizeof(tool_paths[TOOL_MAKE]), "%s", candidate);
+            }
+        }
+        free(path);
+        if (!tool_paths[TOOL_MAKE][0]) {
+            fprintf(stderr, "compare: can't find %s\n", make);
+            return 2;
+        }
+    }
+    /* when run by a make, don't let the inner make think it's part of that build */
+    unsetenv("MAKEFLAGS");
+    unsetenv("MFLAGS");
+    unsetenv("MAKELEVEL");
+
+    char scratch[] = "/tmp/minimake-compare-XXXXXX";
+    if (!mkdtemp(scratch)) {
+        perror("compare");
+        return 2;
+    }
+    printf("%-14s %-7s %-9s %10s %10s %8s %8s %10s\n", "project", "what", "tool", "wall ms", "libc calls", "stats", "spawns", "maxrss kB");
+    int ok = 1;
+    const char* generated[] = { "wide", "deep", "libraries" };
+    for (size_t i = 0; i < sizeof(generated) / sizeof(*generated); ++i) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/corpus/%s", scratch, generated[i]);
+        make_parents(dir);
+        mkdir(dir, 0777);
+        generate(dir, generated[i]);
+        ok &= compare_project(scratch, generated[i], dir, find_leaf(dir), runs);
+    }
+    for (int i = optind + 2; i < argc; ++i) {
+        char dir[PATH_MAX];
+        char name[32];
+        snprintf(name, sizeof(name), "project%d", i - optind - 1);
+        snprintf(dir, sizeof(dir), "%s/corpus/%s", scratch, name);
+        copy_project(argv[i], dir);
+        ok &= compare_project(scratch, name, dir, find_leaf(dir), runs);
+    }
+    if (!keep) {
+        run_command("rm -rf '%s'", scratch);
+    } else {
+        printf("scratch directory: %s\n", scratch);
+    }
+    printf(ok ? "make and minimake agree\n" : "make and minimake DISAGREE\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+/*
+ * syscount: counts the system calls a process makes through libc, from inside the process.
+ *
+ * Build it as a shared library and preload it:
+ *     cc -shared -fPIC -o syscount.so syscount.c -ldl
+ *     LD_PRELOAD=./syscount.so SYSCOUNT_OUT=counts.txt make
+ * When the process exits, a line "<kind> <count>" per kind of call, and "maxrss <kB>", is appended to
+ * SYSCOUNT_OUT. Only the process it's preloaded into is counted, not what that process runs: the variables
+ * are removed from the environment right away, so children don't inherit them.
+ *
+ * Calls libc makes internally (say, fopen() opening the file) don't go through these wrappers, so this counts
+ * what a program asks libc for, which is close to, but not exactly, what strace would show.
+ *
+ * No libc headers declaring the wrapped functions are included, so the wrappers don't have to match their
+ * exact prototypes (and _FORTIFY_SOURCE can't turn them into inline functions); pointers are just void*.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <linux/fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/resource.h>
+
+/* without sys/types.h, which would declare select() */
+typedef long sc_ssize_t;
+typedef long sc_off_t;
+typedef int sc_pid_t;
+
+extern char* getenv(const char* name);
+extern int unsetenv(const char* name);
+extern int snprintf(char* buffer, size_t size, const char* format, ...);
+
+typedef enum {
+    SC_STAT,
+    SC_OPEN,
+    SC_CLOSE,
+    SC_READ,
+    SC_WRITE,
+    SC_DIR,
+    SC_SPAWN,
+    SC_WAIT,
+    SC_POLL,
+    SC_FS,
+    SC_KINDS,
+} sc_kind;
+
+static const char* sc_kind_names[] = { "stat", "open", "close", "read", "write", "dir", "spawn", "wait", "poll", "fs" };
+
+static unsigned long sc_counts[SC_KINDS];
+static char sc_out[4096];
+
+/* wraps a function with a fixed argument list */
+#define SC_WRAP(kind, ret, name, params, args)                  \
+    ret name params {                                           \
+        static ret(*real) params;                               \
+        if (!real) {                                            \
+            real = (ret(*) params)dlsym(RTLD_NEXT, #name);      \
+        }                                                       \
+        __atomic_fetch_add(&sc_counts[kind], 1, __ATOMIC_RELAXED); \
+        return real args;                                       \
+    }
+
+/* wraps open() and friends, whose mode is only passed when a file may be created */
+#define SC_WRAP_OPEN(name, params, args)                        \
+    int name params {                                           \
+        static int(*real) params;                               \
+        if (!real) {                                            \
+            real = (int(*) params)dlsym(RTLD_NEXT, #name);      \
+        }                                                       \
+        unsigned mode = 0;                                      \
+        if (flags & (O_CREAT | O_TMPFILE)) {                    \
+            va_list ap;                                         \
+            va_start(ap, flags);                                \
+            mode = va_arg(ap, unsigned);                        \
+            va_end(ap);                                         \
+        }                                                       \
+        __atomic_fetch_add(&sc_counts[SC_OPEN], 1, __ATOMIC_RELAXED); \
+        return real args;                                       \
+    }
+
+SC_WRAP(SC_STAT, int, stat, (const char* path, void* st), (path, st))
+SC_WRAP(SC_STAT, int, stat64, (const char* path, void* st), (path, st))
+SC_WRAP(SC_STAT, int, lstat, (const char* path, void* st), (path, st))
+SC_WRAP(SC_STAT, int, lstat64, (const char* path, void* st), (path, st))
+SC_WRAP(SC_STAT, int, fstat, (int fd, void* st), (fd, st))
+SC_WRAP(SC_STAT, int, fstat64, (int fd, void* st), (fd, st))
+SC_WRAP(SC_STAT, int, fstatat, (int dirfd, const char* path, void* st, int flags), (dirfd, path, st, flags))
+SC_WRAP(SC_STAT, int, fstatat64, (int dirfd, const char* path, void* st, int flags), (dirfd, path, st, flags))
+SC_WRAP(SC_STAT, int, statx, (int dirfd, const char* path, int flags, unsigned mask, void* st), (dirfd, path, flags, mask, st))
+/* what older glibc versions compiled stat() calls to */
+SC_WRAP(SC_STAT, int, __xstat, (int ver, const char* path, void* st), (ver, path, st))
+SC_WRAP(SC_STAT, int, __xstat64, (int ver, const char* path, void* st), (ver, path, st))
+SC_WRAP(SC_STAT, int, __lxstat, (int ver, const char* path, void* st), (ver, path, st))
+SC_WRAP(SC_STAT, int, __lxstat64, (int ver, const char* path, void* st), (ver, path, st))
+SC_WRAP(SC_STAT, int, __fxstat, (int ver, int fd, void* st), (ver, fd, st))
+SC_WRAP(SC_STAT, int, __fxstat64, (int ver, int fd, void* st), (ver, fd, st))
+SC_WRAP(SC_STAT, int, __fxstatat, (int ver, int dirfd, const char* path, void* st, int flags), (ver, dirfd, path, st, flags))
+SC_WRAP(SC_STAT, int, __fxstatat64, (int ver, int dirfd, const char* path, void* st, int flags), (ver, dirfd, path, st, flags))
+SC_WRAP(SC_STAT, int, access, (const char* path, int mode), (path, mode))
+SC_WRAP(SC_STAT, int, faccessat, (int dirfd, const char* path, int mode, int flags), (dirfd, path, mode, flags))
+
+SC_WRAP_OPEN(open, (const char* path, int flags, ...), (path, flags, mode))
+SC_WRAP_OPEN(open64, (const char* path, int flags, ...), (path, flags, mode))
+SC_WRAP_OPEN(openat, (int dirfd, const char* path, int flags, ...), (dirfd, path, flags, mode))
+SC_WRAP_OPEN(openat64, (int dirfd, const char* path, int flags, ...), (dirfd, path, flags, mode))
+SC_WRAP(SC_OPEN, void*, fopen, (const char* path, const char* mode), (path, mode))
+SC_WRAP(SC_OPEN, void*, fopen64, (const char* path, const char* mode), (path, mode))
+
+SC_WRAP(SC_CLOSE, int, close, (int fd), (fd))
+SC_WRAP(SC_CLOSE, int, fclose, (void* file), (file))
+SC_WRAP(SC_READ, sc_ssize_t, read, (int fd, void* buffer, size_t size), (fd, buffer, size))
+SC_WRAP(SC_READ, sc_ssize_t, pread, (int fd, void* buffer, size_t size, sc_off_t offset), (fd, buffer, size, offset))
+SC_WRAP(SC_READ, size_t, fread, (void* buffer, size_t size, size_t n, void* file), (buffer, size, n, file))
+SC_WRAP(SC_WRITE, sc_ssize_t, write, (int fd, const void* buffer, size_t size), (fd, buffer, size))
+SC_WRAP(SC_WRITE, sc_ssize_t, pwrite, (int fd, const void* buffer, size_t size, sc_off_t offset), (fd, buffer, size, offset))
+
+SC_WRAP(SC_DIR, void*, opendir, (const char* path), (path))
+SC_WRAP(SC_DIR, void*, fdopendir, (int fd), (fd))
+SC_WRAP(SC_DIR, void*, readdir, (void* dir), (dir))
+SC_WRAP(SC_DIR, void*, readdir64, (void* dir), (dir))
+
+SC_WRAP(SC_SPAWN, sc_pid_t, fork, (void), ())
+SC_WRAP(SC_SPAWN, sc_pid_t, vfork, (void), ())
+SC_WRAP(SC_SPAWN, int, posix_spawn, (sc_pid_t * pid, const char* path, const void* actions, const void* attr, char* const* argv, char* const* envp), (pid, path, actions, attr, argv, envp))
+SC_WRAP(SC_SPAWN, int, posix_spawnp, (sc_pid_t * pid, const char* file, const void* actions, const void* attr, char* const* argv, char* const* envp), (pid, file, actions, attr, argv, envp))
+SC_WRAP(SC_SPAWN, int, system, (const char* command), (command))
+SC_WRAP(SC_WAIT, sc_pid_t, wait, (int* status), (status))
+SC_WRAP(SC_WAIT, sc_pid_t, waitpid, (sc_pid_t pid, int* status, int options), (pid, status, options))
+SC_WRAP(SC_WAIT, sc_pid_t, wait3, (int* status, int options, void* usage), (status, options, usage))
+SC_WRAP(SC_WAIT, sc_pid_t, wait4, (sc_pid_t pid, int* status, int options, void* usage), (pid, status, options, usage))
+SC_WRAP(SC_WAIT, int, waitid, (int idtype, int id, void* info, int options), (idtype, id, info, options))
+SC_WRAP(SC_POLL, int, poll, (void* fds, unsigned long n, int timeout), (fds, n, timeout))
+SC_WRAP(SC_POLL, int, ppoll, (void* fds, unsigned long n, const void* timeout, const void* sigmask), (fds, n, timeout, sigmask))
+SC_WRAP(SC_POLL, int, select, (int n, void* r, void* w, void* e, void* timeout), (n, r, w, e, timeout))
+SC_WRAP(SC_POLL, int, pselect, (int n, void* r, void* w, void* e, const void* timeout, const void* sigmask), (n, r, w, e, timeout, sigmask))
+
+SC_WRAP(SC_FS, int, unlink, (const char* path), (path))
+SC_WRAP(SC_FS, int, unlinkat, (int dirfd, const char* path, int flags), (dirfd, path, flags))
+SC_WRAP(SC_FS, int, mkdir, (const char* path, unsigned mode), (path, mode))
+SC_WRAP(SC_FS, int, rmdir, (const char* path), (path))
+SC_WRAP(SC_FS, sc_ssize_t, readlink, (const char* path, char* buffer, size_t size), (path, buffer, size))
+SC_WRAP(SC_FS, int, symlink, (const char* target, const char* path), (target, path))
+SC_WRAP(SC_FS, int, utimensat, (int dirfd, const char* path, const void* times, int flags), (dirfd, path, times, flags))
+SC_WRAP(SC_FS, int, futimens, (int fd, const void* times), (fd, times))
+SC_WRAP(SC_FS, int, fcntl, (int fd, int cmd, void* arg), (fd, cmd, arg))
+
+__attribute__((constructor)) static void sc_start(void) {
+    const char* out = getenv("SYSCOUNT_OUT");
+    if (out) {
+        snprintf(sc_out, sizeof(sc_out), "%s", out);
+    }
+    unsetenv("SYSCOUNT_OUT");
+    unsetenv("LD_PRELOAD");
+}
+
+__attribute__((destructor)) static void sc_report(void) {
+    char report[1024];
+    if (!sc_out[0]) {
+        return;
+    }
+    /* the real functions, so reporting doesn't count itself */
+    int (*real_open)(const char*, int, ...) = (int (*)(const char*, int, ...))dlsym(RTLD_NEXT, "open");
+    sc_ssize_t (*real_write)(int, const void*, size_t) = (sc_ssize_t(*)(int, const void*, size_t))dlsym(RTLD_NEXT, "write");
+    int (*real_close)(int) = (int (*)(int))dlsym(RTLD_NEXT, "close");
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    int len = 0;
+    for (int kind = 0; kind < SC_KINDS; ++kind) {
+        len += snprintf(report + len, sizeof(report) - len, "%s %lu\n", sc_kind_names[kind], sc_counts[kind]);
+    }
+    len += snprintf(report + len, sizeof(report) - len, "maxrss %ld\n", usage.ru_maxrss);
+    int fd = real_open(sc_out, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        (void)!real_write(fd, report, len);
+        real_close(fd);
+    }
+}